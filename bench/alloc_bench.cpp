@@ -0,0 +1,166 @@
+// Allocation regression benchmark: counts the heap allocations the server's reactor thread makes while relaying chat messages.
+// A steady-state relay is expected to make none: ./alloc_bench [receivers_n] [messages_n] [--io-backend=<epoll|io_uring>]
+#include "../src/server/server.h"
+#include "bench_client.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+static std::atomic_uint64_t reactor_allocations_n = 0;
+static thread_local bool count_allocations = false; // set on the reactor thread only
+
+static void* CountedAllocate(size_t size){
+    if (count_allocations){
+        reactor_allocations_n.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr){
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size){
+    return CountedAllocate(size);
+}
+void* operator new[](size_t size){
+    return CountedAllocate(size);
+}
+void operator delete(void* ptr) noexcept{
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept{
+    free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept{
+    free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept{
+    free(ptr);
+}
+
+#define BENCH_BATCH 64 // messages sent before waiting for every receiver to get them
+#define BENCH_WARMUP_MESSAGES 2000 // relayed before counting: fills the packet pool, the arena and the queues
+#define BENCH_BATCH_TIMEOUT_MS 10000 // a batch that hasn't reached every receiver by then fails the benchmark
+
+static const std::string_view BENCH_SENDER_NICKNAME = "bench-sender";
+static const std::string_view BENCH_MESSAGE = "The quick brown fox jumps over the lazy dog";
+
+// Count the relayed chat messages arriving on a client socket until it's closed.
+static void ReceiveMessages(int socketfd, std::atomic_uint64_t& received_n){
+    const std::string expected = "["s + std::string(BENCH_SENDER_NICKNAME) + "] "s + std::string(BENCH_MESSAGE);
+    FrameDecoder decoder;
+    decoder.SetVersion(ProtocolVersion::V2);
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    Frame frame;
+    while (true){
+        ssize_t recv_bytes = recv(socketfd, buffer.data(), buffer.size(), 0);
+        if (recv_bytes <= 0){
+            return;
+        }
+        decoder.Feed(buffer.data(), recv_bytes);
+        while (decoder.NextFrame(frame) == 1){
+            if (frame.opcode == Opcode::MESSAGE && frame.payload == expected){
+                received_n.fetch_add(1, std::memory_order_release);
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]){
+    size_t receivers_n = argc > 1 ? std::stoul(argv[1]) : 8;
+    size_t messages_n = argc > 2 ? std::stoul(argv[2]) : 20000;
+    ServerConfig config;
+    config.heartbeat_interval_ms = 0; // the receivers don't answer pings
+    config.chat_limit = config.command_limit = config.bytes_limit = RateLimit{0, 0}; // the sender floods on purpose
+    if (argc > 3 && std::string_view(argv[3]).substr(0, 13) == "--io-backend="){
+        config.io_backend = std::string(argv[3] + 13);
+    }
+
+    std::string port = PickFreePort();
+    std::string hostname = "127.0.0.1"s;
+    freopen("/dev/null", "w", stdout); // the server echoes every relayed message
+    Server server(hostname.data(), port.data(), config);
+    std::thread reactor_thread([&server](){
+        count_allocations = true;
+        server.Start();
+    });
+
+    int sender_socketfd = ConnectClient(port, BENCH_SENDER_NICKNAME);
+    std::vector<int> client_sockets{sender_socketfd};
+    for (size_t i = 0; i < receivers_n; ++i){
+        client_sockets.push_back(ConnectClient(port, "bench-receiver-"s + std::to_string(i)));
+    }
+    std::vector<std::atomic_uint64_t> received_n(client_sockets.size());
+    std::vector<std::thread> receiver_threads;
+    for (size_t i = 0; i < client_sockets.size(); ++i){
+        receiver_threads.emplace_back(ReceiveMessages, client_sockets[i], std::ref(received_n[i]));
+    }
+
+    // Closed loop: a batch is sent only after everybody has received the previous one, so no queue ever overflows.
+    const std::string frame = AssembleFrame(ProtocolVersion::V2, Opcode::MESSAGE, BENCH_MESSAGE);
+    const std::string batch = [&frame](){
+        std::string batch;
+        for (size_t i = 0; i < BENCH_BATCH; ++i){
+            batch.append(frame);
+        }
+        return batch;
+    }();
+    uint64_t sent_n = 0;
+    // @return false if a batch hasn't been relayed to everybody in time
+    auto relay = [&](size_t n){
+        for (size_t relayed_n = 0; relayed_n < n; relayed_n += BENCH_BATCH){
+            if (__SendAllBytes__(sender_socketfd, batch.data(), batch.size()) == -1){
+                throw std::runtime_error("send(): "s + std::string(strerror(errno)));
+            }
+            sent_n += BENCH_BATCH;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(BENCH_BATCH_TIMEOUT_MS);
+            for (const std::atomic_uint64_t& client_received_n : received_n){
+                while (client_received_n.load(std::memory_order_acquire) < sent_n){
+                    if (std::chrono::steady_clock::now() >= deadline){
+                        return false;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+        }
+        return true;
+    };
+
+    bool relayed = relay(BENCH_WARMUP_MESSAGES);
+    std::this_thread::sleep_for(std::chrono::milliseconds(EVENT_WAIT_TIMEOUT * 2)); // let the reactor finish its tick
+    uint64_t allocations_before = reactor_allocations_n.load();
+    uint64_t measured_before = sent_n;
+    auto started_at = std::chrono::steady_clock::now();
+    relayed = relayed && relay(messages_n);
+    auto elapsed = std::chrono::steady_clock::now() - started_at;
+    std::this_thread::sleep_for(std::chrono::milliseconds(EVENT_WAIT_TIMEOUT * 2));
+    uint64_t allocations = reactor_allocations_n.load() - allocations_before;
+    uint64_t relayed_n = sent_n - measured_before;
+
+    EXIT_SIGNAL = 1;
+    reactor_thread.join();
+    for (int socketfd : client_sockets){
+        close(socketfd);
+    }
+    for (std::thread& receiver_thread : receiver_threads){
+        receiver_thread.join();
+    }
+
+    if (!relayed){
+        std::cerr << MakeColorfulText("[AllocBench] FAIL: a batch hasn't reached every receiver within "s + std::to_string(BENCH_BATCH_TIMEOUT_MS) + " ms."s, Color::Red) << '\n';
+        return 2;
+    }
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cerr << "[AllocBench] relayed "s << relayed_n << " messages to "s << client_sockets.size() << " clients in "s << seconds << " s ("s
+              << static_cast<uint64_t>(relayed_n / seconds) << " msg/s)\n"s;
+    std::cerr << "[AllocBench] reactor allocations: "s << allocations << " ("s << static_cast<double>(allocations) / relayed_n << " per relayed message, "s
+              << allocations_before << " during the start-up and the warm-up)\n"s;
+    if (allocations != 0){
+        std::cerr << MakeColorfulText("[AllocBench] FAIL: the relay hot path allocates."s, Color::Red) << '\n';
+        return 1;
+    }
+    std::cerr << MakeColorfulText("[AllocBench] OK: no allocations per relayed message."s, Color::Green) << '\n';
+    return 0;
+}
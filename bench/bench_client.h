@@ -0,0 +1,48 @@
+// This file contains the client side of the benchmarks that drive an in-process server over loopback sockets
+#pragma once
+
+#include "../src/server/server.h"
+
+// A free TCP port on the loopback interface (there is a small window in which someone else may take it).
+inline std::string PickFreePort(){
+    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    if (socketfd == -1 || bind(socketfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1
+        || getsockname(socketfd, reinterpret_cast<sockaddr*>(&address), &address_len) == -1){
+        throw std::runtime_error("failed to pick a port: "s + std::string(strerror(errno)));
+    }
+    close(socketfd);
+    return std::to_string(ntohs(address.sin_port));
+}
+
+/**
+ * Connect to the server and complete the connection protocol in v2.
+ * @throw std::runtime_error if the server refuses the client
+*/
+inline int ConnectClient(const std::string& port, std::string_view nickname){
+    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(std::stoi(port)));
+    for (int attempt = 0; connect(socketfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1; ++attempt){
+        if (attempt == 50){ // the server needs a moment to start listenning
+            throw std::runtime_error("connect(): "s + std::string(strerror(errno)));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    std::string storage;
+    Frame frame;
+    if (ReceiveFrame(socketfd, ProtocolVersion::V1, storage, frame) != 1 || frame.opcode != Opcode::NICK_PROMPT
+        || SendFrame(socketfd, ProtocolVersion::V1, Opcode::PROTO_UPGRD, std::string_view()) == -1
+        || ReceiveFrame(socketfd, ProtocolVersion::V1, storage, frame) != 1 || frame.opcode != Opcode::PROTO_ACCPT
+        || SendFrame(socketfd, ProtocolVersion::V2, Opcode::NICK_NEWREQ, nickname) == -1
+        || ReceiveFrame(socketfd, ProtocolVersion::V2, storage, frame) != 1 || frame.opcode != Opcode::NICK_ACCEPT){
+        throw std::runtime_error("handshake of "s + std::string(nickname) + " has failed"s);
+    }
+    return socketfd;
+}
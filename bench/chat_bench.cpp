@@ -0,0 +1,582 @@
+// Load generator: thousands of synthetic clients speaking the real protocol to a running server over loopback.
+// Reports the send rate, the send-to-receive latency and the fanout completion time of broadcast chat messages.
+#include "../lib/networking_ops.h"
+#include "latency_histogram.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define BENCH_MAX_EPOLL_EVENTS 512
+#define BENCH_READ_BUFFER_SIZE 65536
+#define BENCH_TRACKED_MESSAGES (1 << 20) // ring of in-flight messages whose fanout is tracked (power of 2)
+#define BENCH_MIN_MESSAGE_SIZE 48 // room for "<message id>:<send timestamp>:"
+#define BENCH_SETTLE_MS 1000 // pause between the last handshake and the first message: lets the connection notices drain
+#define BENCH_DRAIN_MS 1000 // how long the last messages may take to arrive
+#define BENCH_CONNECT_TIMEOUT_S 60
+
+struct BenchConfig{
+    std::string host, port;
+    size_t clients_n = 1000;
+    size_t senders_n = 10;
+    double rate = 10.0; // messages per second per sender
+    size_t message_size = 64; // chat payload bytes
+    double duration_s = 10.0;
+    double warmup_s = 2.0;
+    ProtocolVersion protocol = ProtocolVersion::V2;
+    size_t threads_n = std::max(1u, std::thread::hardware_concurrency() / 2);
+    size_t connect_parallelism = 32; // handshakes in progress per thread (the server's listen backlog is small)
+    bool json = false;
+};
+
+static int64_t NowNs() noexcept{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Delivery state of a broadcast message, shared by all threads: the receiver that completes the fanout records its time.
+*/
+struct MessageTrack{
+    std::atomic_int64_t send_ns{0};
+    std::atomic_uint32_t received_n{0};
+};
+
+// State shared by the worker threads and the coordinating main thread.
+struct BenchShared{
+    explicit BenchShared(const BenchConfig& config) : config(config), tracks(BENCH_TRACKED_MESSAGES) {}
+
+    const BenchConfig& config;
+    addrinfo* server_address = nullptr;
+    std::vector<MessageTrack> tracks;
+    std::atomic_uint64_t next_message_id{0};
+    std::atomic_size_t ready_n{0}; // clients that have completed the handshake
+    std::atomic_size_t failed_n{0}; // clients refused or disconnected
+    std::atomic_int64_t start_ns{0}; // 0 until the senders may begin
+    std::atomic_int64_t measure_from_ns{INT64_MAX}; // messages sent in [measure_from_ns, measure_to_ns) are measured
+    std::atomic_int64_t measure_to_ns{INT64_MAX};
+    std::atomic_bool stop{false};
+
+    bool IsMeasured(int64_t send_ns) const noexcept{
+        return send_ns >= measure_from_ns.load(std::memory_order_relaxed) && send_ns < measure_to_ns.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * One epoll loop driving a slice of the synthetic clients: connection, handshake, paced sending and receiving.
+*/
+class BenchWorker{
+public:
+    explicit BenchWorker(BenchShared& shared) : shared_(shared), read_buffer_(BENCH_READ_BUFFER_SIZE) {}
+
+    ~BenchWorker(){
+        for (BenchClient& client : clients_){
+            if (client.socketfd != -1){
+                close(client.socketfd);
+            }
+        }
+        if (epoll_fd_ != -1){
+            close(epoll_fd_);
+        }
+    }
+
+    void AddClient(size_t client_index, bool is_sender){
+        BenchClient client;
+        client.nickname = "bench-"s + std::to_string(getpid()) + "-"s + std::to_string(client_index);
+        client.is_sender = is_sender;
+        clients_.push_back(std::move(client));
+    }
+
+    /**
+     * @throw std::runtime_error if the event loop can't be set up
+    */
+    void Run(){
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1){
+            throw std::runtime_error("epoll_create1(): "s + std::string(strerror(errno)));
+        }
+        epoll_event events[BENCH_MAX_EPOLL_EVENTS];
+        while (!shared_.stop.load(std::memory_order_relaxed)){
+            __StartConnections__();
+            int ready_count = epoll_wait(epoll_fd_, events, BENCH_MAX_EPOLL_EVENTS, __WaitTimeoutMs__());
+            if (ready_count == -1 && errno != EINTR){
+                throw std::runtime_error("epoll_wait(): "s + std::string(strerror(errno)));
+            }
+            for (int i = 0; i < ready_count; ++i){
+                __HandleEvent__(clients_[events[i].data.u64], events[i].events);
+            }
+            __SendDueMessages__();
+        }
+    }
+
+    uint64_t sent_n = 0; // measured messages sent
+    uint64_t received_n = 0; // measured messages received (one per recipient)
+    LatencyHistogram latency; // send -> receive, per recipient
+    LatencyHistogram fanout; // send -> the last recipient has received it
+
+private:
+    enum class ClientState{
+        IDLE = 0,
+        CONNECTING = 1,
+        AWAIT_PROMPT = 2,
+        AWAIT_UPGRADE = 3,
+        AWAIT_ACCEPT = 4,
+        READY = 5,
+        FAILED = 6
+    };
+
+    struct BenchClient{
+        int socketfd = -1;
+        ClientState state = ClientState::IDLE;
+        ProtocolVersion version = ProtocolVersion::V1;
+        bool is_sender = false;
+        std::string nickname;
+        FrameDecoder decoder;
+        std::string outbox; // bytes the socket hasn't accepted yet
+        int64_t next_send_ns = 0;
+    };
+
+    // Keep up to connect_parallelism handshakes in progress.
+    void __StartConnections__(){
+        while (handshaking_n_ < shared_.config.connect_parallelism && next_to_connect_ < clients_.size()){
+            BenchClient& client = clients_[next_to_connect_];
+            const addrinfo* address = shared_.server_address;
+            client.socketfd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+            if (client.socketfd == -1 || (connect(client.socketfd, address->ai_addr, address->ai_addrlen) == -1 && errno != EINPROGRESS)){
+                __Fail__(client, "connect()"s);
+            } else{
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.u64 = next_to_connect_;
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client.socketfd, &ev);
+                client.state = ClientState::CONNECTING;
+                ++handshaking_n_;
+            }
+            ++next_to_connect_;
+        }
+    }
+
+    int __WaitTimeoutMs__() const noexcept{
+        int64_t start_ns = shared_.start_ns.load(std::memory_order_relaxed);
+        if (start_ns == 0){
+            return 10;
+        }
+        int64_t next_send_ns = INT64_MAX;
+        for (const BenchClient& client : clients_){
+            if (client.is_sender && client.state == ClientState::READY){
+                next_send_ns = std::min(next_send_ns, client.next_send_ns);
+            }
+        }
+        int64_t wait_ns = next_send_ns - NowNs();
+        return static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(wait_ns / 1000000, 10)));
+    }
+
+    void __HandleEvent__(BenchClient& client, uint32_t events){
+        if (client.state == ClientState::FAILED){
+            return;
+        }
+        if (client.state == ClientState::CONNECTING && (events & (EPOLLOUT | EPOLLERR))){
+            int error_code = 0;
+            socklen_t error_code_len = sizeof(error_code);
+            getsockopt(client.socketfd, SOL_SOCKET, SO_ERROR, &error_code, &error_code_len);
+            if (error_code != 0){
+                errno = error_code;
+                __Fail__(client, "connect()"s);
+                return;
+            }
+            client.state = ClientState::AWAIT_PROMPT;
+        }
+        if ((events & EPOLLOUT) && !client.outbox.empty()){
+            __Flush__(client);
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+            __Receive__(client);
+        }
+    }
+
+    void __Receive__(BenchClient& client){
+        while (client.state != ClientState::FAILED){
+            ssize_t recv_bytes = recv(client.socketfd, read_buffer_.data(), read_buffer_.size(), 0);
+            if (recv_bytes == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK){
+                    __Fail__(client, "recv()"s);
+                }
+                return;
+            }
+            if (recv_bytes == 0){
+                errno = ECONNRESET;
+                __Fail__(client, "the server has closed the connection"s);
+                return;
+            }
+            int64_t received_ns = NowNs();
+            client.decoder.Feed(read_buffer_.data(), recv_bytes);
+            Frame frame;
+            int decode_status;
+            while (client.state != ClientState::FAILED && (decode_status = client.decoder.NextFrame(frame)) == 1){
+                __HandleFrame__(client, frame, received_ns);
+            }
+            if (decode_status == -1){
+                errno = EPROTO;
+                __Fail__(client, "malformed frame"s);
+            }
+        }
+    }
+
+    void __HandleFrame__(BenchClient& client, const Frame& frame, int64_t received_ns){
+        switch (client.state){
+            case ClientState::AWAIT_PROMPT:
+                if (frame.opcode != Opcode::NICK_PROMPT){
+                    break;
+                }
+                if (shared_.config.protocol == ProtocolVersion::V2){
+                    __Queue__(client, Opcode::PROTO_UPGRD, std::string_view());
+                    client.state = ClientState::AWAIT_UPGRADE;
+                } else{
+                    __Queue__(client, Opcode::NICK_NEWREQ, client.nickname);
+                    client.state = ClientState::AWAIT_ACCEPT;
+                }
+                break;
+            case ClientState::AWAIT_UPGRADE:
+                if (frame.opcode != Opcode::PROTO_ACCPT){
+                    errno = EPROTONOSUPPORT;
+                    __Fail__(client, "the server doesn't speak protocol v2"s);
+                    break;
+                }
+                client.version = ProtocolVersion::V2;
+                client.decoder.SetVersion(ProtocolVersion::V2);
+                __Queue__(client, Opcode::NICK_NEWREQ, client.nickname);
+                client.state = ClientState::AWAIT_ACCEPT;
+                break;
+            case ClientState::AWAIT_ACCEPT:
+                if (frame.opcode != Opcode::NICK_ACCEPT){
+                    errno = EACCES;
+                    __Fail__(client, "nickname refused"s);
+                    break;
+                }
+                client.state = ClientState::READY;
+                --handshaking_n_;
+                shared_.ready_n.fetch_add(1);
+                break;
+            case ClientState::READY:
+                if (frame.opcode == Opcode::MESSAGE && !(frame.flags & FRAME_FLAG_NOTICE)){
+                    __HandleChatMessage__(frame.payload, received_ns);
+                } else if (frame.opcode == Opcode::HEARTB_PING){ // silent receivers get pinged on long runs
+                    __Queue__(client, Opcode::HEARTB_PONG, std::string_view());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // "[<nickname>] <message id>:<send timestamp>:<padding>"; anything else (notices in v1) is ignored.
+    void __HandleChatMessage__(std::string_view payload, int64_t received_ns){
+        size_t text_begin = payload.find("] ");
+        if (payload.empty() || payload[0] != '[' || text_begin == payload.npos){
+            return;
+        }
+        std::string_view text = payload.substr(text_begin + 2);
+        const char* text_end = text.data() + text.size();
+        uint64_t message_id;
+        int64_t send_ns;
+        auto [id_end, id_error] = std::from_chars(text.data(), text_end, message_id);
+        if (id_error != std::errc() || id_end == text_end || *id_end != ':'){
+            return;
+        }
+        auto [ts_end, ts_error] = std::from_chars(id_end + 1, text_end, send_ns);
+        if (ts_error != std::errc() || ts_end == text_end || *ts_end != ':' || !shared_.IsMeasured(send_ns)){
+            return;
+        }
+        ++received_n;
+        latency.Record(static_cast<uint64_t>(std::max<int64_t>(0, received_ns - send_ns)));
+
+        MessageTrack& track = shared_.tracks[message_id & (BENCH_TRACKED_MESSAGES - 1)];
+        if (track.send_ns.load(std::memory_order_acquire) != send_ns){ // overwritten: too many messages in flight
+            return;
+        }
+        if (track.received_n.fetch_add(1, std::memory_order_acq_rel) + 1 == shared_.ready_n.load(std::memory_order_relaxed)){
+            fanout.Record(static_cast<uint64_t>(std::max<int64_t>(0, received_ns - send_ns)));
+        }
+    }
+
+    void __SendDueMessages__(){
+        int64_t start_ns = shared_.start_ns.load(std::memory_order_relaxed);
+        if (start_ns == 0){
+            return;
+        }
+        int64_t now_ns = NowNs();
+        int64_t interval_ns = static_cast<int64_t>(1e9 / shared_.config.rate);
+        for (BenchClient& client : clients_){
+            if (!client.is_sender || client.state != ClientState::READY){
+                continue;
+            }
+            if (client.next_send_ns == 0){ // spread the senders over the first interval
+                client.next_send_ns = start_ns + static_cast<int64_t>(std::hash<std::string>()(client.nickname) % interval_ns);
+            }
+            while (client.next_send_ns <= now_ns){
+                __SendChatMessage__(client, now_ns);
+                client.next_send_ns += interval_ns;
+            }
+        }
+    }
+
+    void __SendChatMessage__(BenchClient& client, int64_t now_ns){
+        uint64_t message_id = shared_.next_message_id.fetch_add(1, std::memory_order_relaxed);
+        MessageTrack& track = shared_.tracks[message_id & (BENCH_TRACKED_MESSAGES - 1)];
+        track.received_n.store(0, std::memory_order_relaxed);
+        track.send_ns.store(now_ns, std::memory_order_release);
+
+        char header[BENCH_MIN_MESSAGE_SIZE];
+        int header_length = snprintf(header, sizeof(header), "%" PRIu64 ":%" PRId64 ":", message_id, now_ns);
+        message_.assign(header, header_length);
+        if (message_.size() < shared_.config.message_size){
+            message_.append(shared_.config.message_size - message_.size(), '.');
+        }
+        __Queue__(client, Opcode::MESSAGE, message_);
+        if (shared_.IsMeasured(now_ns)){
+            ++sent_n;
+        }
+    }
+
+    void __Queue__(BenchClient& client, Opcode opcode, std::string_view payload){
+        AssembleFrameInto(frame_, client.version, opcode, payload);
+        client.outbox.append(frame_);
+        __Flush__(client);
+    }
+
+    void __Flush__(BenchClient& client){
+        while (!client.outbox.empty()){
+            ssize_t sent_bytes = send(client.socketfd, client.outbox.data(), client.outbox.size(), MSG_NOSIGNAL);
+            if (sent_bytes == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK){
+                    __Fail__(client, "send()"s);
+                }
+                return; // the rest goes out on EPOLLOUT
+            }
+            client.outbox.erase(0, sent_bytes);
+        }
+    }
+
+    void __Fail__(BenchClient& client, const std::string& reason){
+        if (client.state != ClientState::READY && client.state != ClientState::IDLE){
+            --handshaking_n_;
+        }
+        if (client.state == ClientState::READY){
+            shared_.ready_n.fetch_sub(1);
+        }
+        shared_.failed_n.fetch_add(1);
+        if (failures_logged_++ < 5){
+            std::cerr << MakeColorfulText("[ChatBench] "s + client.nickname + ": "s + reason + ": "s + std::string(strerror(errno)), Color::Red) << '\n';
+        }
+        client.state = ClientState::FAILED;
+        if (client.socketfd != -1){
+            close(client.socketfd);
+            client.socketfd = -1;
+        }
+    }
+
+    BenchShared& shared_;
+    int epoll_fd_ = -1;
+    std::vector<BenchClient> clients_;
+    size_t next_to_connect_ = 0;
+    size_t handshaking_n_ = 0;
+    size_t failures_logged_ = 0;
+    std::vector<char> read_buffer_;
+    std::string message_; // payload being sent
+    std::string frame_; // frame being queued
+};
+
+static bool ParseBenchOptions(int options_n, char* options[], BenchConfig& config){
+    for (int i = 0; i < options_n; ++i){
+        std::string option(options[i]);
+        size_t eq_pos = option.find('=');
+        if (eq_pos == option.npos){
+            return false;
+        }
+        std::string name(option.substr(0, eq_pos)), value(option.substr(eq_pos + 1));
+        try{
+            if (name == "--clients"s){
+                config.clients_n = std::stoul(value);
+            } else if (name == "--senders"s){
+                config.senders_n = std::stoul(value);
+            } else if (name == "--rate"s){
+                config.rate = std::stod(value);
+            } else if (name == "--size"s){
+                config.message_size = std::stoul(value);
+            } else if (name == "--duration"s){
+                config.duration_s = std::stod(value);
+            } else if (name == "--warmup"s){
+                config.warmup_s = std::stod(value);
+            } else if (name == "--protocol"s){
+                if (value != "v1"s && value != "v2"s){
+                    return false;
+                }
+                config.protocol = value == "v2"s ? ProtocolVersion::V2 : ProtocolVersion::V1;
+            } else if (name == "--threads"s){
+                config.threads_n = std::stoul(value);
+            } else if (name == "--connect-parallelism"s){
+                config.connect_parallelism = std::stoul(value);
+            } else if (name == "--format"s){
+                if (value != "text"s && value != "json"s){
+                    return false;
+                }
+                config.json = value == "json"s;
+            } else{
+                return false;
+            }
+        } catch (std::logic_error&){ // std::invalid_argument or std::out_of_range
+            return false;
+        }
+    }
+    config.message_size = std::max<size_t>(config.message_size, BENCH_MIN_MESSAGE_SIZE);
+    return config.clients_n > 0 && config.senders_n <= config.clients_n && config.rate > 0 && config.threads_n > 0
+        && config.connect_parallelism > 0 && config.duration_s > 0 && config.warmup_s >= 0;
+}
+
+// Thousands of sockets need more than the usual 1024 descriptors.
+static void RaiseFileLimit(size_t clients_n){
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < clients_n + 64){
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, clients_n + 64);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void PrintReport(const BenchConfig& config, const std::vector<std::unique_ptr<BenchWorker>>& workers, size_t ready_n, size_t failed_n){
+    uint64_t sent_n = 0, received_n = 0;
+    LatencyHistogram latency, fanout;
+    for (const std::unique_ptr<BenchWorker>& worker : workers){
+        sent_n += worker->sent_n;
+        received_n += worker->received_n;
+        latency.Merge(worker->latency);
+        fanout.Merge(worker->fanout);
+    }
+    auto us = [](uint64_t ns){
+        return static_cast<double>(ns) / 1000.0;
+    };
+    double sent_per_s = sent_n / config.duration_s;
+    double received_per_s = received_n / config.duration_s;
+    uint64_t expected_n = sent_n * ready_n;
+
+    if (config.json){
+        printf("{\"clients\": %zu, \"senders\": %zu, \"rate_per_sender\": %.3f, \"message_size\": %zu, \"duration_s\": %.3f, \"protocol\": \"%s\", "
+               "\"connected\": %zu, \"failed\": %zu, \"messages_sent\": %" PRIu64 ", \"messages_per_s\": %.1f, "
+               "\"deliveries\": %" PRIu64 ", \"deliveries_expected\": %" PRIu64 ", \"deliveries_per_s\": %.1f, "
+               "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}, "
+               "\"fanout_completed\": %" PRIu64 ", \"fanout_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}}\n",
+               config.clients_n, config.senders_n, config.rate, config.message_size, config.duration_s, config.protocol == ProtocolVersion::V2 ? "v2" : "v1",
+               ready_n, failed_n, sent_n, sent_per_s, received_n, expected_n, received_per_s,
+               us(latency.Percentile(50)), us(latency.Percentile(99)), us(latency.Percentile(99.9)), us(latency.Max()), latency.Mean() / 1000.0,
+               fanout.Count(), us(fanout.Percentile(50)), us(fanout.Percentile(99)), us(fanout.Percentile(99.9)), us(fanout.Max()), fanout.Mean() / 1000.0);
+        return;
+    }
+    printf("clients: %zu connected, %zu failed | senders: %zu x %.1f msg/s | message size: %zu B | protocol: %s\n",
+           ready_n, failed_n, config.senders_n, config.rate, config.message_size, config.protocol == ProtocolVersion::V2 ? "v2" : "v1");
+    printf("sent:       %" PRIu64 " messages in %.1f s (%.1f msg/s)\n", sent_n, config.duration_s, sent_per_s);
+    printf("delivered:  %" PRIu64 " of %" PRIu64 " (%.1f deliveries/s)\n", received_n, expected_n, received_per_s);
+    printf("latency:    p50 %.1f us | p99 %.1f us | p99.9 %.1f us | max %.1f us\n",
+           us(latency.Percentile(50)), us(latency.Percentile(99)), us(latency.Percentile(99.9)), us(latency.Max()));
+    printf("fanout:     p50 %.1f us | p99 %.1f us | p99.9 %.1f us | max %.1f us (%" PRIu64 " of %" PRIu64 " messages reached everybody)\n",
+           us(fanout.Percentile(50)), us(fanout.Percentile(99)), us(fanout.Percentile(99.9)), us(fanout.Max()), fanout.Count(), sent_n);
+}
+
+int main(int argc, char* argv[]){
+    BenchConfig config;
+    if (argc < 3 || !ParseBenchOptions(argc - 3, argv + 3, config)){
+        std::cerr << "[Usage] ./chat_bench <hostname> <port> [options]\n"s
+                  << "  --clients=<n>                 synthetic clients (default: 1000)\n"s
+                  << "  --senders=<n>                 clients that send messages, every client receives (default: 10)\n"s
+                  << "  --rate=<msg/s>                messages per second per sender (default: 10)\n"s
+                  << "  --size=<bytes>                chat message size, at least 48 (default: 64)\n"s
+                  << "  --duration=<s>                measured time (default: 10)\n"s
+                  << "  --warmup=<s>                  unmeasured time before it (default: 2)\n"s
+                  << "  --protocol=<v1|v2>            protocol version of the clients (default: v2)\n"s
+                  << "  --threads=<n>                 client threads (default: half of the CPUs)\n"s
+                  << "  --connect-parallelism=<n>     handshakes in progress per thread (default: 32)\n"s
+                  << "  --format=<text|json>          report format (default: text)"s << std::endl;
+        return 1;
+    }
+    config.host = argv[1];
+    config.port = argv[2];
+    RaiseFileLimit(config.clients_n);
+
+    BenchShared shared(config);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int getaddrinfo_status_code = getaddrinfo(config.host.c_str(), config.port.c_str(), &hints, &shared.server_address);
+    if (getaddrinfo_status_code != 0){
+        std::cerr << MakeColorfulText("[ChatBench] getaddrinfo(): "s + std::string(gai_strerror(getaddrinfo_status_code)), Color::Red) << '\n';
+        return 1;
+    }
+
+    config.threads_n = std::min(config.threads_n, config.clients_n);
+    std::vector<std::unique_ptr<BenchWorker>> workers;
+    for (size_t i = 0; i < config.threads_n; ++i){
+        workers.push_back(std::make_unique<BenchWorker>(shared));
+    }
+    for (size_t i = 0; i < config.clients_n; ++i){ // the senders are spread over the threads
+        workers[i % config.threads_n]->AddClient(i, i < config.senders_n);
+    }
+
+    std::atomic_int exit_code = 0;
+    std::vector<std::thread> worker_threads;
+    for (std::unique_ptr<BenchWorker>& worker : workers){
+        worker_threads.emplace_back([&worker, &shared, &exit_code](){
+            try{
+                worker->Run();
+            } catch(std::runtime_error& err){
+                std::cerr << MakeColorfulText("[ChatBench] "s + std::string(err.what()), Color::Red) << '\n';
+                exit_code = 1;
+                shared.stop = true;
+            }
+        });
+    }
+
+    // Connect everybody, let the connection notices drain, warm up, measure, wait for the last deliveries.
+    auto connect_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(BENCH_CONNECT_TIMEOUT_S);
+    while (shared.ready_n + shared.failed_n < config.clients_n && std::chrono::steady_clock::now() < connect_deadline && !shared.stop){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    size_t stalled_n = config.clients_n - shared.ready_n - shared.failed_n;
+    if (stalled_n > 0){
+        std::cerr << MakeColorfulText("[ChatBench] "s + std::to_string(stalled_n) + " clients haven't completed the handshake in "s + std::to_string(BENCH_CONNECT_TIMEOUT_S) + " s, running without them."s, Color::Yellow) << '\n';
+    }
+    if (!config.json){
+        std::cerr << MakeColorfulText("[ChatBench] "s + std::to_string(shared.ready_n.load()) + " clients connected, "s + std::to_string(shared.failed_n.load()) + " failed."s, Color::Green) << '\n';
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_SETTLE_MS));
+    int64_t start_ns = NowNs();
+    shared.measure_from_ns = start_ns + static_cast<int64_t>(config.warmup_s * 1e9);
+    shared.measure_to_ns = shared.measure_from_ns + static_cast<int64_t>(config.duration_s * 1e9);
+    shared.start_ns = start_ns;
+    std::this_thread::sleep_for(std::chrono::nanoseconds(shared.measure_to_ns - start_ns) + std::chrono::milliseconds(BENCH_DRAIN_MS));
+    size_t ready_n = shared.ready_n, failed_n = shared.failed_n;
+    shared.stop = true;
+    for (std::thread& worker_thread : worker_threads){
+        worker_thread.join();
+    }
+    freeaddrinfo(shared.server_address);
+
+    PrintReport(config, workers, ready_n, failed_n);
+    return exit_code;
+}
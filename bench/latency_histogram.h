@@ -0,0 +1,96 @@
+// This file contains the latency histogram shared by the benchmarks
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 7 // every power of 2 is split into 128 buckets: < 1% relative error
+
+/**
+ * Log-linear histogram of non-negative integer samples (nanoseconds). Recording is O(1) and allocation-free,
+ * histograms of several threads are combined with Merge().
+*/
+class LatencyHistogram{
+public:
+    LatencyHistogram() : buckets_((65 - HISTOGRAM_SUB_BUCKET_BITS) << HISTOGRAM_SUB_BUCKET_BITS, 0) {}
+
+    void Record(uint64_t value) noexcept{
+        ++buckets_[__BucketIndex__(value)];
+        ++count_;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void Merge(const LatencyHistogram& other) noexcept{
+        for (size_t i = 0; i < buckets_.size(); ++i){
+            buckets_[i] += other.buckets_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    /**
+     * @param percentile 0-100
+     * @return upper bound of the bucket holding the percentile (never above the max sample), 0 if empty
+    */
+    uint64_t Percentile(double percentile) const noexcept{
+        if (count_ == 0){
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets_.size(); ++i){
+            seen += buckets_[i];
+            if (seen >= rank){
+                return std::min(__BucketUpperBound__(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t Count() const noexcept{
+        return count_;
+    }
+    uint64_t Min() const noexcept{
+        return count_ == 0 ? 0 : min_;
+    }
+    uint64_t Max() const noexcept{
+        return max_;
+    }
+    double Mean() const noexcept{
+        return count_ == 0 ? 0.0 : static_cast<double>(sum_) / count_;
+    }
+
+private:
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << HISTOGRAM_SUB_BUCKET_BITS;
+
+    // Values below SUB_BUCKETS get a bucket each; above, [2^k, 2^(k+1)) is split into SUB_BUCKETS equal buckets.
+    static size_t __BucketIndex__(uint64_t value) noexcept{
+        if (value < SUB_BUCKETS){
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+        return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t __BucketUpperBound__(size_t index) noexcept{
+        if (index < SUB_BUCKETS){
+            return index;
+        }
+        int shift = static_cast<int>(index >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+        uint64_t lower = ((index & (SUB_BUCKETS - 1)) + SUB_BUCKETS) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::vector<uint64_t> buckets_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+};
@@ -0,0 +1,265 @@
+// Microbenchmarks of the per-message helpers of networking_ops.h and color.h, and of the server's timing wheel:
+// ./microbench [name filter] [--format=json]
+#include "../lib/networking_ops.h"
+#include "../lib/color.h"
+#include "../src/server/timer_wheel.h"
+#include "microbench.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+static void* CountedAllocate(size_t size){
+    microbench_allocations_n.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr){
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size){
+    return CountedAllocate(size);
+}
+void* operator new[](size_t size){
+    return CountedAllocate(size);
+}
+void operator delete(void* ptr) noexcept{
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept{
+    free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept{
+    free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept{
+    free(ptr);
+}
+
+// Fixed inputs: a typical chat line and a long one (still under V1_MAX_MESSAGE_LENGTH).
+static const std::string SHORT_MESSAGE = "[alice] hey, is anyone up for a game tonight?"s;
+static const std::string LONG_MESSAGE(4096, 'x');
+static const std::string PADDED_MESSAGE = std::string(64, ' ') + LONG_MESSAGE + std::string(64, '\t');
+
+static void BM_AssembleMessagePacket_Short(MicrobenchState& state){
+    for ([[maybe_unused]] auto _ : state){
+        std::string packet = AssembleMessagePacket(SHORT_MESSAGE);
+        DoNotOptimize(packet);
+    }
+    state.SetBytesProcessed(state.Iterations() * SHORT_MESSAGE.size());
+}
+MICROBENCHMARK(BM_AssembleMessagePacket_Short);
+
+static void BM_AssembleMessagePacket_Long(MicrobenchState& state){
+    for ([[maybe_unused]] auto _ : state){
+        std::string packet = AssembleMessagePacket(LONG_MESSAGE);
+        DoNotOptimize(packet);
+    }
+    state.SetBytesProcessed(state.Iterations() * LONG_MESSAGE.size());
+}
+MICROBENCHMARK(BM_AssembleMessagePacket_Long);
+
+static void BM_AssembleFrame_V2(MicrobenchState& state){
+    for ([[maybe_unused]] auto _ : state){
+        std::string frame = AssembleFrame(ProtocolVersion::V2, Opcode::MESSAGE, SHORT_MESSAGE);
+        DoNotOptimize(frame);
+    }
+}
+MICROBENCHMARK(BM_AssembleFrame_V2);
+
+static void BM_AssembleFrameInto_V1_Reused(MicrobenchState& state){
+    std::string frame;
+    for ([[maybe_unused]] auto _ : state){
+        AssembleFrameInto(frame, ProtocolVersion::V1, Opcode::MESSAGE, SHORT_MESSAGE);
+        DoNotOptimize(frame);
+    }
+}
+MICROBENCHMARK(BM_AssembleFrameInto_V1_Reused);
+
+static void BM_AssembleFrameInto_V2_Reused(MicrobenchState& state){
+    std::string frame;
+    for ([[maybe_unused]] auto _ : state){
+        AssembleFrameInto(frame, ProtocolVersion::V2, Opcode::MESSAGE, SHORT_MESSAGE);
+        DoNotOptimize(frame);
+    }
+}
+MICROBENCHMARK(BM_AssembleFrameInto_V2_Reused);
+
+static void BM_StipString_Padded(MicrobenchState& state){
+    std::string str;
+    str.reserve(PADDED_MESSAGE.size());
+    for ([[maybe_unused]] auto _ : state){
+        str.assign(PADDED_MESSAGE);
+        StipString(str);
+        DoNotOptimize(str);
+    }
+    state.SetBytesProcessed(state.Iterations() * PADDED_MESSAGE.size());
+}
+MICROBENCHMARK(BM_StipString_Padded);
+
+static void BM_MakeColorfulText(MicrobenchState& state){
+    for ([[maybe_unused]] auto _ : state){
+        std::string colored = MakeColorfulText(SHORT_MESSAGE, Color::Cyan);
+        DoNotOptimize(colored);
+    }
+}
+MICROBENCHMARK(BM_MakeColorfulText);
+
+static void BM_AppendColorfulText_Reused(MicrobenchState& state){
+    std::string colored;
+    colored.reserve(ColorfulTextLength(SHORT_MESSAGE, Color::Cyan));
+    for ([[maybe_unused]] auto _ : state){
+        colored.clear();
+        AppendColorfulText(colored, SHORT_MESSAGE, Color::Cyan);
+        DoNotOptimize(colored);
+    }
+}
+MICROBENCHMARK(BM_AppendColorfulText_Reused);
+
+static void BM_ParseV1Message_KeySignal(MicrobenchState& state){
+    const std::string message = "\07ACT_PMSGUSRbob\02see you at 8"s;
+    for ([[maybe_unused]] auto _ : state){
+        Frame frame = ParseV1Message(message);
+        DoNotOptimize(frame);
+    }
+}
+MICROBENCHMARK(BM_ParseV1Message_KeySignal);
+
+// Decode a recv() chunk holding 64 back-to-back frames.
+static void BM_FrameDecoder_V2_Chunk(MicrobenchState& state){
+    std::string chunk;
+    for (int i = 0; i < 64; ++i){
+        chunk.append(AssembleFrame(ProtocolVersion::V2, Opcode::MESSAGE, SHORT_MESSAGE));
+    }
+    FrameDecoder decoder;
+    decoder.SetVersion(ProtocolVersion::V2);
+    Frame frame;
+    for ([[maybe_unused]] auto _ : state){
+        decoder.Feed(chunk.data(), chunk.size());
+        while (decoder.NextFrame(frame) == 1){
+            DoNotOptimize(frame);
+        }
+    }
+    state.SetBytesProcessed(state.Iterations() * chunk.size());
+}
+MICROBENCHMARK(BM_FrameDecoder_V2_Chunk);
+
+// One blocking round trip through the kernel: SendMessage() on one end of a socketpair, ReceiveMessage() on the other.
+static void BM_SendReceiveMessage_Socketpair(MicrobenchState& state){
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1){
+        perror("socketpair()");
+        exit(1);
+    }
+    char receive_buffer[V1_MAX_MESSAGE_LENGTH + 1];
+    for ([[maybe_unused]] auto _ : state){
+        if (SendMessage(sockets[0], SHORT_MESSAGE) == -1 || ReceiveMessage(sockets[1], receive_buffer) <= 0){
+            perror("SendMessage()/ReceiveMessage()");
+            exit(1);
+        }
+        DoNotOptimize(receive_buffer);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+    state.SetBytesProcessed(state.Iterations() * SHORT_MESSAGE.size());
+}
+MICROBENCHMARK(BM_SendReceiveMessage_Socketpair);
+
+static void BM_SendReceiveFrame_V2_Socketpair(MicrobenchState& state){
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1){
+        perror("socketpair()");
+        exit(1);
+    }
+    std::string storage;
+    Frame frame;
+    for ([[maybe_unused]] auto _ : state){
+        if (SendFrame(sockets[0], ProtocolVersion::V2, Opcode::MESSAGE, SHORT_MESSAGE) == -1
+            || ReceiveFrame(sockets[1], ProtocolVersion::V2, storage, frame) != 1){
+            perror("SendFrame()/ReceiveFrame()");
+            exit(1);
+        }
+        DoNotOptimize(frame);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+    state.SetBytesProcessed(state.Iterations() * SHORT_MESSAGE.size());
+}
+MICROBENCHMARK(BM_SendReceiveFrame_V2_Socketpair);
+
+#define BENCH_TIMERS_N 100000 // armed timers: a server with 100k connections
+
+/**
+ * Arm BENCH_TIMERS_N timers with deadlines spread evenly over the `spread` ticks that follow `first_tick`.
+*/
+static void ArmBenchTimers(TimerWheel& wheel, uint64_t first_tick, uint64_t spread){
+    for (uint64_t i = 0; i < BENCH_TIMERS_N; ++i){
+        wheel.Arm(first_tick + i * spread / BENCH_TIMERS_N, i);
+    }
+}
+
+// One loop tick with 100k armed timers, none of them due (deadlines a day or more away, past the longest run).
+static void BM_TimerWheel_Advance_Idle_100k(MicrobenchState& state){
+    const auto start = TimerWheel::Clock::time_point();
+    TimerWheel wheel(start);
+    const uint64_t horizon = TimerWheel::TicksFromMs(24 * 3600 * 1000);
+    ArmBenchTimers(wheel, horizon, horizon);
+    uint64_t tick = 0;
+    for ([[maybe_unused]] auto _ : state){
+        wheel.Advance(start + std::chrono::milliseconds(++tick * TIMER_WHEEL_TICK_MS), [&](TimerWheel::TimerId id, uint64_t){
+            wheel.Rearm(id, wheel.Now() + horizon); // never reached while measuring, unless the run is very long
+        });
+    }
+    size_t armed_n = wheel.ArmedCount();
+    DoNotOptimize(armed_n);
+}
+MICROBENCHMARK(BM_TimerWheel_Advance_Idle_100k);
+
+// One loop tick with 100k timers due over the next second: every tick fires and re-arms ~1k of them (cascades included).
+static void BM_TimerWheel_Advance_Expiring_100k(MicrobenchState& state){
+    const auto start = TimerWheel::Clock::time_point();
+    TimerWheel wheel(start);
+    const uint64_t period = TimerWheel::TicksFromMs(1000);
+    ArmBenchTimers(wheel, 1, period);
+    uint64_t tick = 0, fired_n = 0;
+    for ([[maybe_unused]] auto _ : state){
+        wheel.Advance(start + std::chrono::milliseconds(++tick * TIMER_WHEEL_TICK_MS), [&](TimerWheel::TimerId id, uint64_t){
+            wheel.Rearm(id, wheel.Now() + period);
+            ++fired_n;
+        });
+    }
+    DoNotOptimize(fired_n);
+}
+MICROBENCHMARK(BM_TimerWheel_Advance_Expiring_100k);
+
+// Moving a deadline among 100k armed timers (what a received message would cost if it touched the wheel).
+static void BM_TimerWheel_Rearm_100k(MicrobenchState& state){
+    TimerWheel wheel{TimerWheel::Clock::time_point()};
+    const uint64_t horizon = TimerWheel::TicksFromMs(30000);
+    ArmBenchTimers(wheel, 1, horizon);
+    TimerWheel::TimerId id = 0;
+    for ([[maybe_unused]] auto _ : state){
+        wheel.Rearm(id, horizon + id % 1024);
+        id = (id + 7919) % BENCH_TIMERS_N; // hop around the slab
+    }
+    size_t armed_n = wheel.ArmedCount();
+    DoNotOptimize(armed_n);
+}
+MICROBENCHMARK(BM_TimerWheel_Rearm_100k);
+
+int main(int argc, char* argv[]){
+    std::string_view filter;
+    bool json = false;
+    for (int i = 1; i < argc; ++i){
+        std::string_view arg(argv[i]);
+        if (arg == "--format=json"){
+            json = true;
+        } else if (arg == "--format=text"){
+            json = false;
+        } else{
+            filter = arg;
+        }
+    }
+    return RunMicrobenchmarks(filter, json);
+}
@@ -0,0 +1,153 @@
+// This file contains a minimal Google Benchmark-style harness: ns/op and heap allocations/op of registered functions
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define MICROBENCH_MIN_TIME_MS 200 // a benchmark is repeated with more iterations until a run takes this long
+#define MICROBENCH_MAX_ITERATIONS 1000000000
+
+// Incremented by the replaced global operator new of the benchmark executable.
+inline std::atomic_uint64_t microbench_allocations_n{0};
+
+/**
+ * Iteration control of one benchmark run, used as `for (auto _ : state){ ... }`.
+ * Only the loop is measured: set-up before it and checks after it are free.
+*/
+class MicrobenchState{
+public:
+    explicit MicrobenchState(uint64_t iterations) : iterations_(iterations) {}
+
+    struct Iterator{
+        MicrobenchState* state;
+        uint64_t left;
+
+        bool operator!=(const Iterator&) const noexcept{
+            if (left == 0){
+                state->__Stop__();
+                return false;
+            }
+            return true;
+        }
+        void operator++() noexcept{
+            --left;
+        }
+        int operator*() const noexcept{
+            return 0;
+        }
+    };
+
+    Iterator begin(){
+        allocations_before_ = microbench_allocations_n.load(std::memory_order_relaxed);
+        started_at_ = std::chrono::steady_clock::now();
+        return Iterator{this, iterations_};
+    }
+    Iterator end() noexcept{
+        return Iterator{this, 0};
+    }
+
+    // Report bytes/s in addition to ns/op.
+    void SetBytesProcessed(uint64_t bytes) noexcept{
+        bytes_processed_ = bytes;
+    }
+
+    uint64_t Iterations() const noexcept{
+        return iterations_;
+    }
+    std::chrono::nanoseconds Elapsed() const noexcept{
+        return elapsed_;
+    }
+    uint64_t Allocations() const noexcept{
+        return allocations_;
+    }
+    uint64_t BytesProcessed() const noexcept{
+        return bytes_processed_;
+    }
+
+private:
+    void __Stop__() noexcept{
+        elapsed_ = std::chrono::steady_clock::now() - started_at_;
+        allocations_ = microbench_allocations_n.load(std::memory_order_relaxed) - allocations_before_;
+    }
+
+    const uint64_t iterations_;
+    std::chrono::steady_clock::time_point started_at_;
+    std::chrono::nanoseconds elapsed_{0};
+    uint64_t allocations_before_ = 0;
+    uint64_t allocations_ = 0;
+    uint64_t bytes_processed_ = 0;
+};
+
+using MicrobenchFunction = void (*)(MicrobenchState&);
+
+struct MicrobenchEntry{
+    const char* name;
+    MicrobenchFunction function;
+};
+
+inline std::vector<MicrobenchEntry>& MicrobenchRegistry(){
+    static std::vector<MicrobenchEntry> registry;
+    return registry;
+}
+
+inline bool RegisterMicrobench(const char* name, MicrobenchFunction function){
+    MicrobenchRegistry().push_back(MicrobenchEntry{name, function});
+    return true;
+}
+
+#define MICROBENCHMARK(function) static const bool function##_registered = RegisterMicrobench(#function, function)
+
+// Keep the compiler from optimizing a computed value away.
+template <typename T>
+inline void DoNotOptimize(T& value){
+    asm volatile("" : "+m"(value) : : "memory");
+}
+template <typename T>
+inline void DoNotOptimize(const T& value){
+    asm volatile("" : : "m"(value) : "memory");
+}
+
+/**
+ * Run every registered benchmark whose name contains the filter and print a table (or JSON lines).
+ * @return process exit code
+*/
+inline int RunMicrobenchmarks(std::string_view filter, bool json){
+    if (!json){
+        printf("%-40s %15s %12s %14s %12s\n", "Benchmark", "Iterations", "ns/op", "allocs/op", "MB/s");
+    }
+    for (const MicrobenchEntry& entry : MicrobenchRegistry()){
+        if (!filter.empty() && std::string_view(entry.name).find(filter) == std::string_view::npos){
+            continue;
+        }
+        uint64_t iterations = 1;
+        while (true){
+            MicrobenchState state(iterations);
+            entry.function(state);
+            bool long_enough = state.Elapsed() >= std::chrono::milliseconds(MICROBENCH_MIN_TIME_MS);
+            if (!long_enough && iterations < MICROBENCH_MAX_ITERATIONS){ // aim a bit over the minimal time, grow at most 10x
+                double scale = 1.4 * std::chrono::nanoseconds(std::chrono::milliseconds(MICROBENCH_MIN_TIME_MS)).count() / std::max<int64_t>(1, state.Elapsed().count());
+                iterations = std::min<uint64_t>(MICROBENCH_MAX_ITERATIONS, iterations * std::max(2.0, std::min(10.0, scale)));
+                continue;
+            }
+            double ns_per_op = static_cast<double>(state.Elapsed().count()) / iterations;
+            double allocs_per_op = static_cast<double>(state.Allocations()) / iterations;
+            double mb_per_s = state.BytesProcessed() == 0 ? 0.0 : state.BytesProcessed() / (state.Elapsed().count() / 1e9) / 1e6;
+            if (json){
+                printf("{\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"mb_per_s\": %.1f}\n",
+                       entry.name, static_cast<unsigned long long>(iterations), ns_per_op, allocs_per_op, mb_per_s);
+            } else{
+                printf("%-40s %15llu %12.2f %14.3f %12.1f\n", entry.name, static_cast<unsigned long long>(iterations), ns_per_op, allocs_per_op, mb_per_s);
+            }
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Regression check of flood control: a throttled client keeps a short partial frame in its decoder while the
+// ConnectionTable moves its connection around (swap-remove, reallocation), and the frame must still decode after the resume.
+// ./throttle_check [--io-backend=<epoll|io_uring>], exits with 1 on failure (build with -fsanitize=address to catch stray reads)
+#include "../src/server/server.h"
+#include "bench_client.h"
+
+#define CHECK_RECEIVE_TIMEOUT_MS 5000
+#define CHECK_CROWD_N 64 // clients connected while the first one is throttled: the table reallocates several times
+
+static const std::string_view CHECK_NICKNAME = "throttled";
+
+/**
+ * Wait for the broadcast of a chat line sent by the throttled client.
+ * @return false if it hasn't arrived in time
+*/
+static bool AwaitChatLine(int socketfd, FrameDecoder& decoder, std::string_view line){
+    const std::string expected = "["s + std::string(CHECK_NICKNAME) + "] "s + std::string(line);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CHECK_RECEIVE_TIMEOUT_MS);
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    Frame frame;
+    while (std::chrono::steady_clock::now() < deadline){
+        while (decoder.NextFrame(frame) == 1){
+            if (frame.opcode == Opcode::MESSAGE && frame.payload == expected){
+                return true;
+            }
+        }
+        ssize_t recv_bytes = recv(socketfd, buffer.data(), buffer.size(), 0);
+        if (recv_bytes == 0 || (recv_bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            return false;
+        }
+        if (recv_bytes > 0){
+            decoder.Feed(buffer.data(), recv_bytes);
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]){
+    ServerConfig config;
+    if (argc > 1 && std::string_view(argv[1]).substr(0, 13) == "--io-backend="){
+        config.io_backend = std::string(argv[1] + 13);
+    }
+    config.chat_limit = RateLimit{.rate_per_s = 1, .burst = 5}; // the 6th line throttles the client for a second
+    config.connect_rate_per_ip = 0;
+    config.heartbeat_interval_ms = 0;
+    config.history_messages = 0;
+
+    std::string port = PickFreePort();
+    std::string hostname = "127.0.0.1"s;
+    freopen("/dev/null", "w", stdout); // the server echoes every relayed message
+    Server server(hostname.data(), port.data(), config);
+    std::thread reactor_thread([&server](){
+        server.Start();
+    });
+
+    // The neighbour is inserted first, so removing it moves the throttled connection into its slot.
+    int neighbour_socketfd = ConnectClient(port, "neighbour");
+    int socketfd = ConnectClient(port, CHECK_NICKNAME);
+    timeval receive_timeout{.tv_sec = 0, .tv_usec = 100 * 1000};
+    setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+    FrameDecoder decoder;
+    decoder.SetVersion(ProtocolVersion::V2);
+
+    // Five lines within the burst, one overdraft, and the head of a 7th frame: 8 bytes, short enough to be kept inline by std::string.
+    std::string burst;
+    for (int i = 0; i < 6; ++i){
+        burst.append(AssembleFrame(ProtocolVersion::V2, Opcode::MESSAGE, "line "s + std::to_string(i)));
+    }
+    const std::string last_frame = AssembleFrame(ProtocolVersion::V2, Opcode::MESSAGE, "line 6");
+    const size_t head_length = V2_HEADER_LENGTH + 2;
+    burst.append(last_frame, 0, head_length);
+    bool passed = __SendAllBytes__(socketfd, burst.data(), burst.size()) != -1 && AwaitChatLine(socketfd, decoder, "line 5");
+
+    // While the client is throttled, its connection is moved by a swap-remove and by the table's reallocations.
+    close(neighbour_socketfd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(EVENT_WAIT_TIMEOUT));
+    std::vector<int> crowd_sockets;
+    for (size_t i = 0; passed && i < CHECK_CROWD_N; ++i){
+        crowd_sockets.push_back(ConnectClient(port, "crowd-"s + std::to_string(i)));
+    }
+
+    // After the resume, the retained head and the rest of the frame must make up the 7th line.
+    passed = passed && __SendAllBytes__(socketfd, last_frame.data() + head_length, last_frame.size() - head_length) != -1
+             && AwaitChatLine(socketfd, decoder, "line 6");
+
+    EXIT_SIGNAL = 1;
+    reactor_thread.join();
+    close(socketfd);
+    for (int crowd_socketfd : crowd_sockets){
+        close(crowd_socketfd);
+    }
+
+    if (!passed){
+        std::cerr << MakeColorfulText("[ThrottleCheck] FAIL: the frame retained by a throttled client hasn't survived its connection being moved."s, Color::Red) << '\n';
+        return 1;
+    }
+    std::cerr << MakeColorfulText("[ThrottleCheck] OK: the retained frame has been decoded after the resume."s, Color::Green) << '\n';
+    return 0;
+}
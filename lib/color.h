@@ -2,8 +2,9 @@
 
 #pragma once
 
+#include <array>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 
 using namespace std::string_literals;
 
@@ -15,14 +16,28 @@ enum class Color{
     Cyan = 4,
 };
 
+// ANSI escape sequences indexed by Color
+static constexpr std::array<std::string_view, 5> color_ansi_seqs = {"\u001b[31m", "\u001b[32m", "\u001b[33m", "\u001b[35m", "\u001b[36m"};
+static constexpr std::string_view ANSI_RESET_SEQ = "\u001b[0m"; // to limit text coloring to only our text chunk.
+
+static constexpr std::string_view ColorAnsiSeq(Color color) noexcept{
+    return color_ansi_seqs[static_cast<size_t>(color)];
+}
+
+// Length of a text once it's wrapped by AppendColorfulText()
+static constexpr size_t ColorfulTextLength(std::string_view text, Color color) noexcept{
+    return ColorAnsiSeq(color).size() + text.size() + ANSI_RESET_SEQ.size();
+}
+
+// Append a colored text to an existing buffer (no allocation if the buffer has the capacity).
+static void AppendColorfulText(std::string& buffer, std::string_view text, Color color){
+    buffer.append(ColorAnsiSeq(color)).append(text).append(ANSI_RESET_SEQ);
+}
+
 // Make a colored string using ANSI espace sequences
-static std::string MakeColorfulText(std::string&& text, Color color){
-    const std::unordered_map<Color, std::string> color_to_ansi_seq = {{Color::Red, "\u001b[31m"s}, {Color::Green, "\u001b[32m"s}, {Color::Yellow, "\u001b[33m"s}, {Color::Pink, "\u001b[35m"s}, {Color::Cyan, "\u001b[36m"s}};
-    std::string reset_seq = "\u001b[0m"; // to limit text coloring to only our text chunk.
+static std::string MakeColorfulText(std::string_view text, Color color){
     std::string ret_str;
-    ret_str.reserve(text.size() + 2);
-    ret_str += color_to_ansi_seq.at(color);
-    ret_str.append(std::move(text));
-    ret_str += reset_seq;
+    ret_str.reserve(ColorfulTextLength(text, color));
+    AppendColorfulText(ret_str, text, color);
     return ret_str;
-}
\ No newline at end of file
+}
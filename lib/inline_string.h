@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Fixed-capacity string stored inline (no heap allocation), for short bounded fields such as nicknames.
+ * @tparam Capacity max number of characters (up to 255)
+*/
+template <size_t Capacity>
+class InlineString{
+    static_assert(Capacity <= 255, "InlineString keeps its length in one byte");
+
+public:
+    InlineString() = default;
+
+    explicit InlineString(std::string_view str) noexcept{
+        Assign(str);
+    }
+
+    /**
+     * Replace the contents. A string longer than Capacity is truncated.
+    */
+    void Assign(std::string_view str) noexcept{
+        length_ = static_cast<uint8_t>(str.size() < Capacity ? str.size() : Capacity);
+        memcpy(data_, str.data(), length_);
+    }
+
+    std::string_view View() const noexcept{
+        return std::string_view(data_, length_);
+    }
+
+    std::string ToString() const{
+        return std::string(data_, length_);
+    }
+
+    size_t Size() const noexcept{
+        return length_;
+    }
+
+    bool Empty() const noexcept{
+        return length_ == 0;
+    }
+
+    void Clear() noexcept{
+        length_ = 0;
+    }
+
+private:
+    char data_[Capacity];
+    uint8_t length_ = 0;
+};
@@ -0,0 +1,308 @@
+// This file contains the asynchronous leveled logger: reactor threads format into a lock-free ring, a background thread writes it out
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "color.h"
+
+#define LOG_RING_SLOTS 4096 // power of 2
+#define LOG_SLOT_TEXT_SIZE 496 // longer records are truncated
+#define LOG_WRITE_BUFFER_SIZE (64 * 1024) // bytes gathered by the background thread before a write()
+#define LOG_IDLE_SLEEP_US 1000 // how long the background thread sleeps when the ring is empty
+
+enum class LogLevel : uint8_t{
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3
+};
+
+static constexpr std::array<std::string_view, 4> log_level_names = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+/**
+ * @return false if the name isn't one of "debug", "info", "warn", "error"
+*/
+static bool ParseLogLevel(std::string_view name, LogLevel& level) noexcept{
+    constexpr std::string_view names[] = {"debug", "info", "warn", "error"};
+    for (size_t i = 0; i < std::size(names); ++i){
+        if (name == names[i]){
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Leveled logger that takes console and file I/O off the calling threads.
+ * Log() copies the record into a bounded multi-producer ring (no lock, no allocation) and returns;
+ * a background thread drains the ring into a file or stderr. When the ring is full the record is dropped and counted,
+ * the caller never waits. Colors are applied (and the ANSI sequences already in the text kept) only if the sink is a TTY.
+ * Until Start() is called records are written synchronously to stderr.
+*/
+class Logger{
+public:
+    Logger(){
+        for (size_t i = 0; i < LOG_RING_SLOTS; ++i){
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    Logger(const Logger& other) = delete;
+    Logger& operator=(const Logger& other) = delete;
+
+    ~Logger(){
+        Stop();
+    }
+
+    /**
+     * Start the background thread.
+     * @param path file the records are appended to, empty for stderr
+     * @throws std::runtime_error if the file can't be opened.
+    */
+    void Start(const std::string& path = std::string()){
+        if (running_){
+            return;
+        }
+        if (!path.empty()){
+            sink_fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (sink_fd_ == -1){
+                throw std::runtime_error("open(): "s + path + ": "s + std::string(strerror(errno)));
+            }
+        }
+        sink_is_tty_ = isatty(sink_fd_) == 1;
+        write_buffer_ = std::make_unique<char[]>(LOG_WRITE_BUFFER_SIZE);
+        running_ = true;
+        thread_ = std::thread(&Logger::__Drain__, this);
+    }
+
+    // Write out everything logged so far and stop the background thread.
+    void Stop() noexcept{
+        if (!running_){
+            return;
+        }
+        running_ = false;
+        thread_.join();
+        if (sink_fd_ != STDERR_FILENO){
+            close(sink_fd_);
+            sink_fd_ = STDERR_FILENO;
+        }
+    }
+
+    void SetLevel(LogLevel level) noexcept{
+        min_level_.store(level, std::memory_order_relaxed);
+    }
+    bool Enabled(LogLevel level) const noexcept{
+        return level >= min_level_.load(std::memory_order_relaxed);
+    }
+
+    // Records dropped because the ring was full.
+    uint64_t DroppedCount() const noexcept{
+        return dropped_n_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Log the concatenation of the pieces. Never blocks and never allocates.
+    */
+    void Log(LogLevel level, std::initializer_list<std::string_view> parts) noexcept{
+        __Log__(level, NO_COLOR, parts);
+    }
+
+    /**
+     * Log the concatenation of the pieces, colored if the sink is a TTY (see MakeColorfulText()).
+    */
+    void LogColorful(LogLevel level, Color color, std::initializer_list<std::string_view> parts) noexcept{
+        __Log__(level, static_cast<int8_t>(color), parts);
+    }
+
+private:
+    static constexpr int8_t NO_COLOR = -1;
+
+    struct Slot{
+        std::atomic_size_t sequence; // == position: free for the producer of that position, == position + 1: ready for the consumer
+        int64_t time_ns;
+        LogLevel level;
+        int8_t color;
+        uint16_t length;
+        char text[LOG_SLOT_TEXT_SIZE];
+    };
+
+    static void __FillSlot__(Slot& slot, LogLevel level, int8_t color, std::initializer_list<std::string_view> parts) noexcept{
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        slot.time_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        slot.level = level;
+        slot.color = color;
+        size_t length = 0;
+        for (std::string_view part : parts){
+            size_t n = std::min(part.size(), sizeof(slot.text) - length);
+            memcpy(slot.text + length, part.data(), n);
+            length += n;
+        }
+        if (length == sizeof(slot.text)){ // mark the truncation
+            memcpy(slot.text + length - 3, "...", 3);
+        }
+        slot.length = static_cast<uint16_t>(length);
+    }
+
+    void __Log__(LogLevel level, int8_t color, std::initializer_list<std::string_view> parts) noexcept{
+        if (!Enabled(level)){
+            return;
+        }
+        if (!running_.load(std::memory_order_acquire)){ // not started (or already stopped): write right away
+            Slot slot;
+            __FillSlot__(slot, level, color, parts);
+            char line[LOG_SLOT_TEXT_SIZE + 64];
+            size_t line_length = __FormatRecord__(slot, isatty(STDERR_FILENO) == 1, line);
+            ssize_t written_n = write(STDERR_FILENO, line, line_length);
+            (void)written_n;
+            return;
+        }
+
+        size_t position = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true){
+            slot = &slots_[position & (LOG_RING_SLOTS - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t distance = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (distance == 0){
+                if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+                    break;
+                }
+            } else if (distance < 0){ // the consumer hasn't freed the slot yet: the ring is full
+                dropped_n_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else{ // another producer has taken the position
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+        __FillSlot__(*slot, level, color, parts);
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    /**
+     * Format "HH:MM:SS.mmm LEVEL text\n" into the line buffer (at least LOG_SLOT_TEXT_SIZE + 64 bytes),
+     * colored for a TTY, with the ANSI sequences of the text removed otherwise.
+     * @return line length
+    */
+    static size_t __FormatRecord__(const Slot& slot, bool colored, char* line) noexcept{
+        time_t seconds = static_cast<time_t>(slot.time_ns / 1000000000);
+        tm local_time;
+        localtime_r(&seconds, &local_time);
+        size_t length = strftime(line, 16, "%H:%M:%S", &local_time);
+        length += snprintf(line + length, 16, ".%03d ", static_cast<int>(slot.time_ns / 1000000 % 1000));
+        memcpy(line + length, log_level_names[static_cast<size_t>(slot.level)].data(), 5);
+        length += 5;
+        line[length++] = ' ';
+
+        std::string_view text(slot.text, slot.length);
+        if (colored){
+            if (slot.color != NO_COLOR){
+                std::string_view color_seq = ColorAnsiSeq(static_cast<Color>(slot.color));
+                memcpy(line + length, color_seq.data(), color_seq.size());
+                length += color_seq.size();
+            }
+            memcpy(line + length, text.data(), text.size());
+            length += text.size();
+            if (slot.color != NO_COLOR){
+                memcpy(line + length, ANSI_RESET_SEQ.data(), ANSI_RESET_SEQ.size());
+                length += ANSI_RESET_SEQ.size();
+            }
+        } else{
+            for (size_t i = 0; i < text.size(); ++i){
+                if (text[i] == '\x1b' && i + 1 < text.size() && text[i + 1] == '['){ // skip "ESC[...m"
+                    size_t end = text.find('m', i);
+                    if (end != text.npos){
+                        i = end;
+                        continue;
+                    }
+                }
+                line[length++] = text[i];
+            }
+        }
+        line[length++] = '\n';
+        return length;
+    }
+
+    void __Drain__() noexcept{
+        uint64_t reported_dropped_n = 0;
+        while (true){
+            bool stopping = !running_.load(std::memory_order_acquire); // read before draining: nothing logged before Stop() is lost
+            size_t drained_n = 0;
+            Slot* slot;
+            while ((slot = &slots_[tail_ & (LOG_RING_SLOTS - 1)])->sequence.load(std::memory_order_acquire) == tail_ + 1){
+                if (buffered_ + LOG_SLOT_TEXT_SIZE + 64 > LOG_WRITE_BUFFER_SIZE){
+                    __WriteBuffer__();
+                }
+                buffered_ += __FormatRecord__(*slot, sink_is_tty_, write_buffer_.get() + buffered_);
+                slot->sequence.store(tail_ + LOG_RING_SLOTS, std::memory_order_release);
+                ++tail_;
+                ++drained_n;
+            }
+            uint64_t dropped_n = dropped_n_.load(std::memory_order_relaxed);
+            if (dropped_n != reported_dropped_n){
+                std::string notice = "[Logger] "s + std::to_string(dropped_n - reported_dropped_n) + " messages were dropped (the log can't keep up)."s;
+                Slot notice_slot;
+                __FillSlot__(notice_slot, LogLevel::WARN, static_cast<int8_t>(Color::Yellow), {notice});
+                if (buffered_ + LOG_SLOT_TEXT_SIZE + 64 > LOG_WRITE_BUFFER_SIZE){
+                    __WriteBuffer__();
+                }
+                buffered_ += __FormatRecord__(notice_slot, sink_is_tty_, write_buffer_.get() + buffered_);
+                reported_dropped_n = dropped_n;
+            }
+            __WriteBuffer__();
+            if (stopping){
+                return;
+            }
+            if (drained_n == 0){
+                std::this_thread::sleep_for(std::chrono::microseconds(LOG_IDLE_SLEEP_US));
+            }
+        }
+    }
+
+    void __WriteBuffer__() noexcept{
+        size_t written = 0;
+        while (written < buffered_){
+            ssize_t written_n = write(sink_fd_, write_buffer_.get() + written, buffered_ - written);
+            if (written_n == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                break; // nowhere to report it
+            }
+            written += written_n;
+        }
+        buffered_ = 0;
+    }
+
+    Slot slots_[LOG_RING_SLOTS];
+    alignas(64) std::atomic_size_t head_{0}; // next position to be claimed by a producer
+    alignas(64) size_t tail_ = 0; // next position to be read by the background thread
+    std::atomic_uint64_t dropped_n_{0};
+    std::atomic<LogLevel> min_level_{LogLevel::INFO};
+    std::atomic_bool running_{false};
+
+    int sink_fd_ = STDERR_FILENO;
+    bool sink_is_tty_ = false;
+    std::unique_ptr<char[]> write_buffer_;
+    size_t buffered_ = 0;
+    std::thread thread_;
+};
+
+inline Logger LOGGER; // shared by every thread of the process
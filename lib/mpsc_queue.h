@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/**
+ * Unbounded lock-free multi-producer single-consumer queue (D. Vyukov's node-based algorithm).
+ * Push() may be called from any thread, Pop() only from the owning (consumer) thread.
+*/
+template <typename T>
+class MpscQueue{
+public:
+    MpscQueue(){
+        Node* stub = new Node();
+        head_.store(stub);
+        tail_ = stub;
+    }
+
+    MpscQueue(const MpscQueue& other) = delete;
+    MpscQueue& operator=(const MpscQueue& other) = delete;
+
+    ~MpscQueue(){
+        T value;
+        while (Pop(value)) {}
+        delete tail_;
+    }
+
+    // Wait-free for producers: one exchange and one store.
+    void Push(T&& value){
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* prev = head_.exchange(node, std::memory_order_seq_cst);
+        prev->next.store(node, std::memory_order_seq_cst);
+    }
+
+    /**
+     * @param value set to the oldest element on success
+     * @return false if the queue is empty (or a producer is in the middle of Push())
+    */
+    bool Pop(T& value){
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_seq_cst);
+        if (next == nullptr){
+            return false;
+        }
+        value = std::move(next->value);
+        tail_ = next; // next becomes the new stub
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node{
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    std::atomic<Node*> head_; // last pushed node (producers' side)
+    Node* tail_; // stub node, its successor is the oldest element (consumer's side)
+};
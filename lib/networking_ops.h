@@ -5,15 +5,24 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h> // close()
+#include <fcntl.h>
+#include <sys/ioctl.h>
 
 #include <poll.h>
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h> // snprintf()
 #include <stdexcept>
 #include <string.h>
 #include <iostream>
 
+#include <array>
+#include <cctype>
+#include <iterator>
 #include <string>
+#include <string_view>
+#include <utility>
 
 #include "color.h"
 
@@ -38,16 +47,156 @@ enum class NicknameAction{
     NICK_INVALD = 3
 };
 
-static const std::unordered_map<NicknameAction, std::string> nickaction_to_keysig_string = {{NicknameAction::NICK_PROMPT, "\07NICK_PROMPT"s}, {NicknameAction::NICK_ACCEPT, "\07NICK_ACCEPT"s}, {NicknameAction::NICK_STAKEN, "\07NICK_STAKEN"s}, {NicknameAction::NICK_INVALD, "\07NICK_INVALD"s}};
+/**
+ * Wire protocol versions.
+ * v1: <4 ASCII digits of the message length><message>, commands are text key signals ("\07NICK_ACCEPT...").
+ * v2: <u32 payload length, big endian><u8 opcode><u8 flags><payload>.
+ * Every connection starts with v1; a client may upgrade by answering NICK_PROMPT with PROTO_UPGRD,
+ * and both sides switch to v2 right after the server's PROTO_ACCPT.
+*/
+enum class ProtocolVersion{
+    V1 = 1,
+    V2 = 2
+};
+
+// Kind of a frame. In v1 every opcode except MESSAGE travels as a "\07" + 11-character key signal.
+enum class Opcode : uint8_t{
+    MESSAGE = 0x00, // chat text
+    // server -> client
+    NICK_PROMPT = 0x01,
+    NICK_ACCEPT = 0x02,
+    NICK_STAKEN = 0x03,
+    NICK_INVALD = 0x04,
+    PROTO_ACCPT = 0x05,
+    // client -> server
+    PROTO_UPGRD = 0x10,
+    NICK_NEWREQ = 0x11,
+    ACT_NICKCNG = 0x12,
+    ACT_LSUSERS = 0x13,
+    ACT_PMSGUSR = 0x14,
+    ACT_CHNJOIN = 0x15,
+    ACT_CHNLEAV = 0x16,
+    ACT_CHNMSGS = 0x17,
+    // heartbeat (the server pings a silent v2 client, either side answers a ping)
+    HEARTB_PING = 0x20,
+    HEARTB_PONG = 0x21,
+
+    UNKNOWN = 0xFF // v1 key signal that isn't recognized
+};
+
+#define FRAME_FLAG_NOTICE 0x01 // v2: the message is a server notice (connections, errors), not a user's chat line
+
+#define KEY_SIGNAL_CHAR '\07'
+#define KEY_SIGNAL_LENGTH 11 // bytes of a key signal name after KEY_SIGNAL_CHAR
+
+static constexpr std::pair<Opcode, std::string_view> opcode_key_signals[] = {
+    {Opcode::NICK_PROMPT, "NICK_PROMPT"}, {Opcode::NICK_ACCEPT, "NICK_ACCEPT"}, {Opcode::NICK_STAKEN, "NICK_STAKEN"},
+    {Opcode::NICK_INVALD, "NICK_INVALD"}, {Opcode::PROTO_ACCPT, "PROTO_ACCPT"}, {Opcode::PROTO_UPGRD, "PROTO_UPGRD"},
+    {Opcode::NICK_NEWREQ, "NICK_NEWREQ"}, {Opcode::ACT_NICKCNG, "ACT_NICKCNG"}, {Opcode::ACT_LSUSERS, "ACT_LSUSERS"},
+    {Opcode::ACT_PMSGUSR, "ACT_PMSGUSR"}, {Opcode::ACT_CHNJOIN, "ACT_CHNJOIN"}, {Opcode::ACT_CHNLEAV, "ACT_CHNLEAV"},
+    {Opcode::ACT_CHNMSGS, "ACT_CHNMSGS"}, {Opcode::HEARTB_PING, "HEARTB_PING"}, {Opcode::HEARTB_PONG, "HEARTB_PONG"}
+};
+
+#define KEY_SIGNAL_TABLE_SIZE 128 // slots of the key signal hash table (power of 2)
+
+// FNV-1a hash of a key signal name, reduced to a slot of the key signal table.
+static constexpr size_t KeySignalHash(std::string_view key_signal) noexcept{
+    uint32_t hash = 2166136261u;
+    for (char c : key_signal){
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash & (KEY_SIGNAL_TABLE_SIZE - 1);
+}
+
+/**
+ * Build the perfect hash table of the key signals: slot -> index in opcode_key_signals + 1 (0 = empty slot).
+ * A collision isn't a constant expression, so adding a colliding key signal breaks the build instead of slowing the lookup down.
+*/
+static constexpr std::array<uint8_t, KEY_SIGNAL_TABLE_SIZE> __BuildKeySignalTable__(){
+    std::array<uint8_t, KEY_SIGNAL_TABLE_SIZE> table{};
+    for (size_t i = 0; i < std::size(opcode_key_signals); ++i){
+        size_t slot = KeySignalHash(opcode_key_signals[i].second);
+        if (table[slot] != 0){
+            throw std::logic_error("key signal hash collision: grow KEY_SIGNAL_TABLE_SIZE");
+        }
+        table[slot] = static_cast<uint8_t>(i + 1);
+    }
+    return table;
+}
+
+// opcode -> its key signal name, empty for MESSAGE and unknown opcodes
+static constexpr std::array<std::string_view, 256> __BuildOpcodeNames__(){
+    std::array<std::string_view, 256> names{};
+    for (const auto& [opcode, key_signal] : opcode_key_signals){
+        names[static_cast<uint8_t>(opcode)] = key_signal;
+    }
+    return names;
+}
+
+static constexpr std::array<uint8_t, KEY_SIGNAL_TABLE_SIZE> key_signal_table = __BuildKeySignalTable__();
+static constexpr std::array<std::string_view, 256> opcode_names = __BuildOpcodeNames__();
+
+// @return v1 key signal name of an opcode, empty for MESSAGE and unknown opcodes
+static constexpr std::string_view OpcodeKeySignal(Opcode opcode) noexcept{
+    return opcode_names[static_cast<uint8_t>(opcode)];
+}
+
+// @return opcode of a v1 key signal name (one hash and one comparison), UNKNOWN if there is no such key signal
+static Opcode KeySignalOpcode(std::string_view key_signal) noexcept{
+    if (key_signal.size() != KEY_SIGNAL_LENGTH){
+        return Opcode::UNKNOWN;
+    }
+    uint8_t entry = key_signal_table[KeySignalHash(key_signal)];
+    if (entry == 0 || opcode_key_signals[entry - 1].second != key_signal){
+        return Opcode::UNKNOWN;
+    }
+    return opcode_key_signals[entry - 1].first;
+}
+
+static Opcode NicknameActionOpcode(NicknameAction nick_action) noexcept{
+    switch (nick_action){
+        case NicknameAction::NICK_PROMPT: return Opcode::NICK_PROMPT;
+        case NicknameAction::NICK_ACCEPT: return Opcode::NICK_ACCEPT;
+        case NicknameAction::NICK_STAKEN: return Opcode::NICK_STAKEN;
+        default: return Opcode::NICK_INVALD;
+    }
+}
+
+// A decoded frame of either protocol version.
+struct Frame{
+    Opcode opcode = Opcode::MESSAGE;
+    uint8_t flags = 0;
+    std::string_view payload; // v1 commands: the bytes after the key signal
+};
+
+/**
+ * Translate a v1 message into a frame: "\07" + key signal + arguments is a command, anything else is chat text.
+ * @param message a v1 message without the length header
+ * @return frame whose payload points into message. An unrecognized key signal gives UNKNOWN with the whole command as the payload.
+*/
+static Frame ParseV1Message(std::string_view message) noexcept{
+    if (message.empty() || message[0] != KEY_SIGNAL_CHAR){
+        return Frame{.opcode = Opcode::MESSAGE, .payload = message};
+    }
+    std::string_view command = message.substr(1);
+    Opcode opcode = KeySignalOpcode(command.substr(0, KEY_SIGNAL_LENGTH));
+    if (opcode != Opcode::UNKNOWN){
+        return Frame{.opcode = opcode, .payload = command.substr(KEY_SIGNAL_LENGTH)};
+    }
+    return Frame{.opcode = Opcode::UNKNOWN, .payload = command};
+}
 
-// Remove leading and trailing spaces from a string.
+// Remove leading and trailing spaces from a string (at most one erase() from each end).
 static void StipString(std::string& str){
-    while (!str.empty() && std::isspace(*str.begin())){
-        str.erase(str.begin());
+    size_t begin = 0, end = str.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(str[begin]))){
+        ++begin;
     }
-    while(!str.empty() && std::isspace(*str.rbegin())){
-        str.erase(str.length() - 1);
+    while (end > begin && std::isspace(static_cast<unsigned char>(str[end - 1]))){
+        --end;
     }
+    str.erase(end);
+    str.erase(0, begin);
 }
 
 /**
@@ -63,6 +212,31 @@ static void SetSocketOption(int socketfd, int socket_option){
     }
 }
 
+/**
+ * Switch a socket to the non-blocking mode (O_NONBLOCK).
+ * @param socketfd a socket file descriptor
+ * @return 0 on success, -1 on error with errno set
+*/
+static int SetNonBlocking(int socketfd){
+    int flags = fcntl(socketfd, F_GETFL, 0);
+    if (flags == -1){
+        return -1;
+    }
+    return fcntl(socketfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @param socketfd a socket file descriptor
+ * @return number of bytes that can be read from the socket without blocking, -1 on error with errno set
+*/
+static int BytesAvailable(int socketfd){
+    int bytes_n = 0;
+    if (ioctl(socketfd, FIONREAD, &bytes_n) == -1){
+        return -1;
+    }
+    return bytes_n;
+}
+
 /**
  * Convert sockaddr_storage structure to an IPv4 or IPv6 address.
  * @param conn_address pointer to the address-holding structure
@@ -93,49 +267,183 @@ static ConnectionInfo GetConnectionInfoFromSocket(int socketfd){
     return GetConnectionInfo(&addr_inf);
 }
 
+#define PEER_ADDRESS_STRLEN (INET6_ADDRSTRLEN + 9) // "(" + address + ":" + 5 port digits + ")" + '\0'
 
-// Pack a message into a communication packet: <msg_len><msg>
-static std::string AssembleMessagePacket(std::string&& original_message){
-    int orig_msg_len = original_message.size();
-    std::string assembled_msg(std::to_string(orig_msg_len));
-    assembled_msg.reserve(4 + orig_msg_len); 
-    while (assembled_msg.size() < 4){ // 4 bytes = 4 digits in MESSAGE_MAX_LEN
-        assembled_msg = '0' + assembled_msg;
+/**
+ * Binary IPv4/IPv6 address and port (20 bytes), cheap enough to be cached per connection and formatted only when displayed.
+*/
+struct PeerAddress{
+    sa_family_t family = AF_UNSPEC;
+    uint16_t port = 0; // host byte order
+    uint8_t ip[16] = {};
+
+    ConnectionInfo ToConnectionInfo() const{
+        char address[INET6_ADDRSTRLEN];
+        memset(&address, 0, sizeof(address));
+        if (family == AF_INET || family == AF_INET6){
+            inet_ntop(family, ip, address, sizeof(address));
+        }
+        return ConnectionInfo{.ip_address = address, .port = port};
     }
-    assembled_msg.append(std::move(original_message));
-    return assembled_msg;
+
+    /**
+     * Format as "(<ip>:<port>)" (like ConnectionInfo::ToString()) without allocating.
+     * @return a view into buffer
+    */
+    std::string_view Format(char (&buffer)[PEER_ADDRESS_STRLEN]) const noexcept{
+        size_t length = 0;
+        buffer[length++] = '(';
+        if ((family == AF_INET || family == AF_INET6) && inet_ntop(family, ip, buffer + length, INET6_ADDRSTRLEN) != nullptr){
+            length += strlen(buffer + length);
+        }
+        length += snprintf(buffer + length, PEER_ADDRESS_STRLEN - length, ":%u)", static_cast<unsigned>(port));
+        return std::string_view(buffer, length);
+    }
+
+    std::string ToString() const{
+        char buffer[PEER_ADDRESS_STRLEN];
+        return std::string(Format(buffer));
+    }
+};
+
+static PeerAddress MakePeerAddress(const sockaddr_storage* conn_address) noexcept{
+    PeerAddress peer_address;
+    if (conn_address->ss_family == AF_INET){ // IPv4
+        const sockaddr_in* addr_inf = reinterpret_cast<const sockaddr_in*>(conn_address);
+        peer_address.family = AF_INET;
+        peer_address.port = ntohs(addr_inf->sin_port);
+        memcpy(peer_address.ip, &addr_inf->sin_addr, sizeof(addr_inf->sin_addr));
+    } else if (conn_address->ss_family == AF_INET6){ // IPv6
+        const sockaddr_in6* addr_inf = reinterpret_cast<const sockaddr_in6*>(conn_address);
+        peer_address.family = AF_INET6;
+        peer_address.port = ntohs(addr_inf->sin6_port);
+        memcpy(peer_address.ip, &addr_inf->sin6_addr, sizeof(addr_inf->sin6_addr));
+    }
+    return peer_address;
+}
+
+static PeerAddress GetPeerAddressFromSocket(int socketfd) noexcept{
+    sockaddr_storage addr_inf;
+    memset(&addr_inf, 0, sizeof(addr_inf));
+    socklen_t addr_inf_len = sizeof(addr_inf);
+    getpeername(socketfd, reinterpret_cast<sockaddr*>(&addr_inf), &addr_inf_len);
+    return MakePeerAddress(&addr_inf);
 }
-static std::string AssembleMessagePacket(const std::string& original_message){
-    int orig_msg_len = original_message.size();
-    std::string assembled_msg(std::to_string(orig_msg_len));
-    assembled_msg.reserve(4 + orig_msg_len); 
-    while (assembled_msg.size() < 4){ // 4 bytes = 4 digits in MESSAGE_MAX_LEN
-        assembled_msg = '0' + assembled_msg;
+
+
+#define V1_HEADER_LENGTH 4 // 4 ASCII digits of the message length
+#define V1_MAX_MESSAGE_LENGTH 9999
+#define V2_HEADER_LENGTH 6 // u32 payload length + u8 opcode + u8 flags
+#define V2_MAX_PAYLOAD_LENGTH (1024 * 1024) // larger frames are treated as a protocol violation
+
+/**
+ * Pack a frame for a peer speaking the given protocol version at the end of a buffer,
+ * so that many frames can be batched into one send.
+ * v1 has no flags and can't carry more than V1_MAX_MESSAGE_LENGTH bytes, so a longer payload is truncated.
+ * @param payload chat text or the arguments of a command
+*/
+static void AppendFrame(std::string& buffer, ProtocolVersion version, Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    size_t offset = buffer.size();
+    if (version == ProtocolVersion::V2){
+        buffer.resize(offset + V2_HEADER_LENGTH + payload.size());
+        char* frame = buffer.data() + offset;
+        uint32_t payload_length = htonl(static_cast<uint32_t>(payload.size()));
+        memcpy(frame, &payload_length, sizeof(payload_length));
+        frame[4] = static_cast<char>(opcode);
+        frame[5] = static_cast<char>(flags);
+        memcpy(frame + V2_HEADER_LENGTH, payload.data(), payload.size());
+        return;
+    }
+    std::string_view key_signal = opcode != Opcode::MESSAGE ? OpcodeKeySignal(opcode) : std::string_view();
+    size_t prefix_length = key_signal.empty() ? 0 : 1 + key_signal.size();
+    payload = payload.substr(0, V1_MAX_MESSAGE_LENGTH - prefix_length);
+    size_t message_length = prefix_length + payload.size();
+
+    buffer.resize(offset + V1_HEADER_LENGTH + message_length);
+    char* frame = buffer.data() + offset;
+    for (size_t i = V1_HEADER_LENGTH, length = message_length; i > 0; --i, length /= 10){ // zero-padded decimal length
+        frame[i - 1] = static_cast<char>('0' + length % 10);
     }
-    assembled_msg.append(original_message);
-    return assembled_msg;
+    if (prefix_length > 0){
+        frame[V1_HEADER_LENGTH] = KEY_SIGNAL_CHAR;
+        memcpy(frame + V1_HEADER_LENGTH + 1, key_signal.data(), key_signal.size());
+    }
+    memcpy(frame + V1_HEADER_LENGTH + prefix_length, payload.data(), payload.size());
+}
+
+/**
+ * Pack a frame into an existing buffer (replacing its contents), so that a reused buffer doesn't allocate (see AppendFrame()).
+*/
+static void AssembleFrameInto(std::string& frame, ProtocolVersion version, Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    frame.clear();
+    AppendFrame(frame, version, opcode, payload, flags);
+}
+
+/**
+ * Pack a frame for a peer speaking the given protocol version (see AssembleFrameInto()).
+*/
+static std::string AssembleFrame(ProtocolVersion version, Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    std::string frame;
+    AssembleFrameInto(frame, version, opcode, payload, flags);
+    return frame;
+}
+
+// Pack a message into a v1 communication packet: <msg_len><msg> (a message over V1_MAX_MESSAGE_LENGTH bytes is truncated).
+static std::string AssembleMessagePacket(std::string_view original_message){
+    return AssembleFrame(ProtocolVersion::V1, Opcode::MESSAGE, original_message);
 }
 
 /**
  * SendMessage's internal-use method. Makes sure that all message bytes are sent.
+ * A non-blocking socket is waited on with poll() whenever its send buffer is full.
  * @param receiver_socketfd a socket we are sending the message to
  * @param msg_buffer a pointer to a message string storage
  * @param message_len length of the message to be delivered
- * @throw std::runtime_error on send() -1 return
+ * @return 0 on success, -1 on error with errno set
 */
 static int __SendAllBytes__(int receiver_socketfd, const char* msg_buffer, size_t message_length){
-    int total = 0; // how many bytes we've sent
-    int left_bytes = message_length; // how many bytes are left to send
-    int sent_bytes_n;
+    size_t total = 0; // how many bytes we've sent
     while (total < message_length){
-        sent_bytes_n = send(receiver_socketfd, msg_buffer + total, left_bytes, 0);
-        if (sent_bytes_n == -1) break;
-
+        ssize_t sent_bytes_n = send(receiver_socketfd, msg_buffer + total, message_length - total, MSG_NOSIGNAL);
+        if (sent_bytes_n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                pollfd writable_pollfd{.fd = receiver_socketfd, .events = POLLOUT, .revents = 0};
+                if (poll(&writable_pollfd, 1, -1) == -1 && errno != EINTR){
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
         total += sent_bytes_n;
-        left_bytes -= sent_bytes_n;
     }
 
-    return sent_bytes_n == -1 ? -1 : 0; // -1 on failure, 0 on success
+    return 0;
+}
+
+/**
+ * ReceiveMessage's internal-use method. Makes sure that exactly message_length bytes are read from a blocking socket.
+ * @return message_length on success, 0 if the socket has been closed, -1 on error with errno set
+*/
+static int __RecvAllBytes__(int sender_socketfd, char* msg_buffer, size_t message_length){
+    size_t total = 0;
+    while (total < message_length){
+        ssize_t recv_bytes_n = recv(sender_socketfd, msg_buffer + total, message_length - total, 0);
+        if (recv_bytes_n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if (recv_bytes_n == 0){
+            return 0;
+        }
+        total += recv_bytes_n;
+    }
+    return static_cast<int>(total);
 }
 
 /**
@@ -144,15 +452,7 @@ static int __SendAllBytes__(int receiver_socketfd, const char* msg_buffer, size_
  * @param message data to be sent.
  * @return 0 on success, -1 on error with errno set. 
 */
-static int SendMessage(int receiver_socketfd, std::string&& message){
-    std::string final_msg(AssembleMessagePacket(std::move(message)));
-    // std::cerr << "Sending: " << final_msg << '\n';
-    if (__SendAllBytes__(receiver_socketfd, final_msg.data(), final_msg.size()) == -1){
-        return -1;
-    }
-    return 0;
-}
-static int SendMessage(int receiver_socketfd, const std::string& message){
+static int SendMessage(int receiver_socketfd, std::string_view message){
     std::string final_msg(AssembleMessagePacket(message));
     // std::cerr << "Sending: " << final_msg << '\n';
     if (__SendAllBytes__(receiver_socketfd, final_msg.data(), final_msg.size()) == -1){
@@ -162,33 +462,224 @@ static int SendMessage(int receiver_socketfd, const std::string& message){
 }
 
 /**
- * Receive a message packet coming in the format: <msg_length><msg> and write <msg> to message_buffer.
+ * Receive a message packet coming in the format: <msg_length><msg> from a blocking socket and write <msg> to message_buffer.
  * @param sender_socketfd socket of a message sender
  * @param message_buffer a buffer to where the received message will to be written
  * @return length of the received message on success, 0 if sender_socketfd has closed the connection, -1 on error with errno set
 */
 static int ReceiveMessage(int sender_socketfd, char* message_buffer){
-    char msg_len_str[4];
+    char msg_len_str[5];
     memset(&msg_len_str, 0, sizeof(msg_len_str));
 
-    int recv_bytes = recv(sender_socketfd, msg_len_str, 4, 0); // recv_msg_length
-    if (recv_bytes == -1){
-        return -1;
-    }
-    else if (recv_bytes == 0){
-        return 0;
+    int recv_bytes = __RecvAllBytes__(sender_socketfd, msg_len_str, 4); // recv_msg_length
+    if (recv_bytes <= 0){
+        return recv_bytes;
     }
 
     int msg_len = std::atoi(msg_len_str);
 
-    memset(message_buffer, 0, sizeof(*message_buffer));
-    recv_bytes = recv(sender_socketfd, message_buffer, msg_len, 0);
-    if (recv_bytes == -1){
-        return -1;
-    }
-    else if (recv_bytes == 0){
-        return 0;
+    recv_bytes = __RecvAllBytes__(sender_socketfd, message_buffer, msg_len);
+    if (recv_bytes <= 0){
+        return recv_bytes;
     }
+    message_buffer[msg_len] = '\0';
     // std::cerr << "Received: "s << message_buffer << std::endl;
     return recv_bytes;
-}
\ No newline at end of file
+}
+
+/**
+ * Assemble a frame for the given protocol version and send it to another socket.
+ * @return 0 on success, -1 on error with errno set
+*/
+static int SendFrame(int receiver_socketfd, ProtocolVersion version, Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    std::string frame(AssembleFrame(version, opcode, payload, flags));
+    if (__SendAllBytes__(receiver_socketfd, frame.data(), frame.size()) == -1){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receive one frame of the given protocol version from a blocking socket.
+ * @param payload_storage receives the frame's bytes, the decoded payload points into it
+ * @param frame set to the received frame on success (v1 messages are translated with ParseV1Message())
+ * @return 1 on success, 0 if sender_socketfd has closed the connection, -1 on error with errno set (EPROTO for a malformed header)
+*/
+static int ReceiveFrame(int sender_socketfd, ProtocolVersion version, std::string& payload_storage, Frame& frame){
+    char header[V2_HEADER_LENGTH];
+    size_t header_length = version == ProtocolVersion::V2 ? V2_HEADER_LENGTH : V1_HEADER_LENGTH;
+    int recv_bytes = __RecvAllBytes__(sender_socketfd, header, header_length);
+    if (recv_bytes <= 0){
+        return recv_bytes;
+    }
+
+    size_t payload_length = 0;
+    if (version == ProtocolVersion::V2){
+        uint32_t network_length;
+        memcpy(&network_length, header, sizeof(network_length));
+        payload_length = ntohl(network_length);
+        if (payload_length > V2_MAX_PAYLOAD_LENGTH){
+            errno = EPROTO;
+            return -1;
+        }
+    } else{
+        for (size_t i = 0; i < V1_HEADER_LENGTH; ++i){
+            if (header[i] < '0' || header[i] > '9'){
+                errno = EPROTO;
+                return -1;
+            }
+            payload_length = payload_length * 10 + (header[i] - '0');
+        }
+    }
+
+    payload_storage.resize(payload_length);
+    if (payload_length > 0 && (recv_bytes = __RecvAllBytes__(sender_socketfd, payload_storage.data(), payload_length)) <= 0){
+        return recv_bytes;
+    }
+    if (version == ProtocolVersion::V2){
+        frame = Frame{.opcode = static_cast<Opcode>(header[4]), .flags = static_cast<uint8_t>(header[5]), .payload = payload_storage};
+    } else{
+        frame = ParseV1Message(payload_storage);
+    }
+    return 1;
+}
+
+/**
+ * Resumable decoder of v1 (<msg_length><msg>) and v2 (<length><opcode><flags><payload>) frames for non-blocking sockets.
+ * Feed() it with whatever a single recv() returned and pull complete frames with NextFrame();
+ * an incomplete frame tail is kept inside the decoder until the rest of it arrives.
+*/
+class FrameDecoder{
+public:
+    /**
+     * Give the decoder a new chunk of received bytes. The chunk only has to stay alive until NextFrame() returns 0 or -1:
+     * if nothing has been buffered yet, the frames are decoded right from the chunk without copying it.
+    */
+    void Feed(const char* data, size_t data_length){
+        if (buffer_.empty()){
+            input_ = std::string_view(data, data_length);
+            input_in_buffer_ = false;
+        } else{
+            buffer_.append(data, data_length);
+            input_ = std::string_view(buffer_);
+            input_in_buffer_ = true;
+        }
+    }
+
+    /**
+     * Switch the framing of the bytes that follow the last extracted frame (used right after the protocol upgrade).
+    */
+    void SetVersion(ProtocolVersion version) noexcept{
+        version_ = version;
+    }
+
+    ProtocolVersion Version() const noexcept{
+        return version_;
+    }
+
+    /**
+     * Extract the next complete frame from the fed data.
+     * @param frame set to the decoded frame on success. Its payload is valid until the next Feed()/NextFrame() call.
+     * @return 1 if a frame has been extracted, 0 if more data is needed, -1 if the frame header is malformed
+    */
+    int NextFrame(Frame& frame){
+        __RebaseInput__();
+        int status = version_ == ProtocolVersion::V2 ? __NextFrameV2__(frame) : __NextFrameV1__(frame);
+        if (status == 0){
+            __KeepTail__();
+        }
+        return status;
+    }
+
+    /**
+     * Keep the bytes that haven't been extracted yet (complete frames included) inside the decoder, so that decoding
+     * can be paused and resumed after the fed chunk is gone.
+    */
+    void Retain(){
+        __RebaseInput__();
+        __KeepTail__();
+    }
+
+    // Number of bytes of an incomplete packet waiting for the rest of its data.
+    size_t BufferedBytes() const noexcept{
+        return buffer_.size();
+    }
+
+    void Reset() noexcept{
+        buffer_.clear();
+        input_ = std::string_view();
+        input_in_buffer_ = false;
+    }
+
+private:
+    int __NextFrameV1__(Frame& frame){
+        if (input_.size() < V1_HEADER_LENGTH){
+            return 0;
+        }
+        size_t msg_len = 0;
+        for (size_t i = 0; i < V1_HEADER_LENGTH; ++i){
+            char c = input_[i];
+            if (c < '0' || c > '9'){
+                Reset();
+                return -1;
+            }
+            msg_len = msg_len * 10 + (c - '0');
+        }
+        if (input_.size() < V1_HEADER_LENGTH + msg_len){
+            return 0;
+        }
+        frame = ParseV1Message(input_.substr(V1_HEADER_LENGTH, msg_len));
+        input_.remove_prefix(V1_HEADER_LENGTH + msg_len);
+        return 1;
+    }
+
+    int __NextFrameV2__(Frame& frame){
+        if (input_.size() < V2_HEADER_LENGTH){
+            return 0;
+        }
+        uint32_t network_length;
+        memcpy(&network_length, input_.data(), sizeof(network_length));
+        size_t payload_length = ntohl(network_length);
+        if (payload_length > V2_MAX_PAYLOAD_LENGTH){
+            Reset();
+            return -1;
+        }
+        if (input_.size() < V2_HEADER_LENGTH + payload_length){
+            return 0;
+        }
+        frame.opcode = static_cast<Opcode>(input_[4]);
+        frame.flags = static_cast<uint8_t>(input_[5]);
+        frame.payload = input_.substr(V2_HEADER_LENGTH, payload_length);
+        input_.remove_prefix(V2_HEADER_LENGTH + payload_length);
+        return 1;
+    }
+
+    /**
+     * Point a buffered input back into buffer_. The decoder lives inside a Connection that the ConnectionTable moves
+     * (swap-remove, reallocation), and moving a short, inline-stored std::string moves its bytes too: a view kept across
+     * the move would read freed memory. Buffered input always ends where buffer_ ends, so its size is enough to find it.
+    */
+    void __RebaseInput__() noexcept{
+        if (input_in_buffer_){
+            input_ = std::string_view(buffer_).substr(buffer_.size() - input_.size());
+        }
+    }
+
+    // Move the unparsed rest of the input into the decoder's own buffer so that the caller can reuse its chunk.
+    void __KeepTail__(){
+        if (input_.empty()){
+            buffer_.clear();
+        } else if (input_in_buffer_){
+            buffer_.erase(0, buffer_.size() - input_.size());
+        } else{
+            buffer_.assign(input_.data(), input_.size());
+        }
+        input_ = std::string_view(buffer_);
+        input_in_buffer_ = !buffer_.empty();
+    }
+
+    ProtocolVersion version_ = ProtocolVersion::V1;
+    std::string buffer_; // bytes of an incomplete frame
+    std::string_view input_; // not yet decoded bytes (either the caller's chunk or buffer_)
+    bool input_in_buffer_ = false; // input_ is the tail of buffer_ (and has to follow it when the decoder is moved)
+};
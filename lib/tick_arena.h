@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string.h>
+
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "color.h"
+
+#define TICK_ARENA_BLOCK_SIZE (64 * 1024) // bytes per arena block, larger requests get a block of their own
+
+/**
+ * Bump allocator for the scratch strings of one event loop tick (formatted messages, notices).
+ * Everything it hands out is valid until the next Reset(). Reset() keeps the regular blocks for the next tick,
+ * so once the arena has grown to the busiest tick it serves every following tick without touching the heap.
+*/
+class TickArena{
+public:
+    /**
+     * @return n bytes of uninitialized scratch memory
+    */
+    char* Allocate(size_t n){
+        if (n > TICK_ARENA_BLOCK_SIZE){ // oversized: dropped on Reset()
+            oversized_blocks_.push_back(std::make_unique<char[]>(n));
+            return oversized_blocks_.back().get();
+        }
+        if (current_block_ == blocks_.size() || block_used_ + n > TICK_ARENA_BLOCK_SIZE){
+            if (current_block_ < blocks_.size()){
+                ++current_block_;
+            }
+            if (current_block_ == blocks_.size()){
+                blocks_.push_back(std::make_unique<char[]>(TICK_ARENA_BLOCK_SIZE));
+            }
+            block_used_ = 0;
+        }
+        char* ptr = blocks_[current_block_].get() + block_used_;
+        block_used_ += n;
+        return ptr;
+    }
+
+    /**
+     * Concatenate string pieces into the arena.
+    */
+    std::string_view Concat(std::initializer_list<std::string_view> parts){
+        size_t length = 0;
+        for (std::string_view part : parts){
+            length += part.size();
+        }
+        char* ptr = Allocate(length);
+        size_t offset = 0;
+        for (std::string_view part : parts){
+            memcpy(ptr + offset, part.data(), part.size());
+            offset += part.size();
+        }
+        return std::string_view(ptr, length);
+    }
+
+    /**
+     * Concatenate string pieces into the arena and wrap them in ANSI color sequences (see MakeColorfulText()).
+    */
+    std::string_view ConcatColorful(Color color, std::initializer_list<std::string_view> parts){
+        size_t length = ColorAnsiSeq(color).size() + ANSI_RESET_SEQ.size();
+        for (std::string_view part : parts){
+            length += part.size();
+        }
+        char* ptr = Allocate(length);
+        memcpy(ptr, ColorAnsiSeq(color).data(), ColorAnsiSeq(color).size());
+        size_t offset = ColorAnsiSeq(color).size();
+        for (std::string_view part : parts){
+            memcpy(ptr + offset, part.data(), part.size());
+            offset += part.size();
+        }
+        memcpy(ptr + offset, ANSI_RESET_SEQ.data(), ANSI_RESET_SEQ.size());
+        return std::string_view(ptr, length);
+    }
+
+    // Invalidate everything handed out so far.
+    void Reset() noexcept{
+        current_block_ = 0;
+        block_used_ = 0;
+        oversized_blocks_.clear();
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_; // reused from tick to tick
+    std::vector<std::unique_ptr<char[]>> oversized_blocks_;
+    size_t current_block_ = 0;
+    size_t block_used_ = 0;
+};
@@ -0,0 +1,276 @@
+// This file contains the curses front-end of the client: a scrollback pane, a status line and an input line
+#pragma once
+
+#include <curses.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../lib/color.h"
+
+#define CHAT_SCROLLBACK_LINES 2000 // lines kept for scrolling back and redrawing after a resize
+#define CHAT_FRAME_INTERVAL_MS 33 // the screen is redrawn at most once per interval (~30 FPS)
+#define CHAT_INPUT_MAX_LENGTH 1024
+#define CHAT_ESCAPE_DELAY_MS 25
+
+/**
+ * Curses chat screen. Incoming lines are only stored by AddLine(); Render() draws what has changed since the last frame
+ * (new lines at the bottom of the pane, the status line, the input line) and pushes it to the terminal with one doupdate().
+ * The event loop calls Render() once the frame interval has passed, so a burst of messages costs one redraw per frame,
+ * and only the lines that stay on the screen are drawn.
+*/
+class ChatWindow{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ChatWindow() : lines_(CHAT_SCROLLBACK_LINES){
+        initscr();
+        cbreak();
+        noecho();
+        nonl();
+        set_escdelay(CHAT_ESCAPE_DELAY_MS);
+        if (has_colors()){
+            start_color();
+            use_default_colors();
+            constexpr short curses_colors[] = {COLOR_RED, COLOR_GREEN, COLOR_YELLOW, COLOR_MAGENTA, COLOR_CYAN}; // indexed by Color
+            for (short i = 0; i < static_cast<short>(std::size(curses_colors)); ++i){
+                init_pair(i + 1, curses_colors[i], -1);
+            }
+        }
+        __CreateWindows__();
+    }
+
+    ChatWindow(const ChatWindow& other) = delete;
+    ChatWindow& operator=(const ChatWindow& other) = delete;
+
+    ~ChatWindow(){
+        delwin(pane_);
+        delwin(status_);
+        delwin(input_);
+        endwin();
+    }
+
+    /**
+     * Store a line for the next frame. The ANSI color sequences of the line (see MakeColorfulText()) become curses colors.
+    */
+    void AddLine(std::string_view line){
+        size_t index = (first_line_ + lines_n_) % CHAT_SCROLLBACK_LINES;
+        if (lines_n_ == CHAT_SCROLLBACK_LINES){ // overwrite the oldest line
+            first_line_ = (first_line_ + 1) % CHAT_SCROLLBACK_LINES;
+            pending_lines_n_ = std::min(pending_lines_n_, lines_n_ - 1);
+        } else{
+            ++lines_n_;
+        }
+        lines_[index].assign(line); // keeps the capacity of the overwritten line
+        ++pending_lines_n_;
+        if (scroll_offset_ > 0){ // the user is reading older lines: keep the view where it is
+            ++scroll_offset_;
+            status_dirty_ = true;
+        }
+    }
+
+    void SetStatus(std::string_view status){
+        status_text_.assign(status);
+        status_dirty_ = true;
+    }
+
+    /**
+     * Read the pending key presses. Must be called when stdin is readable (and after EINTR, for the terminal resizes).
+     * @param on_line called with every submitted input line
+    */
+    template <typename OnLine>
+    void ReadInput(OnLine&& on_line){
+        int key;
+        while ((key = wgetch(input_)) != ERR){
+            switch (key){
+                case '\r': case '\n': case KEY_ENTER:
+                {
+                    std::string line;
+                    line.swap(input_line_);
+                    input_dirty_ = true;
+                    on_line(std::move(line));
+                    break;
+                }
+                case KEY_BACKSPACE: case 127: case '\b':
+                    if (!input_line_.empty()){
+                        input_line_.pop_back();
+                        input_dirty_ = true;
+                    }
+                    break;
+                case 21: // Ctrl-U
+                    input_line_.clear();
+                    input_dirty_ = true;
+                    break;
+                case KEY_PPAGE:
+                    __Scroll__(static_cast<int>(__PaneHeight__()) - 1);
+                    break;
+                case KEY_NPAGE:
+                    __Scroll__(-(static_cast<int>(__PaneHeight__()) - 1));
+                    break;
+                case KEY_RESIZE:
+                    __CreateWindows__();
+                    break;
+                default:
+                    if (key >= 32 && key < 256 && key != 127 && input_line_.size() < CHAT_INPUT_MAX_LENGTH){
+                        input_line_.push_back(static_cast<char>(key));
+                        input_dirty_ = true;
+                    }
+            }
+        }
+    }
+
+    bool NeedsRender() const noexcept{
+        return pending_lines_n_ > 0 || full_redraw_ || status_dirty_ || input_dirty_;
+    }
+
+    // Milliseconds until the next frame may be drawn (0: now), -1 if there is nothing to draw.
+    int MillisecondsToNextFrame(Clock::time_point now) const noexcept{
+        if (!NeedsRender()){
+            return -1;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(last_frame_ + std::chrono::milliseconds(CHAT_FRAME_INTERVAL_MS) - now).count();
+        return static_cast<int>(std::max<int64_t>(0, wait));
+    }
+
+    /**
+     * Draw the changes since the last frame if the frame interval has passed.
+    */
+    void Render(Clock::time_point now){
+        if (MillisecondsToNextFrame(now) != 0){
+            return;
+        }
+        last_frame_ = now;
+
+        size_t height = __PaneHeight__();
+        if (full_redraw_){
+            werase(pane_);
+            pane_empty_ = true;
+            size_t end = lines_n_ - std::min(scroll_offset_, lines_n_);
+            size_t begin = end - std::min(end, height);
+            for (size_t i = begin; i < end; ++i){
+                __DrawLine__(i);
+            }
+            wnoutrefresh(pane_);
+            full_redraw_ = false;
+        } else if (pending_lines_n_ > 0 && scroll_offset_ == 0){
+            // Lines that would scroll out of the pane within this frame are never drawn.
+            size_t begin = lines_n_ - std::min(pending_lines_n_, height);
+            for (size_t i = begin; i < lines_n_; ++i){
+                __DrawLine__(i);
+            }
+            wnoutrefresh(pane_);
+        }
+        pending_lines_n_ = 0;
+
+        if (status_dirty_){
+            werase(status_);
+            wattrset(status_, A_REVERSE);
+            std::string status = status_text_;
+            if (scroll_offset_ > 0){
+                status.append("  [scrolled back ").append(std::to_string(scroll_offset_)).append(" lines, PgDn to return]");
+            }
+            status.resize(std::max(status.size(), static_cast<size_t>(COLS)), ' ');
+            mvwaddnstr(status_, 0, 0, status.data(), COLS);
+            wnoutrefresh(status_);
+            status_dirty_ = false;
+        }
+        if (input_dirty_){ // the input line is drawn last, so that the cursor ends up in it
+            werase(input_);
+            mvwaddstr(input_, 0, 0, "> ");
+            size_t visible = static_cast<size_t>(std::max(1, COLS - 3));
+            std::string_view shown(input_line_);
+            shown.remove_prefix(shown.size() > visible ? shown.size() - visible : 0);
+            waddnstr(input_, shown.data(), static_cast<int>(shown.size()));
+            input_dirty_ = false;
+        }
+        wnoutrefresh(input_);
+        doupdate();
+    }
+
+private:
+    void __CreateWindows__(){
+        if (pane_ != nullptr){
+            delwin(pane_);
+            delwin(status_);
+            delwin(input_);
+            endwin();
+            refresh(); // picks up the new terminal size
+        }
+        int pane_height = std::max(1, LINES - 2);
+        pane_ = newwin(pane_height, COLS, 0, 0);
+        status_ = newwin(1, COLS, pane_height, 0);
+        input_ = newwin(1, COLS, pane_height + 1, 0);
+        scrollok(pane_, TRUE);
+        idlok(pane_, TRUE); // scroll with the terminal's own scrolling instead of redrawing the pane
+        keypad(input_, TRUE);
+        nodelay(input_, TRUE);
+        full_redraw_ = status_dirty_ = input_dirty_ = true;
+    }
+
+    size_t __PaneHeight__() const noexcept{
+        return static_cast<size_t>(std::max(1, getmaxy(pane_)));
+    }
+
+    void __Scroll__(int lines){
+        size_t max_offset = lines_n_ - std::min(lines_n_, __PaneHeight__());
+        int64_t offset = static_cast<int64_t>(scroll_offset_) + lines;
+        scroll_offset_ = static_cast<size_t>(std::clamp<int64_t>(offset, 0, static_cast<int64_t>(max_offset)));
+        full_redraw_ = status_dirty_ = true;
+    }
+
+    /**
+     * Draw the i-th stored line (0 = oldest) at the bottom of the pane, translating its ANSI color sequences.
+    */
+    void __DrawLine__(size_t i){
+        std::string_view line = lines_[(first_line_ + i) % CHAT_SCROLLBACK_LINES];
+        if (!pane_empty_){
+            waddch(pane_, '\n');
+        }
+        pane_empty_ = false;
+        wattrset(pane_, A_NORMAL);
+        while (!line.empty()){
+            size_t escape_pos = line.find('\x1b');
+            waddnstr(pane_, line.data(), static_cast<int>(std::min(escape_pos, line.size())));
+            if (escape_pos == line.npos){
+                break;
+            }
+            line.remove_prefix(escape_pos);
+            size_t sequence_end = line.find('m');
+            if (sequence_end == line.npos){
+                break;
+            }
+            std::string_view sequence = line.substr(0, sequence_end + 1);
+            wattrset(pane_, A_NORMAL);
+            for (short color = 0; color < static_cast<short>(color_ansi_seqs.size()); ++color){
+                if (sequence == ColorAnsiSeq(static_cast<Color>(color))){
+                    wattrset(pane_, COLOR_PAIR(color + 1));
+                    break;
+                }
+            }
+            line.remove_prefix(sequence_end + 1);
+        }
+    }
+
+    WINDOW* pane_ = nullptr;
+    WINDOW* status_ = nullptr;
+    WINDOW* input_ = nullptr;
+
+    std::vector<std::string> lines_; // ring of the last CHAT_SCROLLBACK_LINES lines
+    size_t first_line_ = 0; // ring index of the oldest line
+    size_t lines_n_ = 0;
+    size_t pending_lines_n_ = 0; // newest lines not drawn yet
+    size_t scroll_offset_ = 0; // lines between the bottom of the view and the newest line
+
+    std::string status_text_;
+    std::string input_line_;
+
+    bool full_redraw_ = true;
+    bool pane_empty_ = true; // nothing drawn since the last erase: the next line starts at the top
+    bool status_dirty_ = true;
+    bool input_dirty_ = true;
+    Clock::time_point last_frame_;
+};
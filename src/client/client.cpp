@@ -1,18 +1,55 @@
 #include "client.h"
 
+static bool ParseClientOptions(int options_n, char* options[], ClientConfig& config){
+    for (int i = 0; i < options_n; ++i){
+        std::string option(options[i]);
+        size_t eq_pos = option.find('=');
+        if (eq_pos == option.npos){
+            return false;
+        }
+        std::string name(option.substr(0, eq_pos)), value(option.substr(eq_pos + 1));
+        if (name == "--nickname"s){
+            config.nickname = value;
+        } else if (name == "--exit-on-eof"s){
+            config.exit_on_eof = value != "0"s;
+        } else if (name == "--ui"s){
+            if (value != "auto"s && value != "curses"s && value != "plain"s){
+                return false;
+            }
+            config.ui = value;
+        } else if (name == "--pipe"s){
+            config.pipe_mode = value != "0"s;
+        } else{
+            return false;
+        }
+    }
+    if (config.pipe_mode){
+        if (config.nickname.empty()){ // nobody is there to type one
+            return false;
+        }
+        config.ui = "plain"s;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]){
-    if (argc != 3){
-        std::cerr << "[Usage] ./client <remote_host> <port>" << std::endl;
+    ClientConfig config;
+    if (argc < 3 || !ParseClientOptions(argc - 3, argv + 3, config)){
+        std::cerr << "[Usage] ./client <remote_host> <port> [options]\n"s
+                  << "  --nickname=<name>    connect with this nickname instead of asking for one (headless and bot clients)\n"s
+                  << "  --exit-on-eof=<0|1>  leave once stdin ends (default: 1), 0 keeps listening\n"s
+                  << "  --ui=<auto|curses|plain>  curses screen or line-by-line output (default: auto, curses on a terminal)\n"s
+                  << "  --pipe=<0|1>         bulk-send every stdin line as a chat message, needs --nickname (default: 0)" << std::endl;
         return 1;
     }
 
-   std::unique_ptr<Client> client = std::make_unique<Client>(argv[1], argv[2]);
+   std::unique_ptr<Client> client = std::make_unique<Client>(argv[1], argv[2], config);
     try{
         client->Connect();
     } catch(std::runtime_error& err){
-        std::cerr << MakeColorfulText(err.what(), Color::Red);
+        std::cerr << MakeColorfulText(err.what(), Color::Red) << std::endl;
         return 1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
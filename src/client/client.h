@@ -1,24 +1,30 @@
 #pragma once
 
 #include "../../lib/networking_ops.h"
+#include "domain.h"
+#include "chat_window.h"
 
+#include <chrono>
 #include <iostream>
 #include <memory>
 
 #include <curses.h>
 
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <signal.h>
-#include <thread>
-#include <atomic>
 
-std::atomic_int EXIT_FLAG = 0;
-void InterruptHandler(int signal_num){
-    EXIT_FLAG = 1;
-}
+#define CLIENT_MAX_EVENTS 8
+#define CLIENT_RECEIVE_BUFFER_SIZE (64 * 1024) // bytes read from the socket per recv()
+#define CLIENT_STDIN_READ_SIZE 4096 // bytes read from stdin per read()
+#define CLIENT_PIPE_READ_SIZE (256 * 1024) // bytes read from stdin per read() in the pipe mode
+#define CLIENT_OUTBOUND_HIGH_WATERMARK (1024 * 1024) // unsent bytes at which stdin stops being read
+#define CLIENT_OUTBOUND_LOW_WATERMARK (256 * 1024) // unsent bytes at which stdin is read again
+#define NICKNAME_INPUT_MAX_LENGTH 20
 
 class Client{
 public:
-    explicit Client(const char* hostname, const char* port);
+    explicit Client(const char* hostname, const char* port, const ClientConfig& config = ClientConfig());
 
     explicit Client(const Client& other) = delete;
     Client& operator=(const Client& other) = delete;
@@ -28,7 +34,10 @@ public:
 public: // ---------- MAIN API ----------
 
     /**
-     * Main method for starting the client.
+     * Main method for starting the client: connect and run the event loop until the user quits,
+     * stdin ends, the server closes the connection or SIGINT/SIGTERM arrives.
+     * @return 0 on a clean exit
+     * @throws std::runtime_error on a connection or protocol error.
     */
     int Connect();
 
@@ -37,62 +46,130 @@ public: // ---------- MAIN API ----------
     */
     void Disconnect() noexcept;
 
+private: // ---------- EVENT LOOP ----------
+    /**
+     * Watch the server socket, stdin and a signalfd for SIGINT/SIGTERM with a single epoll instance.
+     * @throws std::runtime_error if one of them can't be set up.
+    */
+    void __SetUpEventLoop__();
+
+    /**
+     * Wait for and dispatch events until the session is over. Sleeps in epoll_wait() while there is nothing to do.
+    */
+    void RunEventLoop();
+
+    // Read everything the socket has (edge-triggered) and handle the decoded frames.
+    void __OnSocketReadable__();
+
+    // Read a chunk of stdin and handle the complete lines.
+    void __OnStdinReadable__();
+
+    // Consume the pending signals and end the session.
+    void __OnSignal__() noexcept;
+
+    /**
+     * Stop reading stdin while the server doesn't take what has been read (the socket stays unwritable),
+     * and read it again once most of it has been sent.
+    */
+    void __UpdateStdinFlow__();
+
 private: // ---------- HELPER METHODS ----------
     /**
-     * Parse and process user input and send it to the server.
-     * @param command_str a command string from the user.
-     * @return 0 on success, -1 on error with errno set.
+     * Handle a frame according to the current step of the connection protocol.
+     * @throws std::runtime_error if the server breaks the protocol.
     */
-    int ProcessInputCommand(std::string&& command_str);
+    void HandleFrame(const Frame& frame);
 
-    static void __OverwriteStdout__() noexcept{
-        std::cout << "> "s;
-        std::cout.flush();
-    }
+    /**
+     * Handle the complete lines of the input buffer that the current state allows to handle.
+    */
+    void ProcessInputLines();
 
     /**
-     * Method for handling user input on a separate thread.
+     * Pipe mode: frame every complete line of the input buffer as a chat message, without copying the lines.
     */
-    void InputHandler(void);
+    void QueueInputLines();
+
     /**
-     * Method for handling incoming messages on a separate thread.
+     * Handle one line typed by the user: a nickname during the handshake, a chat message or a command afterwards.
     */
-    void OutputDisplay(void);
+    void ProcessInputLine(std::string&& line);
 
     /**
-     * Helper method for establising a InputHandler thread.
+     * Parse and process user input and send it to the server.
+     * @param command_str a command string from the user.
+     * @return 0 on success, 1 if the command is unknown or malformed.
     */
-    // static void* __InputHaldlerHelper__(void* context){
-    //     return ((Client*)context)->InputHandler();
-    // }
-    // /**
-    //  * Helper method for establishing a OutputHandler's thread.
-    // */
-    // static void* __OutputDisplayHandlerHelper__(void* context){
-    //     return ((Client*)context)->OutputDisplay();
-    // }
+    int ProcessInputCommand(std::string&& command_str);
+
+    // Print the lines of a chat message or a server notice.
+    void DisplayFrame(const Frame& frame);
+
     /**
-     * Main method for establishing connection with the server.
-     * @return 0 on success, -1 on error.
+     * Append a frame to the outbound buffer. The buffer is written at the end of the loop iteration,
+     * so the frames queued during one iteration (e.g. the lines of a stdin chunk) leave with one send().
     */
-    int EstablishConnection();
+    void QueueFrame(Opcode opcode, std::string_view payload);
 
     /**
-     * Process a message from the server.
-     * @param write_buffer a buffer to read and write the ready-to-display message
-     * @return 0 on success, -1 on error with errno set.
+     * Write as much of the outbound buffer as the socket accepts.
+     * @throws std::runtime_error on a socket error.
     */
-   int ProcessMessage(char* write_buffer);
+    void FlushOutbound();
+
+    // The nickname prompt of the interactive mode, or the configured nickname of the headless one.
+    void AskForNickname();
+
+    // Pipe mode: print how many messages have been sent and how fast.
+    void ReportPipeThroughput() const;
+
+private: // ---------- DISPLAY ----------
+    // Show a line received from the server (its ANSI colors are kept).
+    void ShowLine(std::string_view line);
+
+    // Show a client-side notice in the given color.
+    void ShowNotice(std::string_view text, Color color);
+
+    // Plain mode: print the "> " prompt with the next flush.
+    void ShowPrompt() noexcept;
+
+    /**
+     * Push what has been shown during this loop iteration to the terminal:
+     * the curses screen is redrawn at most once per frame interval, the plain output is written with one write().
+    */
+    void FlushDisplay();
 
 private:
     const std::string remote_host_address_, remote_host_port_;
-    int client_socket_;
+    const ClientConfig config_;
+    int client_socket_ = -1;
+    int epoll_fd_ = -1;
+    int signal_fd_ = -1;
+    ProtocolVersion protocol_version_ = ProtocolVersion::V1; // negotiated during the handshake
+    ClientState state_ = ClientState::AWAIT_PROMPT;
+
+    FrameDecoder inbound_; // received bytes -> frames
+    std::unique_ptr<char[]> receive_buffer_;
+    std::string outbound_; // frames not written to the socket yet
+    size_t outbound_sent_ = 0; // bytes of outbound_ already written
+    std::string input_buffer_; // stdin bytes not handled yet (at most one incomplete line once handled)
+    bool stdin_polled_ = false; // stdin is a regular file, which epoll can't watch: it's read on every loop iteration
+    bool stdin_closed_ = false;
+    bool stdin_paused_ = false; // flow control: too many bytes wait for the socket
+    bool exit_requested_ = false;
+
+    uint64_t queued_messages_n_ = 0; // pipe mode
+    std::chrono::steady_clock::time_point connected_at_;
+
+    std::unique_ptr<ChatWindow> window_; // the curses screen, nullptr in the plain mode
+    std::string plain_output_; // plain mode: lines shown since the last flush
+    bool prompt_pending_ = false;
 
     bool disconnected = false;
-
 };
 
-Client::Client(const char* hostname, const char* port) : remote_host_address_(hostname), remote_host_port_(port) {}
+Client::Client(const char* hostname, const char* port, const ClientConfig& config) : remote_host_address_(hostname), remote_host_port_(port), config_(config),
+                                                                                       receive_buffer_(std::make_unique<char[]>(CLIENT_RECEIVE_BUFFER_SIZE)) {}
 
 Client::~Client(){
     if (!disconnected){
@@ -109,8 +186,6 @@ int Client::Connect(){
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    signal(SIGINT, InterruptHandler);
-    
     // Fill out the address structure for creating client's socket
     {
         int getaddrinfo_status_code = getaddrinfo(remote_host_address_.data(), remote_host_port_.data(), &hints, &res);
@@ -136,167 +211,493 @@ int Client::Connect(){
     std::cerr << MakeColorfulText("[Connect] Connected to the remote host. Authorizing..."s, Color::Pink) << '\n';
     freeaddrinfo(res);
 
-    if (EstablishConnection() != 0){
-        throw std::runtime_error("Failed to establish a connection to the server.\n"s);
+    __SetUpEventLoop__();
+    if (config_.ui == "curses"s || (config_.ui == "auto"s && isatty(STDIN_FILENO) == 1 && isatty(STDOUT_FILENO) == 1)){
+        window_ = std::make_unique<ChatWindow>();
+        window_->SetStatus(" "s + remote_host_address_ + ":"s + remote_host_port_ + " | PgUp/PgDn: scroll, /quit: leave"s);
+    }
+    try{
+        RunEventLoop();
+    } catch(std::runtime_error&){
+        window_.reset(); // restore the terminal before the error is printed
+        throw;
+    }
+    window_.reset();
+    if (config_.pipe_mode && state_ == ClientState::CONNECTED){
+        ReportPipeThroughput();
     }
-
-    // Creating two working threads for input and output
-    std::thread input_reading_worker(&Client::InputHandler, this);
-    std::thread output_display_worker(&Client::OutputDisplay, this);
-    while (EXIT_FLAG == 0) {} // Stay inside this loop until we receive an exit signal
     Disconnect();
-    input_reading_worker.join();
-    output_display_worker.join();
     return 0;
 }
 
 void Client::Disconnect() noexcept{
     std::cerr << MakeColorfulText("[Disconnect] Disconnecting..."s, Color::Pink) << '\n';
-    close(client_socket_);
+    for (int* fd : {&client_socket_, &epoll_fd_, &signal_fd_}){
+        if (*fd != -1){
+            close(*fd);
+            *fd = -1;
+        }
+    }
     std::cerr << MakeColorfulText("[Disconnect] Successfully disconnected from the server!"s, Color::Pink) << '\n';
     disconnected = true;
 }
 
-int Client::ProcessInputCommand(std::string&& command_str){
-    std::string command_name(command_str.substr(1, command_str.find_first_of(' ')));
-    if (command_name == "list_users"s){
-        SendMessage(client_socket_, "\07ACT_LSUSERS"s);
-        std::string serv_reply;
-        serv_reply.reserve(1068);
-
-        int recv_msg_status_code;
-        if ((recv_msg_status_code = ReceiveMessage(client_socket_, serv_reply.data())) == 0){ // Server closed the connection
-            EXIT_FLAG = 1;
-        } else if (recv_msg_status_code == -1){ // En error occurred while receiving the data
-            EXIT_FLAG = 1;
-        }
+void Client::__SetUpEventLoop__(){
+    if (SetNonBlocking(client_socket_) == -1){
+        throw std::runtime_error("fcntl(): "s + std::string(strerror(errno)));
+    }
 
-        // parsing a string
-        std::string token;
-        size_t pos = 0;
-        while ((pos = serv_reply.find('\02', pos)) != serv_reply.npos){ // The response will arrive in this form: "1) Username (X.X.X.X:YYYY)<\02>2) Username (X.X.X.X:YYYY)
-            token = serv_reply.substr(0, pos);
-            std::cout << token << '\n';
-            serv_reply.erase(0, pos + 1); // +1 for '\02' delimeter
-        }
-        std::cout << serv_reply << '\n';
+    // SIGINT and SIGTERM are delivered through the loop instead of interrupting it.
+    sigset_t exit_signals;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &exit_signals, nullptr) == -1 || (signal_fd_ = signalfd(-1, &exit_signals, SFD_NONBLOCK | SFD_CLOEXEC)) == -1){
+        throw std::runtime_error("signalfd(): "s + std::string(strerror(errno)));
     }
-    else if (command_name == "change_name"s){
-        
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1){
+        throw std::runtime_error("epoll_create1(): "s + std::string(strerror(errno)));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = client_socket_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket_, &event) == -1){
+        throw std::runtime_error("epoll_ctl(): "s + std::string(strerror(errno)));
+    }
+    event.events = EPOLLIN;
+    event.data.fd = signal_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &event) == -1){
+        throw std::runtime_error("epoll_ctl(): "s + std::string(strerror(errno)));
+    }
+    // stdin stays blocking (it's shared with the shell): level-triggered readiness guarantees that one read() doesn't block.
+    event.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1){
+        if (errno != EPERM){
+            throw std::runtime_error("epoll_ctl(): stdin: "s + std::string(strerror(errno)));
+        }
+        stdin_polled_ = true; // a regular file or /dev/null: always readable
     }
-    return 1;
 }
 
-void Client::InputHandler(void){
-    char write_buffer[1068]; // 44 bytes for message headers
-    while (EXIT_FLAG == 0){
-        __OverwriteStdout__();
-        memset(&write_buffer, 0, sizeof(write_buffer));
-        fgets(write_buffer, 1024, stdin);
-
-        std::string msg_str(write_buffer);
-        StipString(msg_str);
-        
-        if (msg_str.size() > 0){
-            if (msg_str[0] == '/'){
-                if (msg_str == "/quit"){
-                    EXIT_FLAG = 1;
-                    break;
-                }
-                if (ProcessInputCommand(std::move(msg_str)) == -1){
-                    EXIT_FLAG = 1;
-                    throw std::runtime_error("Failed to process input command: "s + std::string(strerror(errno)));
+void Client::RunEventLoop(){
+    epoll_event ready_events[CLIENT_MAX_EVENTS];
+    while (!exit_requested_){
+        // A polled stdin is read without waiting, unless the lines read so far are still waiting for the handshake.
+        bool poll_stdin = stdin_polled_ && !stdin_closed_ && !stdin_paused_ && (state_ == ClientState::CONNECTED || state_ == ClientState::AWAIT_NICKNAME_INPUT);
+        int timeout_ms = poll_stdin ? 0 : -1;
+        if (window_ != nullptr){ // wake up for the next frame
+            int frame_timeout_ms = window_->MillisecondsToNextFrame(ChatWindow::Clock::now());
+            timeout_ms = timeout_ms == -1 ? frame_timeout_ms : std::min(timeout_ms, std::max(0, frame_timeout_ms));
+        }
+        int ready_count = epoll_wait(epoll_fd_, ready_events, CLIENT_MAX_EVENTS, timeout_ms);
+        if (ready_count == -1){
+            if (errno == EINTR){ // curses reports a terminal resize (SIGWINCH) as a key press
+                if (window_ != nullptr){
+                    __OnStdinReadable__();
+                    FlushDisplay();
                 }
+                continue;
+            }
+            throw std::runtime_error("epoll_wait(): "s + std::string(strerror(errno)));
+        }
+        for (int i = 0; i < ready_count && !exit_requested_; ++i){
+            const epoll_event& event = ready_events[i];
+            if (event.data.fd == signal_fd_){
+                __OnSignal__();
+            } else if (event.data.fd == STDIN_FILENO){
+                __OnStdinReadable__();
             } else{
-                if (SendMessage(client_socket_, std::move(msg_str)) == -1){
-                    if (errno == EBADF || EXIT_FLAG == 1){ // if the socket has been closed and exit code set -> we just leave
-                        break;
-                    }
-                    throw std::runtime_error("Failed to send message to the server: "s + std::string(strerror(errno)));
+                if (event.events & EPOLLOUT){
+                    FlushOutbound();
+                }
+                if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+                    __OnSocketReadable__();
                 }
             }
         }
+        if (poll_stdin && !exit_requested_){
+            __OnStdinReadable__();
+        }
+        if (!exit_requested_ && outbound_sent_ < outbound_.size()){
+            FlushOutbound();
+        }
+        __UpdateStdinFlow__();
+        if (stdin_closed_ && config_.exit_on_eof && state_ == ClientState::CONNECTED && outbound_.empty()){ // everything typed has been sent
+            exit_requested_ = true;
+        }
+        FlushDisplay();
     }
 }
 
-int Client::ProcessMessage(char* write_buffer){
-    return 1;
-}
-
-void Client::OutputDisplay(void){
-    char write_buffer[1068]; // 44 bytes for message headers
-
-    while (EXIT_FLAG == 0){
-        memset(&write_buffer, 0, sizeof(write_buffer));
-        int recved_msg_status;
-        if ((recved_msg_status = ReceiveMessage(client_socket_, write_buffer)) == 0){ // Server closed connection
-            EXIT_FLAG = 1;
-        } else if (recved_msg_status == -1){
-            if (errno == EBADF || EXIT_FLAG == 1){ // if the socket has been closed and exit code set -> we just leave
-                break;
+void Client::__OnSocketReadable__(){
+    while (!exit_requested_){
+        ssize_t received_n = recv(client_socket_, receive_buffer_.get(), CLIENT_RECEIVE_BUFFER_SIZE, 0);
+        if (received_n == 0){ // Server closed connection
+            ShowNotice("[ConnectionClosed] Server closed the connection."s, Color::Pink);
+            exit_requested_ = true;
+            return;
+        }
+        if (received_n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return;
             }
-            EXIT_FLAG = 1;
             throw std::runtime_error("Failed to receive a message from the server: recv(): "s + std::string(strerror(errno)));
         }
-        
-        std::cout << write_buffer << '\n';
-        __OverwriteStdout__();
+
+        inbound_.Feed(receive_buffer_.get(), received_n);
+        Frame frame;
+        int decode_status;
+        while (!exit_requested_ && (decode_status = inbound_.NextFrame(frame)) == 1){
+            HandleFrame(frame);
+        }
+        if (decode_status == -1){
+            throw std::runtime_error("Received a malformed frame from the server."s);
+        }
     }
 }
 
-int Client::EstablishConnection(){
-    char writable_buffer[1068]; // 44 bytes for message headers
-    memset(&writable_buffer, 0, sizeof(writable_buffer));
+void Client::__OnStdinReadable__(){
+    if (window_ != nullptr){ // the curses screen reads the keys itself
+        window_->ReadInput([this](std::string&& line){
+            input_buffer_.append(line).push_back('\n');
+        });
+        ProcessInputLines();
+        return;
+    }
+    // Read straight into the input buffer: the lines are framed from there.
+    size_t read_size = config_.pipe_mode ? CLIENT_PIPE_READ_SIZE : CLIENT_STDIN_READ_SIZE;
+    size_t buffered_n = input_buffer_.size();
+    input_buffer_.resize(buffered_n + read_size);
+    ssize_t read_n = read(STDIN_FILENO, input_buffer_.data() + buffered_n, read_size);
+    input_buffer_.resize(buffered_n + std::max<ssize_t>(read_n, 0));
+    if (read_n == -1){
+        if (errno == EINTR || errno == EAGAIN){
+            return;
+        }
+        throw std::runtime_error("read(): stdin: "s + std::string(strerror(errno)));
+    }
+    if (read_n == 0){ // end of input: the session ends once what has been typed is sent
+        stdin_closed_ = true;
+        if (!stdin_polled_){
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, STDIN_FILENO, nullptr);
+        }
+        if (!input_buffer_.empty() && input_buffer_.back() != '\n'){ // the last line has no line break
+            input_buffer_.push_back('\n');
+        }
+    }
+    ProcessInputLines();
+    if (stdin_closed_ && state_ != ClientState::CONNECTED && input_buffer_.empty() && config_.nickname.empty()){ // no nickname is coming
+        exit_requested_ = true;
+    }
+}
+
+void Client::__OnSignal__() noexcept{
+    signalfd_siginfo signal_info;
+    while (read(signal_fd_, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {}
+    exit_requested_ = true;
+}
+
+void Client::__UpdateStdinFlow__(){
+    size_t waiting_n = outbound_.size() - outbound_sent_ + input_buffer_.size();
+    bool pause = waiting_n >= CLIENT_OUTBOUND_HIGH_WATERMARK;
+    if (pause == stdin_paused_ || (!pause && waiting_n > CLIENT_OUTBOUND_LOW_WATERMARK)){
+        return;
+    }
+    stdin_paused_ = pause;
+    if (stdin_polled_ || stdin_closed_){ // a polled stdin is just skipped
+        return;
+    }
+    epoll_event event{};
+    event.events = stdin_paused_ ? 0u : static_cast<uint32_t>(EPOLLIN);
+    event.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, STDIN_FILENO, &event) == -1){
+        throw std::runtime_error("epoll_ctl(): stdin: "s + std::string(strerror(errno)));
+    }
+}
+
+void Client::HandleFrame(const Frame& frame){
+    switch (state_){
+        case ClientState::AWAIT_PROMPT:
+            if (frame.opcode != Opcode::NICK_PROMPT){
+                throw std::runtime_error("Handshake: received a wrong initial signal: "s + std::string(frame.payload));
+            }
+            // Ask for the binary framing. A server that doesn't know v2 answers with an "Unknown command" message: stay on v1.
+            QueueFrame(Opcode::PROTO_UPGRD, std::string_view());
+            state_ = ClientState::AWAIT_UPGRADE;
+            return;
+        case ClientState::AWAIT_UPGRADE:
+            if (frame.opcode == Opcode::PROTO_ACCPT){
+                protocol_version_ = ProtocolVersion::V2;
+                inbound_.SetVersion(ProtocolVersion::V2);
+            }
+            AskForNickname();
+            return;
+        case ClientState::AWAIT_NICKNAME_INPUT: // nothing is expected
+            return;
+        case ClientState::AWAIT_NICKNAME_ANSWER:
+            if (frame.opcode == Opcode::NICK_ACCEPT){
+                ShowNotice("[Connection] Connected to the server."s, Color::Green);
+                state_ = ClientState::CONNECTED;
+                connected_at_ = std::chrono::steady_clock::now();
+                ProcessInputLines(); // what has been typed meanwhile
+                return;
+            }
+            if (frame.opcode == Opcode::NICK_STAKEN){
+                ShowNotice("[NickRefused] Entered nickname is already taken. Enter a new one."s, Color::Red);
+            } else if (frame.opcode == Opcode::NICK_INVALD){
+                ShowNotice("[NickRefused] Entered nickname contains forbidden characters. Enter a new one."s, Color::Red);
+            } else{ // Unknown key signal
+                throw std::runtime_error("Handshake: received an unknown key signal: \""s + std::string(frame.payload) + "\""s);
+            }
+            if (!config_.nickname.empty()){ // a headless client has no other nickname to offer
+                throw std::runtime_error("The nickname \""s + config_.nickname + "\" has been refused."s);
+            }
+            AskForNickname();
+            return;
+        case ClientState::CONNECTED:
+            switch (frame.opcode){
+                case Opcode::NICK_ACCEPT: // answers to /change_name
+                    ShowNotice("[Nickname] Your nickname has been changed."s, Color::Green);
+                    break;
+                case Opcode::NICK_STAKEN:
+                    ShowNotice("[NickRefused] Entered nickname is already taken."s, Color::Red);
+                    break;
+                case Opcode::NICK_INVALD:
+                    ShowNotice("[NickRefused] Entered nickname contains forbidden characters."s, Color::Red);
+                    break;
+                case Opcode::HEARTB_PING: // the server checks that we are still there
+                    QueueFrame(Opcode::HEARTB_PONG, std::string_view());
+                    return;
+                default:
+                    if (config_.pipe_mode && frame.opcode == Opcode::MESSAGE && !(frame.flags & FRAME_FLAG_NOTICE)){ // the bridge only sends
+                        break;
+                    }
+                    DisplayFrame(frame);
+            }
+            ShowPrompt();
+            return;
+    }
+}
+
+void Client::DisplayFrame(const Frame& frame){
+    // Multi-line answers (e.g. the user list) separate their lines with '\02'
+    std::string_view lines = frame.payload;
+    size_t line_end;
+    while ((line_end = lines.find('\02')) != lines.npos){
+        ShowLine(lines.substr(0, line_end));
+        lines.remove_prefix(line_end + 1);
+    }
+    ShowLine(lines);
+}
 
-    if (ReceiveMessage(client_socket_, writable_buffer) == -1){
-        std::cerr << MakeColorfulText("[Error] EstablishConnection: ReceiveMessage() fail: "s + std::string(strerror(errno)), Color::Red);
-        return -1;
+void Client::AskForNickname(){
+    state_ = ClientState::AWAIT_NICKNAME_INPUT;
+    if (!config_.nickname.empty()){
+        QueueFrame(Opcode::NICK_NEWREQ, config_.nickname);
+        state_ = ClientState::AWAIT_NICKNAME_ANSWER;
+        return;
     }
-    std::string key_signal_name(writable_buffer + 1); // +1 to skip the key signal character (\07)
-    if (key_signal_name != "NICK_PROMPT"){
-        std::cerr << MakeColorfulText("[Error] EstablishConnection(): Received a wrong initial signal: "s + key_signal_name, Color::Red) << '\n';
-        return -1;
+    ShowLine("Enter your nickname"s);
+    ShowPrompt();
+    ProcessInputLines(); // a nickname typed ahead
+}
+
+void Client::ProcessInputLines(){
+    if (config_.pipe_mode){
+        QueueInputLines();
+        return;
     }
+    size_t line_begin = 0, line_end;
+    while ((state_ == ClientState::CONNECTED || state_ == ClientState::AWAIT_NICKNAME_INPUT) && !exit_requested_
+           && (line_end = input_buffer_.find('\n', line_begin)) != input_buffer_.npos){
+        std::string line(input_buffer_, line_begin, line_end - line_begin);
+        line_begin = line_end + 1;
+        ProcessInputLine(std::move(line));
+    }
+    input_buffer_.erase(0, line_begin);
+}
 
-    while (true){
-        std::string nick_str;
-        std::cout << "Enter your nickname\n"s;
-        __OverwriteStdout__();
-        std::getline(std::cin, nick_str);
-        if (nick_str.find(' ') != nick_str.npos || nick_str.size() > 20 || *nick_str.begin() == '/'){ // if a space is found or nickname is more than 20 chars or the first char is /
-            __OverwriteStdout__();
-            std::cerr << MakeColorfulText("[Error] Entered name contains a space or is more than 20 characters or '/' at the beginning. Try again."s, Color::Red) << '\n';
+void Client::QueueInputLines(){
+    if (state_ != ClientState::CONNECTED){ // the lines wait for the handshake
+        return;
+    }
+    std::string_view input(input_buffer_);
+    size_t line_begin = 0, line_end;
+    while ((line_end = input.find('\n', line_begin)) != input.npos){
+        std::string_view line = input.substr(line_begin, line_end - line_begin);
+        line_begin = line_end + 1;
+        if (!line.empty() && line.back() == '\r'){
+            line.remove_suffix(1);
+        }
+        if (line.empty()){
             continue;
         }
+        AppendFrame(outbound_, protocol_version_, Opcode::MESSAGE, line);
+        ++queued_messages_n_;
+    }
+    input_buffer_.erase(0, line_begin);
+}
 
-        // Get response from the server about our nickname
-        SendMessage(client_socket_, "\07NICK_NEWREQ"s + std::move(nick_str));
-        
-        std::string serv_response;
-        serv_response.resize(12);
-        int recv_bytes;
-        if ((recv_bytes = ReceiveMessage(client_socket_, serv_response.data())) == 0){
-            std::cerr << MakeColorfulText("[ConnectionClosed] Server closed the connection."s, Color::Pink) << std::endl;
-            return -1;
-        } else if (recv_bytes == -1){
-            std::cerr << MakeColorfulText("[Error] Failed to receive a message from server: recv(): "s + std::string(strerror(errno)), Color::Red) << std::endl;
-            return -1;
+void Client::ProcessInputLine(std::string&& line){
+    StipString(line);
+    if (state_ == ClientState::AWAIT_NICKNAME_INPUT){
+        if (line.empty() || line.find(' ') != line.npos || line.size() > NICKNAME_INPUT_MAX_LENGTH || line[0] == '/'){ // if a space is found or nickname is more than 20 chars or the first char is /
+            ShowNotice("[Error] Entered name contains a space or is more than 20 characters or '/' at the beginning. Try again."s, Color::Red);
+            ShowPrompt();
+            return;
         }
+        QueueFrame(Opcode::NICK_NEWREQ, line);
+        state_ = ClientState::AWAIT_NICKNAME_ANSWER;
+        return;
+    }
 
-        std::string server_command(serv_response.substr(1)); // omit the first key signal char
-        if (server_command == "NICK_ACCEPT"s){
-            std::cerr << MakeColorfulText("[Connection] Connected to the server."s, Color::Green) << '\n';
-            break;
-        } else if (server_command == "NICK_STAKEN"s){
-            std::cerr << MakeColorfulText("[NickRefused] Entered nickname is already taken. Enter a new one."s, Color::Red) << '\n';
-        } else if (server_command == "NICK_INVALD"s){
-            std::cerr << MakeColorfulText("[NickRefused] Entered nickname contains forbidden characters. Enter a new one.", Color::Red) << '\n';
+    if (line.empty()){
+        ShowPrompt();
+        return;
+    }
+    if (line[0] == '/'){
+        if (line == "/quit"){
+            FlushOutbound(); // what has been typed before
+            exit_requested_ = true;
+            return;
         }
-        else{ // Unknown key signal
-            std::cerr << MakeColorfulText("[Error] EstablishConnection(): Received an unknown key signal: \""s + std::string(serv_response), Color::Red) << "\"\n";
-            return -1; 
+        ProcessInputCommand(std::move(line));
+        return;
+    }
+    QueueFrame(Opcode::MESSAGE, line);
+}
+
+int Client::ProcessInputCommand(std::string&& command_str){
+    // The answers arrive later through the event loop, like any other frame.
+    size_t name_end = command_str.find(' ');
+    std::string_view command_name(std::string_view(command_str).substr(1, name_end == command_str.npos ? command_str.npos : name_end - 1));
+    std::string_view arguments(name_end == command_str.npos ? std::string_view() : std::string_view(command_str).substr(name_end + 1));
+    if (command_name == "list_users"){
+        QueueFrame(Opcode::ACT_LSUSERS, std::string_view());
+        return 0;
+    }
+    else if (command_name == "change_name"){
+        QueueFrame(Opcode::ACT_NICKCNG, arguments);
+        return 0;
+    }
+    else if (command_name == "pm"){ // /pm <nickname> <message>
+        size_t nickname_end = arguments.find(' ');
+        if (nickname_end == arguments.npos){
+            ShowNotice("[Error] Usage: /pm <nickname> <message>"s, Color::Red);
+            return 1;
+        }
+        std::string pm_arguments(arguments.substr(0, nickname_end));
+        pm_arguments.push_back('\02');
+        pm_arguments.append(arguments.substr(nickname_end + 1));
+        QueueFrame(Opcode::ACT_PMSGUSR, pm_arguments);
+        return 0;
+    }
+    else if (command_name == "join" || command_name == "leave"){ // /join <channel>, /leave <channel>
+        if (!arguments.empty() && arguments[0] == '#'){
+            arguments.remove_prefix(1);
         }
+        QueueFrame(command_name == "join" ? Opcode::ACT_CHNJOIN : Opcode::ACT_CHNLEAV, arguments);
+        return 0;
     }
+    else if (command_name == "cm"){ // /cm <channel> <message>
+        if (!arguments.empty() && arguments[0] == '#'){
+            arguments.remove_prefix(1);
+        }
+        size_t channel_end = arguments.find(' ');
+        if (channel_end == arguments.npos){
+            ShowNotice("[Error] Usage: /cm <channel> <message>"s, Color::Red);
+            return 1;
+        }
+        std::string cm_arguments(arguments.substr(0, channel_end));
+        cm_arguments.push_back('\02');
+        cm_arguments.append(arguments.substr(channel_end + 1));
+        QueueFrame(Opcode::ACT_CHNMSGS, cm_arguments);
+        return 0;
+    }
+    ShowNotice("[Error] Unknown command: /"s + std::string(command_name), Color::Red);
+    return 1;
+}
 
-    return 0;
-}
\ No newline at end of file
+void Client::QueueFrame(Opcode opcode, std::string_view payload){
+    AppendFrame(outbound_, protocol_version_, opcode, payload);
+}
+
+void Client::FlushOutbound(){
+    while (outbound_sent_ < outbound_.size()){
+        ssize_t sent_n = send(client_socket_, outbound_.data() + outbound_sent_, outbound_.size() - outbound_sent_, MSG_NOSIGNAL);
+        if (sent_n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){ // the rest goes out on EPOLLOUT
+                if (outbound_sent_ >= outbound_.size() / 2){ // don't let the sent bytes pile up while new frames are appended
+                    outbound_.erase(0, outbound_sent_);
+                    outbound_sent_ = 0;
+                }
+                return;
+            }
+            throw std::runtime_error("Failed to send message to the server: "s + std::string(strerror(errno)));
+        }
+        outbound_sent_ += sent_n;
+    }
+    outbound_.clear();
+    outbound_sent_ = 0;
+}
+
+void Client::ShowLine(std::string_view line){
+    if (window_ != nullptr){
+        window_->AddLine(line);
+        return;
+    }
+    plain_output_.append(line).push_back('\n');
+}
+
+void Client::ShowNotice(std::string_view text, Color color){
+    if (window_ != nullptr){
+        window_->AddLine(MakeColorfulText(text, color));
+        return;
+    }
+    if (!plain_output_.empty()){ // keep the order of the chat lines and the notice
+        std::cout << plain_output_;
+        std::cout.flush();
+        plain_output_.clear();
+    }
+    std::cerr << MakeColorfulText(text, color) << '\n';
+}
+
+void Client::ShowPrompt() noexcept{
+    prompt_pending_ = !config_.pipe_mode;
+}
+
+void Client::FlushDisplay(){
+    if (window_ != nullptr){
+        window_->Render(ChatWindow::Clock::now());
+        return;
+    }
+    if (plain_output_.empty() && !prompt_pending_){
+        return;
+    }
+    if (prompt_pending_){
+        plain_output_.append("> "s);
+        prompt_pending_ = false;
+    }
+    std::cout << plain_output_;
+    std::cout.flush();
+    plain_output_.clear();
+}
+
+void Client::ReportPipeThroughput() const{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - connected_at_).count();
+    size_t unsent_n = outbound_.size() - outbound_sent_;
+    std::string report = "[Pipe] Queued "s + std::to_string(queued_messages_n_) + " messages in "s + std::to_string(seconds) + " s ("s
+                         + std::to_string(static_cast<uint64_t>(seconds > 0 ? queued_messages_n_ / seconds : 0)) + " msg/s)"s;
+    if (unsent_n > 0){
+        report += ", "s + std::to_string(unsent_n) + " bytes were not sent"s;
+    }
+    std::cerr << MakeColorfulText(report, unsent_n > 0 ? Color::Yellow : Color::Green) << '\n';
+}
@@ -1 +1,21 @@
+// This file contains all client-specific structures
 #pragma once
+
+#include <string>
+
+// Client parameters (see ParseClientOptions() for the command-line flags)
+struct ClientConfig{
+    std::string nickname; // sent right away instead of asking the user (headless and bot clients)
+    bool exit_on_eof = true; // leave once stdin ends and everything typed has been sent (false: stay and listen)
+    bool pipe_mode = false; // bulk send: every stdin line is a chat message, batched into large writes (needs a nickname)
+    std::string ui = "auto"; // "curses": scrollback pane and input line, "plain": line-by-line output, "auto": curses on a terminal
+};
+
+// Steps of the connection protocol, driven by the frames received from the server
+enum class ClientState{
+    AWAIT_PROMPT, // waiting for NICK_PROMPT
+    AWAIT_UPGRADE, // PROTO_UPGRD sent, waiting for PROTO_ACCPT (or for an "unknown command" notice of a v1-only server)
+    AWAIT_NICKNAME_INPUT, // waiting for the user to enter a nickname
+    AWAIT_NICKNAME_ANSWER, // NICK_NEWREQ sent
+    CONNECTED
+};
@@ -0,0 +1,120 @@
+// This file contains the admin socket: a local Unix socket that serves the server's metrics
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "../../lib/networking_ops.h"
+#include "metrics.h"
+
+#define ADMIN_POLL_TIMEOUT 200 // ms between checks of the exit signal
+#define ADMIN_REQUEST_MAX_LENGTH 1024
+#define ADMIN_RECEIVE_TIMEOUT 1000 // ms a client has to send its request
+
+/**
+ * Serves the metrics registry on a Unix stream socket, one request per connection:
+ * "metrics\n" is answered with the bare Prometheus text, "GET /metrics ..." with an HTTP/1.0 response
+ * (so that `curl --unix-socket <path> http://localhost/metrics` and Prometheus-compatible scrapers work).
+ * Requests are handled on a thread of its own, the reactor threads are never touched.
+*/
+class AdminSocket{
+public:
+    /**
+     * @param stop_flag the serving thread exits once it becomes non-zero
+     * @throws std::runtime_error if the socket can't be created.
+    */
+    AdminSocket(const std::string& path, const MetricsRegistry& registry, const std::atomic_int& stop_flag)
+        : path_(path), registry_(registry), stop_flag_(stop_flag) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(address.sun_path)){
+            throw std::runtime_error("admin socket path is too long: "s + path_);
+        }
+        memcpy(address.sun_path, path_.data(), path_.size());
+
+        listen_socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_socket_ == -1){
+            throw std::runtime_error("admin socket(): "s + std::string(strerror(errno)));
+        }
+        unlink(path_.c_str()); // a stale socket left by a crashed server
+        if (bind(listen_socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || listen(listen_socket_, 16) == -1){
+            std::string error_msg("admin socket bind()/listen(): "s + std::string(strerror(errno)));
+            close(listen_socket_);
+            throw std::runtime_error(error_msg);
+        }
+        thread_ = std::thread(&AdminSocket::__Serve__, this);
+    }
+
+    AdminSocket(const AdminSocket& other) = delete;
+    AdminSocket& operator=(const AdminSocket& other) = delete;
+
+    // Wait for the stop flag to be noticed, then remove the socket file.
+    ~AdminSocket(){
+        thread_.join();
+        close(listen_socket_);
+        unlink(path_.c_str());
+    }
+
+private:
+    void __Serve__(){
+        pollfd listen_pollfd{.fd = listen_socket_, .events = POLLIN, .revents = 0};
+        while (stop_flag_ == 0){
+            if (poll(&listen_pollfd, 1, ADMIN_POLL_TIMEOUT) <= 0){
+                continue;
+            }
+            int client_socket = accept4(listen_socket_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_socket == -1){
+                continue;
+            }
+            __HandleRequest__(client_socket);
+            close(client_socket);
+        }
+    }
+
+    void __HandleRequest__(int client_socket){
+        timeval receive_timeout{.tv_sec = ADMIN_RECEIVE_TIMEOUT / 1000, .tv_usec = (ADMIN_RECEIVE_TIMEOUT % 1000) * 1000};
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+        // Only the first line matters.
+        char request_buffer[ADMIN_REQUEST_MAX_LENGTH];
+        size_t request_length = 0;
+        while (request_length < sizeof(request_buffer)){
+            ssize_t received_n = recv(client_socket, request_buffer + request_length, sizeof(request_buffer) - request_length, 0);
+            if (received_n <= 0){
+                break;
+            }
+            request_length += received_n;
+            if (memchr(request_buffer, '\n', request_length) != nullptr){
+                break;
+            }
+        }
+        std::string_view request(request_buffer, request_length);
+        request = request.substr(0, request.find_first_of("\r\n"));
+
+        std::string response;
+        if (request == "metrics"){
+            response = registry_.RenderPrometheus();
+        } else if (request.substr(0, 13) == "GET /metrics "){
+            std::string body = registry_.RenderPrometheus();
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "s + std::to_string(body.size()) + "\r\n\r\n"s + body;
+        } else if (request.substr(0, 4) == "GET "){
+            response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n"s;
+        } else{
+            response = "unknown command: try \"metrics\"\n"s;
+        }
+        __SendAllBytes__(client_socket, response.data(), response.size()); // the client may have left already: nothing to report
+    }
+
+    std::string path_;
+    const MetricsRegistry& registry_;
+    const std::atomic_int& stop_flag_;
+    int listen_socket_ = -1;
+    std::thread thread_;
+};
@@ -0,0 +1,121 @@
+// This file contains the admission control of incoming connections: per-IP connect rate limits
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+#include "../../lib/networking_ops.h"
+
+#define ADMISSION_TRACKED_IPS_MAX 65536 // IP addresses with a connect budget in use, per reactor thread
+#define ADMISSION_SWEEP_INTERVAL_MS 1000 // the full table is swept at most this often
+
+/**
+ * Per-IP token buckets limiting how often an address may open a connection. A bucket holds up to `burst` tokens,
+ * refills at `rate_per_s` and every connection takes one. A bucket is only created when an address connects and
+ * dropped once it has refilled (a full bucket is the same as no bucket), so the table holds the recently active
+ * addresses only. When it reaches max_tracked_ips, the refilled buckets are swept out; if every address is still
+ * active, new addresses are let through untracked and the cap on pending handshakes has to hold the line.
+*/
+class ConnectRateLimiter{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @param rate_per_s connections per second and address, 0 disables the limit
+     * @param burst connections an idle address may open at once
+    */
+    ConnectRateLimiter(double rate_per_s, double burst, size_t max_tracked_ips = ADMISSION_TRACKED_IPS_MAX)
+        : rate_per_s_(rate_per_s), burst_(std::max(burst, 1.0)), max_tracked_ips_(max_tracked_ips) {}
+
+    /**
+     * Take a token from the address's bucket.
+     * @return false if the address has used up its budget
+    */
+    bool TryAcquire(const PeerAddress& address, Clock::time_point now){
+        if (rate_per_s_ <= 0){
+            return true;
+        }
+        IpKey key = __MakeKey__(address);
+        auto bucket_it = buckets_.find(key);
+        if (bucket_it == buckets_.end()){
+            if (buckets_.size() >= max_tracked_ips_ && now >= next_sweep_at_){
+                __Sweep__(now);
+                next_sweep_at_ = now + std::chrono::milliseconds(ADMISSION_SWEEP_INTERVAL_MS);
+            }
+            if (buckets_.size() < max_tracked_ips_){
+                buckets_.emplace(key, Bucket{.tokens = burst_ - 1, .refilled_at = now});
+            }
+            return true;
+        }
+        Bucket& bucket = bucket_it->second;
+        __Refill__(bucket, now);
+        if (bucket.tokens < 1){
+            return false;
+        }
+        bucket.tokens -= 1;
+        return true;
+    }
+
+    size_t TrackedCount() const noexcept{
+        return buckets_.size();
+    }
+
+    void Clear() noexcept{
+        buckets_.clear();
+    }
+
+private:
+    struct IpKey{
+        sa_family_t family;
+        uint8_t ip[16];
+
+        bool operator==(const IpKey& other) const noexcept{
+            return family == other.family && memcmp(ip, other.ip, sizeof(ip)) == 0;
+        }
+    };
+
+    struct IpKeyHash{
+        size_t operator()(const IpKey& key) const noexcept{
+            uint64_t high, low;
+            memcpy(&high, key.ip, sizeof(high));
+            memcpy(&low, key.ip + sizeof(high), sizeof(low));
+            uint64_t hash = (high ^ (low * 0x9E3779B97F4A7C15ull) ^ key.family) * 0xBF58476D1CE4E5B9ull;
+            return static_cast<size_t>(hash ^ (hash >> 31));
+        }
+    };
+
+    struct Bucket{
+        double tokens;
+        Clock::time_point refilled_at;
+    };
+
+    static IpKey __MakeKey__(const PeerAddress& address) noexcept{
+        IpKey key;
+        key.family = address.family;
+        memcpy(key.ip, address.ip, sizeof(key.ip));
+        return key;
+    }
+
+    void __Refill__(Bucket& bucket, Clock::time_point now) const noexcept{
+        double elapsed_s = std::chrono::duration<double>(now - bucket.refilled_at).count();
+        bucket.tokens = std::min(burst_, bucket.tokens + elapsed_s * rate_per_s_);
+        bucket.refilled_at = now;
+    }
+
+    // Drop the buckets that have refilled completely.
+    void __Sweep__(Clock::time_point now){
+        for (auto bucket_it = buckets_.begin(); bucket_it != buckets_.end();){
+            __Refill__(bucket_it->second, now);
+            bucket_it = bucket_it->second.tokens >= burst_ ? buckets_.erase(bucket_it) : std::next(bucket_it);
+        }
+    }
+
+    const double rate_per_s_;
+    const double burst_;
+    const size_t max_tracked_ips_;
+    std::unordered_map<IpKey, Bucket, IpKeyHash> buckets_;
+    Clock::time_point next_sweep_at_;
+};
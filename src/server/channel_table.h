@@ -0,0 +1,108 @@
+// This file contains the channels of a reactor thread and their membership index
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define CHANNEL_NAME_MAX_LENGTH 32
+#define CHANNELS_PER_USER_MAX 16
+
+/**
+ * Channels of the users connected to one shard. Every channel keeps its members as a sorted vector of socket fds,
+ * so a channel message walks the members only, never the whole connection table. The reverse index
+ * (the channels of a user) lives in Connection::channels, so leaving every channel on disconnect
+ * costs O(channels of the user). The ids of deleted channels are reused.
+*/
+class ChannelTable{
+public:
+    static constexpr uint32_t NO_CHANNEL = UINT32_MAX;
+
+    // @return id of the channel, NO_CHANNEL if no user of this shard is in it
+    uint32_t Find(const std::string& name) const noexcept{
+        auto channel_it = name_to_id_.find(name);
+        return channel_it != name_to_id_.end() ? channel_it->second : NO_CHANNEL;
+    }
+
+    /**
+     * Add a member, creating the channel if it doesn't exist on this shard yet.
+     * @return the channel id, and false if the socket is a member already
+    */
+    std::pair<uint32_t, bool> Join(const std::string& name, int socketfd){
+        auto [channel_it, created] = name_to_id_.emplace(name, NO_CHANNEL);
+        if (created){
+            if (free_ids_.empty()){
+                channel_it->second = static_cast<uint32_t>(channels_.size());
+                channels_.emplace_back();
+            } else{
+                channel_it->second = free_ids_.back();
+                free_ids_.pop_back();
+            }
+            channels_[channel_it->second].name = name;
+        }
+        std::vector<int>& members = channels_[channel_it->second].members;
+        auto member_it = std::lower_bound(members.begin(), members.end(), socketfd);
+        if (member_it != members.end() && *member_it == socketfd){
+            return {channel_it->second, false};
+        }
+        members.insert(member_it, socketfd);
+        ++memberships_n_;
+        return {channel_it->second, true};
+    }
+
+    /**
+     * Remove a member. A channel without members is deleted.
+     * @return false if the socket isn't a member
+    */
+    bool Leave(uint32_t channel_id, int socketfd){
+        Channel& channel = channels_[channel_id];
+        auto member_it = std::lower_bound(channel.members.begin(), channel.members.end(), socketfd);
+        if (member_it == channel.members.end() || *member_it != socketfd){
+            return false;
+        }
+        channel.members.erase(member_it);
+        --memberships_n_;
+        if (channel.members.empty()){
+            name_to_id_.erase(channel.name);
+            channel.name.clear();
+            channel.members.shrink_to_fit();
+            free_ids_.push_back(channel_id);
+        }
+        return true;
+    }
+
+    // Sorted socket fds of the channel's members on this shard
+    const std::vector<int>& Members(uint32_t channel_id) const noexcept{
+        return channels_[channel_id].members;
+    }
+
+    const std::string& Name(uint32_t channel_id) const noexcept{
+        return channels_[channel_id].name;
+    }
+
+    // Sum of the member counts of all channels
+    size_t MembershipsCount() const noexcept{
+        return memberships_n_;
+    }
+
+    void Clear() noexcept{
+        channels_.clear();
+        free_ids_.clear();
+        name_to_id_.clear();
+        memberships_n_ = 0;
+    }
+
+private:
+    struct Channel{
+        std::string name; // empty: the id is free
+        std::vector<int> members;
+    };
+
+    std::vector<Channel> channels_; // indexed by channel id
+    std::vector<uint32_t> free_ids_;
+    std::unordered_map<std::string, uint32_t> name_to_id_;
+    size_t memberships_n_ = 0;
+};
@@ -0,0 +1,102 @@
+// This file contains the fd-indexed table of the server's connections
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "domain.h"
+
+/**
+ * Dense array of connections plus an fd -> slot index: lookups, inserts and removals are O(1),
+ * and iterating over all clients (fanout) walks contiguous memory.
+ * Removal moves the last connection into the freed slot, so slots (and references to connections)
+ * are only stable until the next Insert() or Remove().
+ * Connections are moved around (swap-remove, reallocation), so a member of Connection must not keep views or pointers
+ * into itself: a short std::string moves its bytes along (FrameDecoder re-points its input into its buffer for that reason).
+*/
+class ConnectionTable{
+    static_assert(std::is_nothrow_move_constructible_v<Connection>, "the table's reallocations would copy the connections");
+
+public:
+    /**
+     * Start tracking a freshly accepted socket. The socket fd gets a new generation,
+     * which makes every answer addressed to a previous connection on the same fd stale.
+     * @return the new connection
+    */
+    Connection& Insert(int socketfd){
+        if (static_cast<size_t>(socketfd) >= fd_to_slot_.size()){
+            fd_to_slot_.resize(socketfd + 1, NO_SLOT);
+            fd_generations_.resize(socketfd + 1, 0);
+        }
+        fd_to_slot_[socketfd] = static_cast<uint32_t>(connections_.size());
+        Connection& connection = connections_.emplace_back();
+        connection.socket_fd = socketfd;
+        connection.generation = ++fd_generations_[socketfd];
+        return connection;
+    }
+
+    /**
+     * Forget a connection (swap-remove).
+     * @return false if the socket isn't in the table
+    */
+    bool Remove(int socketfd){
+        if (Find(socketfd) == nullptr){
+            return false;
+        }
+        uint32_t slot = fd_to_slot_[socketfd];
+        if (slot + 1 != connections_.size()){
+            connections_[slot] = std::move(connections_.back());
+            fd_to_slot_[connections_[slot].socket_fd] = slot;
+        }
+        connections_.pop_back();
+        fd_to_slot_[socketfd] = NO_SLOT;
+        return true;
+    }
+
+    // @return the connection of a socket, nullptr if there is none
+    Connection* Find(int socketfd) noexcept{
+        if (socketfd < 0 || static_cast<size_t>(socketfd) >= fd_to_slot_.size() || fd_to_slot_[socketfd] == NO_SLOT){
+            return nullptr;
+        }
+        return &connections_[fd_to_slot_[socketfd]];
+    }
+
+    /**
+     * @param generation the generation the caller has seen the socket with
+     * @return the connection, nullptr if it's gone or the fd now belongs to another connection
+    */
+    Connection* Find(int socketfd, uint32_t generation) noexcept{
+        Connection* connection = Find(socketfd);
+        return connection != nullptr && connection->generation == generation ? connection : nullptr;
+    }
+
+    size_t Size() const noexcept{
+        return connections_.size();
+    }
+
+    void Clear() noexcept{
+        connections_.clear();
+        fd_to_slot_.assign(fd_to_slot_.size(), NO_SLOT);
+    }
+
+    std::vector<Connection>::iterator begin() noexcept{
+        return connections_.begin();
+    }
+    std::vector<Connection>::iterator end() noexcept{
+        return connections_.end();
+    }
+    std::vector<Connection>::const_iterator begin() const noexcept{
+        return connections_.begin();
+    }
+    std::vector<Connection>::const_iterator end() const noexcept{
+        return connections_.end();
+    }
+
+private:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    std::vector<Connection> connections_; // dense: every element is a live connection
+    std::vector<uint32_t> fd_to_slot_; // socket fd -> index in connections_
+    std::vector<uint32_t> fd_generations_; // socket fd -> generation of its last connection (kept after Remove())
+};
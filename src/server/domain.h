@@ -2,36 +2,99 @@
 #pragma once
 
 #include <string>
+#include <chrono>
+#include <vector>
 
-struct User{
-    std::string nickname;
-    std::string ip_address;
-    std::string port;
+#include "../../lib/inline_string.h"
+#include "../../lib/networking_ops.h"
+#include "../../lib/logger.h"
+#include "outbound_queue.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "flood_control.h"
+
+// Tunable server parameters (see ParseServerOptions() for the command-line flags)
+struct ServerConfig{
+    size_t egress_high_watermark = 256 * 1024; // queued bytes at which a client becomes congested and new messages for it are dropped
+    size_t egress_low_watermark = 64 * 1024; // queued bytes at which a congested client is considered healthy again
+    int slow_consumer_timeout_ms = 5000; // how long a client may stay congested before it is disconnected
+
+    int listen_backlog = SOMAXCONN; // accepted-by-the-kernel connections waiting for accept() (a burst of connects must not overflow it)
+    size_t max_pending_handshakes = 1024; // connections that haven't finished the handshake (all shards together), more are refused
+    int handshake_timeout_ms = 10000; // how long a client may take to get a nickname accepted before it is disconnected
+    double connect_rate_per_ip = 20; // new connections per second from one IP address, 0 = unlimited
+    double connect_burst_per_ip = 40; // connections an IP address may open at once after being idle
+
+    int heartbeat_interval_ms = 30000; // a v2 client silent for this long is pinged, 0 = no heartbeat
+    int heartbeat_timeout_ms = 10000; // time a pinged client has to answer before it is considered gone
+    int idle_timeout_ms = 0; // a user who sends nothing but heartbeats for this long is disconnected, 0 = never
+
+    // Flood control budgets of every connection (a rate of 0 = unlimited)
+    RateLimit chat_limit{.rate_per_s = 20, .burst = 40}; // chat lines, private and channel messages
+    RateLimit command_limit{.rate_per_s = 10, .burst = 20}; // other commands
+    RateLimit nick_limit{.rate_per_s = 0.2, .burst = 5}; // nickname requests and changes
+    RateLimit bytes_limit{.rate_per_s = 256 * 1024, .burst = 1024 * 1024}; // received payload bytes
+    int flood_mute_ms = 30000; // how long a client that keeps overdrawing its budgets stays muted
+
+    size_t mailbox_messages = 20; // private messages kept for an offline nickname until a user takes it, 0 = no mailboxes
+
+    int presence_window_ms = 250; // join/leave events are announced together once per window, 0 = once per loop tick
+
+    std::string io_backend = "epoll"s; // event loop I/O backend: "epoll" or "io_uring"
+
+    size_t shards_n = 1; // number of reactor threads, each with its own SO_REUSEPORT listenner (1 = classic single-thread mode)
+    bool pin_cpus = false; // pin reactor thread i to CPU i
+
+    size_t history_messages = 50; // chat lines replayed to a user who joins, 0 = no history
+    size_t history_bytes = 64 * 1024; // memory budget of the history (packets of both protocol versions)
+
+    std::string persist_dir; // directory of the durable message log, empty = nothing is persisted
+    size_t persist_segment_bytes = 64 * 1024 * 1024; // size of a log segment file
+    size_t persist_sync_bytes = 1024 * 1024; // group commit: sync once this many bytes have been written...
+    int persist_sync_interval_ms = 100; // ...or once this much time has passed since the last sync
+
+    std::string admin_socket_path; // Unix socket serving the metrics, empty = disabled
+
+    LogLevel log_level = LogLevel::INFO; // records below this level are discarded
+    std::string log_file; // file the log is appended to, empty = stderr
+};
+
+#define NICKNAME_MAX_LENGTH 32
+
+// Per-socket state of every accepted client (pending or established), stored inline in the ConnectionTable
+struct Connection{
+    int socket_fd = -1;
+    uint32_t generation = 0; // tells apart the successive connections that reuse the same socket fd
+    bool established = false; // the handshake is finished: the client is a user with a nickname
+    bool nick_claim_in_flight = false; // waiting for the nickname owner shard to answer
+    bool flush_scheduled = false; // the socket is already in the list of sockets to be flushed at the end of the tick
+    bool congested = false; // outbound queue is above the high watermark
+    ProtocolVersion protocol_version = ProtocolVersion::V1; // framing of the packets queued for this client
+
+    InlineString<NICKNAME_MAX_LENGTH> nickname; // valid once established
+    PeerAddress address; // resolved once, when the client is accepted
+
+    TimerWheel::TimerId timer = TimerWheel::NO_TIMER; // the handshake deadline, then the next heartbeat or idle deadline
+    uint64_t last_received_tick = 0; // timer wheel tick of the last bytes received
+    uint64_t last_activity_tick = 0; // timer wheel tick of the last frame other than a heartbeat answer
+    bool ping_sent = false; // a heartbeat ping is waiting for the client's answer
+
+    FloodState flood; // token buckets and escalation state
+
+    FrameDecoder inbound; // incoming bytes -> frames
+    OutboundQueue outbound; // packets waiting for the socket to become writable
+
+    std::chrono::steady_clock::time_point congested_since;
+    size_t dropped_messages = 0; // messages dropped while the client was congested
+
+    std::vector<uint32_t> channels; // ids of the user's channels in the shard's ChannelTable
+
+    size_t user_list_replies_left = 0; // ACT_LSUSERS in the sharded mode: shards that haven't sent their part yet
+    std::string user_list; // ACT_LSUSERS: '\02'-separated entries gathered so far
 };
 
 struct DisconnectedClient{
     int socket_fd;
+    DisconnectReason reason; // metrics label of disconnect_reason
     std::string disconnect_reason;
 };
-
-enum class ClientKeySignal{
-    NICK_NEWREQ = 0,
-    ACT_NICKCNG = 1,
-    ACT_LSUSERS = 2,
-    ACT_PMSGUSR = 3,
-    UNKNOWN = 4
-};
-
-static ClientKeySignal StringToClientKeySignal(const std::string& command_str){
-    if (command_str == "NICK_NEWREQ"s){
-        return ClientKeySignal::NICK_NEWREQ;
-    } else if (command_str == "ACT_NICKCNG"s){
-        return ClientKeySignal::ACT_NICKCNG;
-    } else if (command_str == "ACT_LSUSERS"s){
-        return ClientKeySignal::ACT_LSUSERS;
-    } else if (command_str == "ACT_PMSGUSR"s){
-        return ClientKeySignal::ACT_PMSGUSR;
-    } else{
-        return ClientKeySignal::UNKNOWN;
-    }
-}
\ No newline at end of file
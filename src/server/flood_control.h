@@ -0,0 +1,112 @@
+// This file contains the per-connection flood control: token buckets per message class and the escalation thresholds
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#define FLOOD_TOKEN_UNIT 1000 // a bucket counts thousandths of a token, so slow rates refill without rounding to 0
+#define FLOOD_PRESSURE_GAP_MS 1000 // an overdraft later than this after the client's last resume begins a new streak
+#define FLOOD_MUTE_AFTER_MS 5000 // a client overdrawing its budgets for this long is muted
+#define FLOOD_DISCONNECT_AFTER_MS 20000 // a client overdrawing its budgets for this long is disconnected
+
+// Budgeted kinds of frames, see Server::__BuildCommandTable__() for the class of every opcode
+enum class MessageClass : uint8_t{
+    CHAT = 0, // chat lines, private and channel messages: the ones that fan out
+    COMMAND = 1,
+    NICK_CHANGE = 2 // nickname requests and changes: each one is a claim, possibly on another shard
+};
+#define MESSAGE_CLASSES_N 3
+
+// Command-line form of a budget: refill rate and capacity
+struct RateLimit{
+    double rate_per_s = 0; // 0 = unlimited
+    double burst = 0;
+};
+
+/**
+ * Refill rate and capacity of a token bucket, in FLOOD_TOKEN_UNITs per timer wheel tick.
+*/
+struct TokenBudget{
+    int64_t refill_per_tick = 0; // 0 = unlimited
+    int64_t capacity = 0;
+
+    static TokenBudget FromRateLimit(const RateLimit& limit, uint64_t tick_ms) noexcept{
+        if (limit.rate_per_s <= 0){
+            return TokenBudget();
+        }
+        return TokenBudget{.refill_per_tick = std::max<int64_t>(1, static_cast<int64_t>(limit.rate_per_s * FLOOD_TOKEN_UNIT * tick_ms / 1000)),
+                           .capacity = static_cast<int64_t>(std::max(limit.burst, 1.0) * FLOOD_TOKEN_UNIT)};
+    }
+
+    bool Unlimited() const noexcept{
+        return refill_per_tick == 0;
+    }
+};
+
+/**
+ * A token bucket refilled lazily from the timer wheel's tick: taking from it is a few integer operations,
+ * with no clock read and no allocation. A frame is always charged in full, so an overdraft leaves the bucket
+ * in debt, and the client is throttled until the debt is paid off.
+*/
+struct TokenBucket{
+    int64_t tokens = 0; // FLOOD_TOKEN_UNITs, negative while in debt
+    uint64_t refilled_at = 0; // timer wheel tick
+
+    void Fill(const TokenBudget& budget, uint64_t now) noexcept{
+        tokens = budget.capacity;
+        refilled_at = now;
+    }
+
+    void Refill(const TokenBudget& budget, uint64_t now) noexcept{
+        if (now > refilled_at){
+            tokens = std::min(budget.capacity, tokens + static_cast<int64_t>(now - refilled_at) * budget.refill_per_tick);
+            refilled_at = now;
+        }
+    }
+
+    /**
+     * @param cost FLOOD_TOKEN_UNITs
+     * @return false if the bucket is in debt after the charge
+    */
+    bool Take(const TokenBudget& budget, uint64_t now, int64_t cost) noexcept{
+        if (budget.Unlimited()){
+            return true;
+        }
+        Refill(budget, now);
+        tokens -= cost;
+        return tokens >= 0;
+    }
+
+    bool InDebt() const noexcept{
+        return tokens < 0;
+    }
+};
+
+// Flood control state of a connection, stored inline in the Connection
+struct FloodState{
+    std::array<TokenBucket, MESSAGE_CLASSES_N> message_buckets; // a token per frame
+    TokenBucket byte_bucket; // a token per payload byte
+    uint64_t pressure_since_tick = 0; // beginning of the current streak of overdrafts
+    uint64_t resumed_at_tick = 0; // the client has last been resumed after a throttle
+    uint64_t muted_until_tick = 0; // chat frames are dropped until this tick
+    bool throttled = false; // the socket isn't read until the buckets are out of debt
+
+    void Fill(const std::array<TokenBudget, MESSAGE_CLASSES_N>& message_budgets, const TokenBudget& byte_budget, uint64_t now) noexcept{
+        for (size_t i = 0; i < MESSAGE_CLASSES_N; ++i){
+            message_buckets[i].Fill(message_budgets[i], now);
+        }
+        byte_bucket.Fill(byte_budget, now);
+    }
+
+    // Refill every bucket and tell whether they are all out of debt.
+    bool Refill(const std::array<TokenBudget, MESSAGE_CLASSES_N>& message_budgets, const TokenBudget& byte_budget, uint64_t now) noexcept{
+        bool in_debt = false;
+        for (size_t i = 0; i < MESSAGE_CLASSES_N; ++i){
+            message_buckets[i].Refill(message_budgets[i], now);
+            in_debt |= message_buckets[i].InDebt();
+        }
+        byte_bucket.Refill(byte_budget, now);
+        return !in_debt && !byte_bucket.InDebt();
+    }
+};
@@ -0,0 +1,76 @@
+// This file contains the bounded history of the chat, replayed to the users who join
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "outbound_queue.h"
+
+/**
+ * Fixed-capacity ring of the last broadcast chat lines, kept as the already-assembled packets of both protocol versions.
+ * The packets are shared with the queues they have been fanned out to, so recording a message copies no bytes,
+ * and replaying it queues the stored packets again without re-encoding anything.
+ * Memory is bounded twice: at most max_messages entries and at most max_bytes of packets (the oldest entries are evicted first).
+*/
+class HistoryRing{
+public:
+    /**
+     * @param max_messages entries kept, 0 disables the history
+     * @param max_bytes total size of the kept packets (both versions)
+    */
+    HistoryRing(size_t max_messages, size_t max_bytes) : ring_(max_messages), max_bytes_(max_bytes) {}
+
+    // Record a broadcast. A message bigger than the whole byte budget isn't kept.
+    void Append(const VersionedPackets& packets){
+        size_t packets_bytes = __PacketsBytes__(packets);
+        if (ring_.empty() || packets_bytes > max_bytes_){
+            return;
+        }
+        while (size_ == ring_.size() || bytes_ + packets_bytes > max_bytes_){
+            __PopOldest__();
+        }
+        ring_[(head_ + size_) % ring_.size()] = packets;
+        ++size_;
+        bytes_ += packets_bytes;
+    }
+
+    /**
+     * Visit the recorded messages from the oldest to the newest.
+    */
+    template <typename Visitor>
+    void ForEach(Visitor&& visit) const{
+        for (size_t i = 0; i < size_; ++i){
+            visit(ring_[(head_ + i) % ring_.size()]);
+        }
+    }
+
+    size_t Size() const noexcept{
+        return size_;
+    }
+
+    void Clear() noexcept{
+        while (size_ > 0){
+            __PopOldest__();
+        }
+    }
+
+private:
+    static size_t __PacketsBytes__(const VersionedPackets& packets) noexcept{
+        return packets.v1->size() + packets.v2->size();
+    }
+
+    void __PopOldest__() noexcept{
+        VersionedPackets& oldest = ring_[head_];
+        bytes_ -= __PacketsBytes__(oldest);
+        oldest.v1.reset();
+        oldest.v2.reset();
+        head_ = (head_ + 1) % ring_.size();
+        --size_;
+    }
+
+    std::vector<VersionedPackets> ring_; // allocated once
+    size_t head_ = 0; // index of the oldest entry
+    size_t size_ = 0;
+    size_t bytes_ = 0;
+    const size_t max_bytes_;
+};
@@ -0,0 +1,254 @@
+// This file contains the I/O backend interface of the server event loop and its epoll implementation
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../../lib/networking_ops.h"
+#include "../../lib/logger.h"
+#include "outbound_queue.h"
+
+#define MAX_EPOLL_EVENTS 256 // Max number of ready sockets handled per event loop tick
+#define READ_BUFFER_SIZE 65536 // Size of a single recv() chunk
+
+/**
+ * Receiver of the I/O events produced by an IoBackend. All callbacks are invoked from IoBackend::Wait().
+*/
+class IoHandler{
+public:
+    virtual ~IoHandler() = default;
+
+    // A new client has been accepted (conn_address may be nullptr). The handler has to AddClient() it or close it.
+    virtual void OnAccept(int socketfd, sockaddr_storage* conn_address) = 0;
+
+    /**
+     * Bytes have arrived from a client. The data is valid only until the callback returns.
+     * @return false to stop reading from this socket in the current tick (e.g. the client is being disconnected)
+    */
+    virtual bool OnData(int socketfd, const char* data, size_t data_length) = 0;
+
+    // The client has closed the connection (error_code == 0) or the socket has failed (errno-like error_code).
+    virtual void OnPeerClosed(int socketfd, int error_code) = 0;
+
+    // epoll: the socket is writable again. io_uring: a previously submitted send has completed with sent_bytes.
+    virtual void OnWritable(int socketfd, size_t sent_bytes) = 0;
+
+    // The wakeup descriptor (shard mailbox eventfd) has been signalled.
+    virtual void OnWakeup() = 0;
+};
+
+/**
+ * Event loop I/O strategy: readiness-based (epoll) or completion-based (io_uring).
+ * The server only talks to this interface, so both can be benchmarked on the same workload.
+*/
+class IoBackend{
+public:
+    virtual ~IoBackend() = default;
+
+    virtual const char* Name() const noexcept = 0;
+
+    /**
+     * Start accepting connections on a listening socket.
+     * @param wakeup_fd an eventfd to be watched for OnWakeup(), -1 if none
+     * @throw std::runtime_error if the backend can't be set up
+    */
+    virtual void Init(int listen_socketfd, int wakeup_fd) = 0;
+
+    /**
+     * Start receiving from an accepted client.
+     * @return 0 on success, -1 on error with errno set
+    */
+    virtual int AddClient(int socketfd) = 0;
+
+    /**
+     * Forget a client. Must be called before its socket is closed; no callbacks for it are invoked afterwards.
+    */
+    virtual void RemoveClient(int socketfd) = 0;
+
+    /**
+     * Stop reading from a client, so that TCP flow control pushes back on it. Bytes that the backend has already
+     * received may still be handed to OnData(). A closing peer is still reported.
+    */
+    virtual void PauseReading(int socketfd) = 0;
+
+    // Read from a paused client again. Data that has arrived meanwhile is reported in the next Wait().
+    virtual void ResumeReading(int socketfd) = 0;
+
+    /**
+     * Write (or submit for writing) the client's outbound queue. With a completion-based backend the queue is
+     * consumed only in OnWritable(), and at most one send per socket is in flight.
+     * @return 0 on success, -1 on error with errno set
+    */
+    virtual int Send(int socketfd, OutboundQueue& queue) = 0;
+
+    /**
+     * Submit the pending operations, wait up to timeout_ms for events and dispatch them to the handler.
+     * @return 0 on success, -1 on error with errno set (EINTR when interrupted by a signal)
+    */
+    virtual int Wait(IoHandler& handler, int timeout_ms) = 0;
+};
+
+/**
+ * Edge-triggered epoll backend: one epoll_wait() per tick covers the listenner, the wakeup fd and all clients.
+*/
+class EpollBackend : public IoBackend{
+public:
+    EpollBackend() : read_buffer_(READ_BUFFER_SIZE) {}
+
+    ~EpollBackend() override{
+        if (epoll_fd_ != -1){
+            close(epoll_fd_);
+        }
+    }
+
+    const char* Name() const noexcept override{
+        return "epoll";
+    }
+
+    void Init(int listen_socketfd, int wakeup_fd) override{
+        listen_socketfd_ = listen_socketfd;
+        wakeup_fd_ = wakeup_fd;
+        if (SetNonBlocking(listen_socketfd_) == -1){
+            throw std::runtime_error("fcntl(): "s + std::string(strerror(errno)));
+        }
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1){
+            throw std::runtime_error("epoll_create1(): "s + std::string(strerror(errno)));
+        }
+        if (__WatchSocket__(listen_socketfd_, EPOLLIN) == -1 || (wakeup_fd_ != -1 && __WatchSocket__(wakeup_fd_, EPOLLIN) == -1)){
+            throw std::runtime_error("epoll_ctl(): "s + std::string(strerror(errno)));
+        }
+    }
+
+    int AddClient(int socketfd) override{
+        if (SetNonBlocking(socketfd) == -1){
+            return -1;
+        }
+        return __WatchSocket__(socketfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    }
+
+    void RemoveClient(int /*socketfd*/) override{
+        // nothing to do: closing the socket removes it from the epoll instance
+    }
+
+    void PauseReading(int socketfd) override{
+        __ModifySocket__(socketfd, EPOLLOUT | EPOLLRDHUP);
+    }
+
+    void ResumeReading(int socketfd) override{
+        __ModifySocket__(socketfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP); // reports the data that is already waiting
+    }
+
+    int Send(int socketfd, OutboundQueue& queue) override{
+        return queue.Flush(socketfd);
+    }
+
+    int Wait(IoHandler& handler, int timeout_ms) override{
+        int ready_count = epoll_wait(epoll_fd_, ready_events_, MAX_EPOLL_EVENTS, timeout_ms);
+        if (ready_count == -1){
+            return -1;
+        }
+        for (int i = 0; i < ready_count; ++i){
+            const epoll_event& event = ready_events_[i];
+            if (event.data.fd == listen_socketfd_){
+                __AcceptAll__(handler);
+            } else if (event.data.fd == wakeup_fd_){
+                handler.OnWakeup();
+            } else{
+                __HandleClientEvent__(handler, event.data.fd, event.events);
+            }
+        }
+        return 0;
+    }
+
+private:
+    int __WatchSocket__(int socketfd, uint32_t events) noexcept{
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | EPOLLET;
+        ev.data.fd = socketfd;
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socketfd, &ev);
+    }
+
+    int __ModifySocket__(int socketfd, uint32_t events) noexcept{
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | EPOLLET;
+        ev.data.fd = socketfd;
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, socketfd, &ev);
+    }
+
+    // Edge-triggered listenner: accept until the queue is drained.
+    void __AcceptAll__(IoHandler& handler){
+        sockaddr_storage conn_address;
+        socklen_t conn_address_len;
+        while (true){
+            conn_address_len = sizeof(conn_address);
+            int new_conn_socketfd = accept(listen_socketfd_, reinterpret_cast<sockaddr*>(&conn_address), &conn_address_len);
+            if (new_conn_socketfd == -1){
+                if (errno == EINTR || errno == ECONNABORTED){
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK){
+                    LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ConnectionFail] accept(): ", strerror(errno)});
+                }
+                return;
+            }
+            handler.OnAccept(new_conn_socketfd, &conn_address);
+        }
+    }
+
+    void __HandleClientEvent__(IoHandler& handler, int socketfd, uint32_t events){
+        if (events & EPOLLERR){
+            int error_code = 0;
+            socklen_t error_code_len = sizeof(error_code);
+            getsockopt(socketfd, SOL_SOCKET, SO_ERROR, &error_code, &error_code_len);
+            handler.OnPeerClosed(socketfd, error_code != 0 ? error_code : EIO);
+            return;
+        }
+        if (events & EPOLLOUT){ // the socket buffer has space again: continue with the queued packets
+            handler.OnWritable(socketfd, 0);
+        }
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))){
+            return;
+        }
+
+        // Edge-triggered socket: consume everything that has already arrived, we won't be notified about it again.
+        while (true){
+            ssize_t recv_bytes = recv(socketfd, read_buffer_.data(), READ_BUFFER_SIZE, 0);
+            if (recv_bytes == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK){
+                    handler.OnPeerClosed(socketfd, errno);
+                }
+                return;
+            } else if (recv_bytes == 0){
+                handler.OnPeerClosed(socketfd, 0);
+                return;
+            }
+            if (!handler.OnData(socketfd, read_buffer_.data(), recv_bytes)){
+                return;
+            }
+            // A short read means the socket is drained: new data will raise a new edge. Only a closing peer has to be read until EOF.
+            if (static_cast<size_t>(recv_bytes) < READ_BUFFER_SIZE && !(events & (EPOLLRDHUP | EPOLLHUP))){
+                return;
+            }
+        }
+    }
+
+    int epoll_fd_ = -1;
+    int listen_socketfd_ = -1;
+    int wakeup_fd_ = -1;
+    epoll_event ready_events_[MAX_EPOLL_EVENTS];
+    std::vector<char> read_buffer_; // one recv() chunk, possibly containing many message packets
+};
@@ -0,0 +1,246 @@
+#include "server.h"
+#include "admin_socket.h"
+#include "message_log.h"
+
+// "<rate>:<burst>" or "<rate>" (the burst is then a second's worth of the rate)
+static RateLimit ParseRateLimit(const std::string& value){
+    size_t colon_pos = value.find(':');
+    double rate_per_s = std::stod(value.substr(0, colon_pos));
+    return RateLimit{.rate_per_s = rate_per_s, .burst = colon_pos == value.npos ? rate_per_s : std::stod(value.substr(colon_pos + 1))};
+}
+
+static bool ParseServerOptions(int options_n, char* options[], ServerConfig& config){
+    for (int i = 0; i < options_n; ++i){
+        std::string option(options[i]);
+        size_t eq_pos = option.find('=');
+        if (eq_pos == option.npos){
+            return false;
+        }
+        std::string name(option.substr(0, eq_pos)), value(option.substr(eq_pos + 1));
+        try{
+            if (name == "--egress-high-watermark"s){
+                config.egress_high_watermark = std::stoul(value);
+            } else if (name == "--egress-low-watermark"s){
+                config.egress_low_watermark = std::stoul(value);
+            } else if (name == "--slow-consumer-timeout"s){
+                config.slow_consumer_timeout_ms = std::stoi(value);
+            } else if (name == "--listen-backlog"s){
+                config.listen_backlog = std::stoi(value);
+            } else if (name == "--max-pending"s){
+                config.max_pending_handshakes = std::stoul(value);
+            } else if (name == "--handshake-timeout"s){
+                config.handshake_timeout_ms = std::stoi(value);
+            } else if (name == "--connect-rate"s){
+                config.connect_rate_per_ip = std::stod(value);
+            } else if (name == "--connect-burst"s){
+                config.connect_burst_per_ip = std::stod(value);
+            } else if (name == "--heartbeat-interval"s){
+                config.heartbeat_interval_ms = std::stoi(value);
+            } else if (name == "--heartbeat-timeout"s){
+                config.heartbeat_timeout_ms = std::stoi(value);
+            } else if (name == "--idle-timeout"s){
+                config.idle_timeout_ms = std::stoi(value);
+            } else if (name == "--limit-chat"s){
+                config.chat_limit = ParseRateLimit(value);
+            } else if (name == "--limit-commands"s){
+                config.command_limit = ParseRateLimit(value);
+            } else if (name == "--limit-nick"s){
+                config.nick_limit = ParseRateLimit(value);
+            } else if (name == "--limit-bytes"s){
+                config.bytes_limit = ParseRateLimit(value);
+            } else if (name == "--flood-mute"s){
+                config.flood_mute_ms = std::stoi(value);
+            } else if (name == "--mailbox-messages"s){
+                config.mailbox_messages = std::stoul(value);
+            } else if (name == "--presence-window"s){
+                config.presence_window_ms = std::stoi(value);
+            } else if (name == "--io-backend"s){
+                if (value != "epoll"s && value != "io_uring"s){
+                    return false;
+                }
+                config.io_backend = value;
+            } else if (name == "--shards"s){
+                config.shards_n = std::stoul(value);
+            } else if (name == "--pin-cpus"s){
+                config.pin_cpus = std::stoi(value) != 0;
+            } else if (name == "--history-messages"s){
+                config.history_messages = std::stoul(value);
+            } else if (name == "--history-bytes"s){
+                config.history_bytes = std::stoul(value);
+            } else if (name == "--persist-dir"s){
+                config.persist_dir = value;
+            } else if (name == "--persist-segment-bytes"s){
+                config.persist_segment_bytes = std::stoul(value);
+            } else if (name == "--persist-sync-bytes"s){
+                config.persist_sync_bytes = std::stoul(value);
+            } else if (name == "--persist-sync-interval"s){
+                config.persist_sync_interval_ms = std::stoi(value);
+            } else if (name == "--admin-socket"s){
+                config.admin_socket_path = value;
+            } else if (name == "--log-level"s){
+                if (!ParseLogLevel(value, config.log_level)){
+                    return false;
+                }
+            } else if (name == "--log-file"s){
+                config.log_file = value;
+            } else{
+                return false;
+            }
+        } catch (std::logic_error&){ // std::invalid_argument or std::out_of_range
+            return false;
+        }
+    }
+    return config.egress_low_watermark <= config.egress_high_watermark && config.shards_n > 0 && config.persist_segment_bytes >= 4096
+           && config.listen_backlog > 0 && config.max_pending_handshakes > 0 && config.handshake_timeout_ms > 0 && config.connect_rate_per_ip >= 0
+           && config.heartbeat_interval_ms >= 0 && config.heartbeat_timeout_ms > 0 && config.idle_timeout_ms >= 0;
+}
+
+static void PinThreadToCpu(size_t cpu_index){
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu_index % std::max(1u, std::thread::hardware_concurrency()), &cpu_set);
+    int error_code = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (error_code != 0){
+        LOGGER.LogColorful(LogLevel::WARN, Color::Yellow, {"[ServStart] Failed to pin a reactor thread to CPU ", std::to_string(cpu_index), ": ", strerror(error_code)});
+    }
+}
+
+/**
+ * Serve the metrics of the given shards on the admin socket, if one is configured.
+ * @return nullptr if the admin socket is disabled
+ * @throws std::runtime_error if the socket can't be created.
+*/
+static std::unique_ptr<AdminSocket> OpenAdminSocket(const ServerConfig& config, MetricsRegistry& registry, const std::vector<const Server*>& shards){
+    if (config.admin_socket_path.empty()){
+        return nullptr;
+    }
+    for (const Server* shard : shards){
+        registry.AddShard(&shard->Metrics());
+    }
+    LOGGER.LogColorful(LogLevel::INFO, Color::Green, {"[ServStart] Serving the metrics on ", config.admin_socket_path});
+    return std::make_unique<AdminSocket>(config.admin_socket_path, registry, EXIT_SIGNAL);
+}
+
+/**
+ * Run N reactor threads, each with its own SO_REUSEPORT listenner and its own slice of the connections.
+ * @return process exit code
+*/
+static int RunShardedServer(char* hostname, char* port, const ServerConfig& config, MessageLog* message_log){
+    ShardHub hub(config.shards_n);
+    std::vector<std::unique_ptr<Server>> shards;
+    MetricsRegistry metrics_registry;
+    std::unique_ptr<AdminSocket> admin_socket;
+    try{
+        std::vector<const Server*> shard_pointers;
+        for (size_t i = 0; i < config.shards_n; ++i){
+            shards.push_back(std::make_unique<Server>(hostname, port, config, &hub, i, message_log));
+            shard_pointers.push_back(shards.back().get());
+        }
+        admin_socket = OpenAdminSocket(config, metrics_registry, shard_pointers);
+    } catch(std::runtime_error& err){
+        LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ServerInitFail] ", err.what()});
+        return 1;
+    }
+
+    std::atomic_int exit_code = 0;
+    std::vector<std::thread> reactor_threads;
+    for (size_t i = 0; i < config.shards_n; ++i){
+        reactor_threads.emplace_back([&, i](){
+            if (config.pin_cpus){
+                PinThreadToCpu(i);
+            }
+            try{
+                shards[i]->Start();
+            } catch(std::runtime_error& err){
+                LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ServerFatalError] (shard ", std::to_string(i), ") ", err.what()});
+                exit_code = 1;
+                EXIT_SIGNAL = 1; // bring the other shards down as well
+            }
+        });
+    }
+    for (std::thread& reactor_thread : reactor_threads){
+        reactor_thread.join();
+    }
+    EXIT_SIGNAL = 1; // stop the admin socket
+    return exit_code;
+}
+
+int main(int argc, char* argv[]){
+    ServerConfig config;
+    if (argc < 3 || !ParseServerOptions(argc - 3, argv + 3, config)){
+        std::cerr << "[Usage] ./server <hostname> <port> [options]\n"s
+                  << "  --egress-high-watermark=<bytes>   queued bytes at which messages for a slow client are dropped\n"s
+                  << "  --egress-low-watermark=<bytes>    queued bytes at which a slow client is considered healthy again\n"s
+                  << "  --slow-consumer-timeout=<ms>      how long a client may stay over the high watermark before it is disconnected\n"s
+                  << "  --listen-backlog=<n>              connections waiting for accept() in the kernel (default: SOMAXCONN)\n"s
+                  << "  --max-pending=<n>                 handshakes in progress at once, more connections are refused (default: 1024)\n"s
+                  << "  --handshake-timeout=<ms>          time a client has to get a nickname accepted (default: 10000)\n"s
+                  << "  --connect-rate=<n>                new connections per second from one IP address, 0 = unlimited (default: 20)\n"s
+                  << "  --connect-burst=<n>               connections an idle IP address may open at once (default: 40)\n"s
+                  << "  --heartbeat-interval=<ms>         ping a v2 client that has been silent for this long, 0 = off (default: 30000)\n"s
+                  << "  --heartbeat-timeout=<ms>          time a pinged client has to answer before it is disconnected (default: 10000)\n"s
+                  << "  --idle-timeout=<ms>               disconnect a user who has sent nothing for this long, 0 = never (default: 0)\n"s
+                  << "  --limit-chat=<rate>[:<burst>]     chat, private and channel messages per second of a client, 0 = unlimited (default: 20:40)\n"s
+                  << "  --limit-commands=<rate>[:<burst>] other commands per second of a client (default: 10:20)\n"s
+                  << "  --limit-nick=<rate>[:<burst>]     nickname requests per second of a client (default: 0.2:5)\n"s
+                  << "  --limit-bytes=<rate>[:<burst>]    received payload bytes per second of a client (default: 262144:1048576)\n"s
+                  << "  --flood-mute=<ms>                 how long a client that keeps flooding is muted, 0 = never (default: 30000)\n"s
+                  << "  --mailbox-messages=<n>            private messages kept for an offline nickname, 0 disables the mailboxes (default: 20)\n"s
+                  << "  --presence-window=<ms>            join/leave notices are announced together once per window (default: 250)\n"s
+                  << "  --io-backend=<epoll|io_uring>     event loop I/O backend (default: epoll)\n"s
+                  << "  --shards=<n>                      number of reactor threads with SO_REUSEPORT listenners (default: 1)\n"s
+                  << "  --pin-cpus=<0|1>                  pin reactor thread i to CPU i\n"s
+                  << "  --history-messages=<n>            chat lines replayed to a user who joins, 0 disables the history (default: 50)\n"s
+                  << "  --history-bytes=<bytes>           memory budget of the history (default: 65536)\n"s
+                  << "  --persist-dir=<path>              keep a durable log of the broadcasts in a directory (default: disabled)\n"s
+                  << "  --persist-segment-bytes=<bytes>   size of a log segment file (default: 67108864)\n"s
+                  << "  --persist-sync-bytes=<bytes>      sync the log once this many bytes have been written (default: 1048576)\n"s
+                  << "  --persist-sync-interval=<ms>      ...or once this much time has passed (default: 100)\n"s
+                  << "  --admin-socket=<path>             serve Prometheus metrics on a Unix socket (\"metrics\" command or GET /metrics)\n"s
+                  << "  --log-level=<debug|info|warn|error> minimal level of the logged records (default: info)\n"s
+                  << "  --log-file=<path>                 append the log to a file instead of stderr"s << std::endl;
+        return 1;
+    }
+    LOGGER.SetLevel(config.log_level);
+    try{
+        LOGGER.Start(config.log_file);
+    } catch(std::runtime_error& err){
+        std::cerr << MakeColorfulText("[ServerInitFail] "s + std::string(err.what()), Color::Red) << std::endl;
+        return 1;
+    }
+    std::unique_ptr<MessageLog> message_log;
+    if (!config.persist_dir.empty()){
+        try{
+            message_log = std::make_unique<MessageLog>(config.persist_dir, config.persist_segment_bytes, config.persist_sync_bytes,
+                                                       config.persist_sync_interval_ms, config.history_messages);
+        } catch(std::runtime_error& err){
+            LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ServerInitFail] ", err.what()});
+            return 1;
+        }
+    }
+    if (config.shards_n > 1){
+        int exit_code = RunShardedServer(argv[1], argv[2], config, message_log.get());
+        LOGGER.Log(LogLevel::INFO, {"Exited from the server!"});
+        return exit_code;
+    }
+
+    std::unique_ptr<Server> p_server;
+    MetricsRegistry metrics_registry;
+    std::unique_ptr<AdminSocket> admin_socket;
+    try{
+        p_server = std::make_unique<Server>(argv[1], argv[2], config, nullptr, 0, message_log.get());
+        admin_socket = OpenAdminSocket(config, metrics_registry, {p_server.get()});
+    } catch(std::runtime_error& err){
+        LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ServerInitFail] ", err.what()});
+        return 1;
+    }
+
+    try{
+        p_server->Start();
+    } catch(std::runtime_error& err){
+        LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ServerFatalError] ", err.what()});
+        EXIT_SIGNAL = 1;
+        return 1;
+    }
+    LOGGER.Log(LogLevel::INFO, {"Exited from the server!"});
+}
\ No newline at end of file
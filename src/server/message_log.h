@@ -0,0 +1,471 @@
+// This file contains the durable append-only log of the broadcasts: mmap'ed segments written by a background thread
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../../lib/logger.h"
+#include "../../lib/mpsc_queue.h"
+#include "outbound_queue.h"
+
+#define MESSAGE_LOG_INDEX_INTERVAL (64 * 1024) // bytes of records between two entries of a segment's sparse index
+#define MESSAGE_LOG_IDLE_SLEEP_US 1000 // how long the writer thread sleeps when nothing has been appended
+
+// CRC-32C (Castagnoli), reflected polynomial
+static constexpr std::array<uint32_t, 256> __BuildCrc32cTable__(){
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i){
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit){
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc32c_table = __BuildCrc32cTable__();
+
+/**
+ * Continue a CRC-32C over more bytes (start with crc = 0).
+*/
+static uint32_t Crc32c(uint32_t crc, const void* data, size_t length) noexcept{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i){
+        crc = crc32c_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Record header; the payload follows, and the next record starts at the next multiple of 8
+struct MessageLogRecordHeader{
+    uint32_t length; // payload bytes, 0 = end of the written part of the segment
+    uint32_t crc; // CRC-32C of the rest of the header and of the payload
+    uint64_t sequence; // consecutive over the whole log
+    int64_t time_ns; // wall clock of the broadcast
+    uint8_t flags; // v2 frame flags of the broadcast
+    uint8_t reserved[7];
+};
+static_assert(sizeof(MessageLogRecordHeader) == 32, "the record header is part of the file format");
+
+// Entry of a segment's sparse index (<first sequence>.idx): the offset of one record every MESSAGE_LOG_INDEX_INTERVAL bytes
+struct MessageLogIndexEntry{
+    uint64_t sequence;
+    uint64_t offset;
+};
+
+/**
+ * Durable log of the broadcast messages. Append() only hands the already-assembled v2 packet to a lock-free queue,
+ * so the event loop never waits for the disk. A background thread copies the records into the current segment
+ * (a preallocated file named after its first sequence number, mapped with mmap()) and makes them durable by group commit:
+ * one msync() once sync_bytes have been written or sync_interval_ms have passed, whichever comes first.
+ * Opening the log recovers its tail: the scan starts at the last valid entry of the last segment's sparse index,
+ * so it reads at most MESSAGE_LOG_INDEX_INTERVAL bytes of records, not the whole log.
+*/
+class MessageLog{
+public:
+    struct Record{
+        uint64_t sequence;
+        int64_t time_ns;
+        uint8_t flags;
+        std::string text;
+    };
+
+    /**
+     * Open (or create) the log in a directory, recover its tail and start the writer thread.
+     * @param tail_n number of the newest records to keep in RecoveredTail()
+     * @throws std::runtime_error if the directory or a segment can't be opened.
+    */
+    MessageLog(const std::string& directory, size_t segment_bytes, size_t sync_bytes, int sync_interval_ms, size_t tail_n)
+        : directory_(directory), segment_bytes_(segment_bytes), sync_bytes_(sync_bytes), sync_interval_(std::chrono::milliseconds(sync_interval_ms)){
+        if (mkdir(directory_.c_str(), 0755) == -1 && errno != EEXIST){
+            throw std::runtime_error("mkdir(): "s + directory_ + ": "s + std::string(strerror(errno)));
+        }
+        auto started_at = std::chrono::steady_clock::now();
+        __Recover__(tail_n);
+        auto recovery_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started_at).count();
+        LOGGER.LogColorful(LogLevel::INFO, Color::Green, {"[MessageLog] Opened ", directory_, ": ", std::to_string(segments_.size()), " segments, ",
+                                                          std::to_string(next_sequence_ - 1), " messages, recovered in ", std::to_string(recovery_ms), " ms."});
+        running_ = true;
+        thread_ = std::thread(&MessageLog::__WriteLoop__, this);
+    }
+
+    MessageLog(const MessageLog& other) = delete;
+    MessageLog& operator=(const MessageLog& other) = delete;
+
+    // Write and sync everything appended so far.
+    ~MessageLog(){
+        running_ = false;
+        thread_.join();
+        __CloseSegment__();
+    }
+
+    /**
+     * Queue a broadcast for the log. Called from any reactor thread, never blocks.
+     * @param packet the v2 packet of the broadcast (its header holds the flags)
+    */
+    void Append(const SharedPacket& packet){
+        if (failed_.load(std::memory_order_relaxed)){
+            return;
+        }
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        queue_.Push(PendingRecord{.time_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec, .packet = packet});
+    }
+
+    // The newest records found when the log was opened, oldest first.
+    const std::vector<Record>& RecoveredTail() const noexcept{
+        return recovered_tail_;
+    }
+
+private:
+    struct PendingRecord{
+        int64_t time_ns = 0;
+        SharedPacket packet;
+    };
+
+    // A segment file mapped into memory
+    struct Mapping{
+        char* data = nullptr;
+        size_t size = 0;
+    };
+
+    static size_t __RecordSize__(size_t payload_length) noexcept{
+        return sizeof(MessageLogRecordHeader) + ((payload_length + 7) & ~size_t(7));
+    }
+
+    static uint32_t __RecordCrc__(const MessageLogRecordHeader& header, const char* payload) noexcept{
+        uint32_t crc = Crc32c(0, reinterpret_cast<const char*>(&header) + offsetof(MessageLogRecordHeader, sequence),
+                              sizeof(header) - offsetof(MessageLogRecordHeader, sequence));
+        return Crc32c(crc, payload, header.length);
+    }
+
+    /**
+     * @return the header of a complete record with the expected sequence number at the offset, nullptr if there is none
+    */
+    static const MessageLogRecordHeader* __ValidRecordAt__(const Mapping& mapping, size_t offset, uint64_t sequence) noexcept{
+        if (offset + sizeof(MessageLogRecordHeader) > mapping.size){
+            return nullptr;
+        }
+        const MessageLogRecordHeader* header = reinterpret_cast<const MessageLogRecordHeader*>(mapping.data + offset);
+        if (header->length == 0 || header->sequence != sequence || offset + __RecordSize__(header->length) > mapping.size
+            || header->crc != __RecordCrc__(*header, mapping.data + offset + sizeof(MessageLogRecordHeader))){
+            return nullptr;
+        }
+        return header;
+    }
+
+    /**
+     * Walk the valid records from an offset until the first invalid one.
+     * @return offset and sequence number after the last valid record
+    */
+    template <typename Visitor>
+    static std::pair<size_t, uint64_t> __Scan__(const Mapping& mapping, size_t offset, uint64_t sequence, Visitor&& visit){
+        const MessageLogRecordHeader* header;
+        while ((header = __ValidRecordAt__(mapping, offset, sequence)) != nullptr){
+            visit(*header, mapping.data + offset + sizeof(MessageLogRecordHeader));
+            offset += __RecordSize__(header->length);
+            ++sequence;
+        }
+        return {offset, sequence};
+    }
+
+    std::string __SegmentPath__(uint64_t first_sequence, const char* extension) const{
+        char name[32];
+        snprintf(name, sizeof(name), "%020" PRIu64 "%s", first_sequence, extension);
+        return directory_ + "/"s + name;
+    }
+
+    static Mapping __Map__(int fd, size_t size, int protection){
+        void* data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED){
+            throw std::runtime_error("mmap(): "s + std::string(strerror(errno)));
+        }
+        return Mapping{.data = static_cast<char*>(data), .size = size};
+    }
+
+    std::vector<MessageLogIndexEntry> __LoadIndex__(uint64_t first_sequence) const{
+        std::vector<MessageLogIndexEntry> index;
+        int fd = open(__SegmentPath__(first_sequence, ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1){
+            return index;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == 0){
+            index.resize(file_stat.st_size / sizeof(MessageLogIndexEntry));
+            ssize_t read_n = pread(fd, index.data(), index.size() * sizeof(MessageLogIndexEntry), 0);
+            index.resize(read_n > 0 ? read_n / sizeof(MessageLogIndexEntry) : 0);
+        }
+        close(fd);
+        return index;
+    }
+
+    /**
+     * Find the segments, the end of the last one and the newest tail_n records, then open the segment to append to.
+    */
+    void __Recover__(size_t tail_n){
+        DIR* dir = opendir(directory_.c_str());
+        if (dir == nullptr){
+            throw std::runtime_error("opendir(): "s + directory_ + ": "s + std::string(strerror(errno)));
+        }
+        while (dirent* entry = readdir(dir)){
+            std::string_view name(entry->d_name);
+            if (name.size() == 24 && name.substr(20) == ".seg"){
+                segments_.push_back(std::stoull(std::string(name.substr(0, 20))));
+            }
+        }
+        closedir(dir);
+        std::sort(segments_.begin(), segments_.end());
+        if (segments_.empty()){
+            __OpenSegment__(1);
+            return;
+        }
+
+        // The end of the log: the last index entry that points at a valid record is where the scan starts.
+        uint64_t last_first_sequence = segments_.back();
+        int fd = open(__SegmentPath__(last_first_sequence, ".seg").c_str(), O_RDWR | O_CLOEXEC);
+        struct stat file_stat;
+        if (fd == -1 || fstat(fd, &file_stat) == -1){
+            throw std::runtime_error("open(): "s + __SegmentPath__(last_first_sequence, ".seg") + ": "s + std::string(strerror(errno)));
+        }
+        Mapping mapping = file_stat.st_size > 0 ? __Map__(fd, file_stat.st_size, PROT_READ | PROT_WRITE) : Mapping();
+        std::vector<MessageLogIndexEntry> index = __LoadIndex__(last_first_sequence);
+        while (!index.empty() && __ValidRecordAt__(mapping, index.back().offset, index.back().sequence) == nullptr){ // written after the last sync
+            index.pop_back();
+        }
+        size_t scan_offset = index.empty() ? 0 : index.back().offset;
+        uint64_t scan_sequence = index.empty() ? last_first_sequence : index.back().sequence;
+        auto [end_offset, next_sequence] = __Scan__(mapping, scan_offset, scan_sequence, [](const MessageLogRecordHeader&, const char*){});
+        next_sequence_ = next_sequence;
+
+        __CollectTail__(tail_n);
+
+        if (mapping.size == segment_bytes_ && end_offset < mapping.size){ // the segment has room: keep appending to it
+            __ZeroStaleBytes__(mapping, end_offset);
+            segment_fd_ = fd;
+            mapping_ = mapping;
+            write_offset_ = synced_offset_ = end_offset;
+            last_indexed_offset_ = index.empty() ? 0 : index.back().offset;
+            index_fd_ = open(__SegmentPath__(last_first_sequence, ".idx").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (index_fd_ == -1 || ftruncate(index_fd_, index.size() * sizeof(MessageLogIndexEntry)) == -1
+                || lseek(index_fd_, 0, SEEK_END) == -1){
+                throw std::runtime_error("open(): "s + __SegmentPath__(last_first_sequence, ".idx") + ": "s + std::string(strerror(errno)));
+            }
+            index_n_ = index.size();
+            return;
+        }
+        if (mapping.data != nullptr){
+            munmap(mapping.data, mapping.size);
+        }
+        close(fd);
+        __OpenSegment__(next_sequence_);
+    }
+
+    /**
+     * Read the newest tail_n records: only the index interval before the first of them is scanned.
+    */
+    void __CollectTail__(size_t tail_n){
+        if (tail_n == 0 || next_sequence_ == segments_.front()){
+            return;
+        }
+        uint64_t first_wanted = next_sequence_ - std::min<uint64_t>(tail_n, next_sequence_ - segments_.front());
+        auto segment_it = std::upper_bound(segments_.begin(), segments_.end(), first_wanted) - 1;
+        for (; segment_it != segments_.end(); ++segment_it){
+            std::string path = __SegmentPath__(*segment_it, ".seg");
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat file_stat;
+            if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size == 0){
+                if (fd != -1){
+                    close(fd);
+                }
+                continue;
+            }
+            Mapping mapping = __Map__(fd, file_stat.st_size, PROT_READ);
+            close(fd);
+            size_t offset = 0;
+            uint64_t sequence = *segment_it;
+            for (const MessageLogIndexEntry& entry : __LoadIndex__(*segment_it)){
+                if (entry.sequence > first_wanted){
+                    break;
+                }
+                if (__ValidRecordAt__(mapping, entry.offset, entry.sequence) != nullptr){
+                    offset = entry.offset;
+                    sequence = entry.sequence;
+                }
+            }
+            __Scan__(mapping, offset, sequence, [&](const MessageLogRecordHeader& header, const char* payload){
+                if (header.sequence >= first_wanted){
+                    recovered_tail_.push_back(Record{.sequence = header.sequence, .time_ns = header.time_ns, .flags = header.flags, .text = std::string(payload, header.length)});
+                }
+            });
+            munmap(mapping.data, mapping.size);
+        }
+    }
+
+    // Clear what a crashed run has left after the end of the log, so that it can't pass for a record later.
+    static void __ZeroStaleBytes__(Mapping& mapping, size_t offset) noexcept{
+        const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        while (offset < mapping.size){
+            size_t chunk_end = std::min(mapping.size, (offset / page_size + 1) * page_size);
+            char* chunk = mapping.data + offset;
+            size_t chunk_size = chunk_end - offset;
+            if (std::all_of(chunk, chunk + chunk_size, [](char c){ return c == 0; })){ // records are contiguous: the rest is clean
+                return;
+            }
+            memset(chunk, 0, chunk_size);
+            offset = chunk_end;
+        }
+    }
+
+    // Create a preallocated segment (and its empty index) and make it the one appended to.
+    void __OpenSegment__(uint64_t first_sequence){
+        std::string path = __SegmentPath__(first_sequence, ".seg");
+        segment_fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (segment_fd_ == -1 || ftruncate(segment_fd_, segment_bytes_) == -1){
+            throw std::runtime_error("open(): "s + path + ": "s + std::string(strerror(errno)));
+        }
+        mapping_ = __Map__(segment_fd_, segment_bytes_, PROT_READ | PROT_WRITE);
+        index_fd_ = open(__SegmentPath__(first_sequence, ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (index_fd_ == -1){
+            throw std::runtime_error("open(): "s + __SegmentPath__(first_sequence, ".idx") + ": "s + std::string(strerror(errno)));
+        }
+        write_offset_ = synced_offset_ = last_indexed_offset_ = 0;
+        index_n_ = 0;
+        if (segments_.empty() || segments_.back() != first_sequence){
+            segments_.push_back(first_sequence);
+        }
+    }
+
+    // Sync and unmap the current segment.
+    void __CloseSegment__() noexcept{
+        if (mapping_.data == nullptr){
+            return;
+        }
+        __Sync__();
+        munmap(mapping_.data, mapping_.size);
+        mapping_ = Mapping();
+        close(segment_fd_);
+        close(index_fd_);
+        segment_fd_ = index_fd_ = -1;
+    }
+
+    // Group commit: make everything written since the previous sync durable with one msync() (and one fdatasync() of the index).
+    void __Sync__() noexcept{
+        if (write_offset_ > synced_offset_){
+            const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t sync_begin = synced_offset_ / page_size * page_size;
+            if (msync(mapping_.data + sync_begin, write_offset_ - sync_begin, MS_SYNC) == -1){
+                LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[MessageLog] msync(): ", strerror(errno)});
+            }
+            fdatasync(index_fd_);
+            synced_offset_ = write_offset_;
+        }
+        last_sync_ = std::chrono::steady_clock::now();
+    }
+
+    void __Write__(const PendingRecord& pending){
+        std::string_view payload = std::string_view(*pending.packet).substr(V2_HEADER_LENGTH);
+        size_t record_size = __RecordSize__(payload.size());
+        if (payload.empty() || record_size > segment_bytes_){
+            return;
+        }
+        if (write_offset_ + record_size > segment_bytes_){ // the segment is full: shrink it to its records and start the next one
+            __CloseSegment__();
+            if (truncate(__SegmentPath__(segments_.back(), ".seg").c_str(), write_offset_) == -1){
+                LOGGER.LogColorful(LogLevel::WARN, Color::Yellow, {"[MessageLog] truncate(): ", strerror(errno)});
+            }
+            __OpenSegment__(next_sequence_);
+        }
+
+        char* record = mapping_.data + write_offset_;
+        MessageLogRecordHeader header{};
+        header.length = static_cast<uint32_t>(payload.size());
+        header.sequence = next_sequence_;
+        header.time_ns = pending.time_ns;
+        header.flags = static_cast<uint8_t>((*pending.packet)[5]);
+        memcpy(record + sizeof(header), payload.data(), payload.size());
+        header.crc = __RecordCrc__(header, record + sizeof(header));
+        memcpy(record, &header, sizeof(header));
+
+        if (index_n_ == 0 || write_offset_ >= last_indexed_offset_ + MESSAGE_LOG_INDEX_INTERVAL){
+            MessageLogIndexEntry entry{.sequence = next_sequence_, .offset = write_offset_};
+            if (write(index_fd_, &entry, sizeof(entry)) == sizeof(entry)){
+                last_indexed_offset_ = write_offset_;
+                ++index_n_;
+            }
+        }
+        write_offset_ += record_size;
+        ++next_sequence_;
+    }
+
+    void __WriteLoop__() noexcept{
+        last_sync_ = std::chrono::steady_clock::now();
+        while (true){
+            bool stopping = !running_.load(std::memory_order_acquire); // read before draining: nothing appended before the stop is lost
+            size_t written_n = 0;
+            PendingRecord pending;
+            while (queue_.Pop(pending)){
+                try{
+                    __Write__(pending);
+                } catch(std::runtime_error& err){ // a new segment can't be created
+                    LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[MessageLog] ", err.what(), ", the log is disabled."});
+                    failed_ = true;
+                    while (queue_.Pop(pending)) {}
+                    return;
+                }
+                pending.packet.reset();
+                ++written_n;
+            }
+            if (write_offset_ - synced_offset_ >= sync_bytes_ || std::chrono::steady_clock::now() - last_sync_ >= sync_interval_){
+                __Sync__();
+            }
+            if (stopping){
+                return;
+            }
+            if (written_n == 0){
+                std::this_thread::sleep_for(std::chrono::microseconds(MESSAGE_LOG_IDLE_SLEEP_US));
+            }
+        }
+    }
+
+    const std::string directory_;
+    const size_t segment_bytes_;
+    const size_t sync_bytes_;
+    const std::chrono::steady_clock::duration sync_interval_;
+
+    std::vector<uint64_t> segments_; // first sequence numbers of the segments, ascending
+    std::vector<Record> recovered_tail_;
+    MpscQueue<PendingRecord> queue_;
+    std::atomic_bool running_{false};
+    std::atomic_bool failed_{false}; // the writer thread has given up: appends are ignored
+    std::thread thread_;
+
+    // Writer thread only (after the recovery)
+    int segment_fd_ = -1;
+    int index_fd_ = -1;
+    Mapping mapping_;
+    size_t write_offset_ = 0; // end of the records of the current segment
+    size_t synced_offset_ = 0; // end of the durable records
+    size_t last_indexed_offset_ = 0;
+    size_t index_n_ = 0; // entries of the current segment's index
+    uint64_t next_sequence_ = 1;
+    std::chrono::steady_clock::time_point last_sync_;
+};
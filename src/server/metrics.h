@@ -0,0 +1,249 @@
+// This file contains the server's metrics: per-reactor counters and histograms, and their Prometheus text rendering
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define METRICS_HISTOGRAM_SUB_BUCKET_BITS 2 // every power of 2 is split into 4 buckets
+#define METRICS_HISTOGRAM_MAX_POWER 40 // samples up to 2^40 (18 minutes in ns, 1 TiB in bytes)
+
+// Classification of DisconnectedClient::disconnect_reason, used as a metrics label
+enum class DisconnectReason : uint8_t{
+    CLIENT_QUIT = 0,
+    SOCKET_ERROR = 1,
+    PROTOCOL_VIOLATION = 2,
+    DELIVERY_FAILED = 3,
+    SLOW_CONSUMER = 4,
+    SERVER_ERROR = 5,
+    HANDSHAKE_TIMEOUT = 6,
+    HEARTBEAT_TIMEOUT = 7, // no answer to a heartbeat ping: the peer is gone
+    IDLE_TIMEOUT = 8,
+    FLOODING = 9 // kept overdrawing its flood control budgets
+};
+#define DISCONNECT_REASONS_N 10
+
+static constexpr std::array<const char*, DISCONNECT_REASONS_N> disconnect_reason_labels = {
+    "client_quit", "socket_error", "protocol_violation", "delivery_failed", "slow_consumer", "server_error", "handshake_timeout",
+    "heartbeat_timeout", "idle_timeout", "flooding"
+};
+
+// Why the admission control has turned an accepted socket away, used as a metrics label
+enum class RejectReason : uint8_t{
+    PENDING_FULL = 0, // too many handshakes in progress
+    RATE_LIMITED = 1 // the client's IP has connected too often
+};
+#define REJECT_REASONS_N 2
+
+static constexpr std::array<const char*, REJECT_REASONS_N> reject_reason_labels = {
+    "pending_full", "rate_limited"
+};
+
+/**
+ * Monotonic counter written by a single reactor thread and read by any thread.
+ * The owner increments with a relaxed load + store (no locked instruction), readers see a slightly stale value.
+*/
+class MetricCounter{
+public:
+    void Add(uint64_t n = 1) noexcept{
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t Value() const noexcept{
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic_uint64_t value_{0};
+};
+
+// Single-writer gauge (see MetricCounter)
+class MetricGauge{
+public:
+    void Add(int64_t n) noexcept{
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    int64_t Value() const noexcept{
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic_int64_t value_{0};
+};
+
+/**
+ * Single-writer log-linear histogram: recording is a bucket index computation and two relaxed counter updates.
+ * Buckets are exported at power-of-2 boundaries, which the sub-buckets align with.
+*/
+class MetricHistogram{
+public:
+    static constexpr size_t SUB_BUCKETS = size_t(1) << METRICS_HISTOGRAM_SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS_N = (METRICS_HISTOGRAM_MAX_POWER + 1) * SUB_BUCKETS;
+
+    void Record(uint64_t value) noexcept{
+        __Increment__(buckets_[__BucketIndex__(value)], 1);
+        __Increment__(sum_, value);
+    }
+
+    /**
+     * @return number of samples <= 2^power - 1, i.e. below 2^power
+    */
+    uint64_t CountBelowPower(size_t power) const noexcept{
+        size_t end = std::min(BUCKETS_N, power <= METRICS_HISTOGRAM_SUB_BUCKET_BITS ? (size_t(1) << power) : (power - METRICS_HISTOGRAM_SUB_BUCKET_BITS + 1) * SUB_BUCKETS);
+        uint64_t count = 0;
+        for (size_t i = 0; i < end; ++i){
+            count += buckets_[i].load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    uint64_t Count() const noexcept{
+        return CountBelowPower(METRICS_HISTOGRAM_MAX_POWER + METRICS_HISTOGRAM_SUB_BUCKET_BITS + 1);
+    }
+    uint64_t Sum() const noexcept{
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static void __Increment__(std::atomic_uint64_t& counter, uint64_t n) noexcept{
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // Values below SUB_BUCKETS get a bucket each; above, [2^k, 2^(k+1)) is split into SUB_BUCKETS equal buckets.
+    static size_t __BucketIndex__(uint64_t value) noexcept{
+        if (value < SUB_BUCKETS){
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - METRICS_HISTOGRAM_SUB_BUCKET_BITS;
+        size_t index = ((shift + 1) << METRICS_HISTOGRAM_SUB_BUCKET_BITS) + ((value >> shift) - SUB_BUCKETS);
+        return std::min(index, BUCKETS_N - 1);
+    }
+
+    std::array<std::atomic_uint64_t, BUCKETS_N> buckets_{};
+    std::atomic_uint64_t sum_{0};
+};
+
+// Metrics of one reactor thread (shard). Only the owner thread records, the admin thread renders.
+struct ServerMetrics{
+    MetricCounter connections_accepted;
+    MetricCounter connections_failed; // the client has left (or has been dropped) before completing the handshake
+    std::array<MetricCounter, REJECT_REASONS_N> connections_rejected; // closed by the admission control right after accept()
+    MetricGauge pending_handshakes;
+    MetricGauge users_connected;
+    MetricGauge channel_memberships; // sum of the member counts of the shard's channels
+    MetricCounter messages_in; // frames received
+    MetricCounter messages_out; // packets queued
+    MetricCounter messages_dropped; // packets not queued for a congested client
+    MetricCounter clients_throttled; // times a client has overdrawn a budget and its socket has stopped being read
+    MetricCounter clients_muted;
+    MetricCounter bytes_in;
+    MetricCounter bytes_out;
+    std::array<MetricCounter, DISCONNECT_REASONS_N> disconnects;
+    MetricHistogram broadcast_fanout_ns; // time to queue a broadcast for every local recipient
+    MetricHistogram channel_fanout_ns; // time to queue a channel message for every local member
+    MetricHistogram egress_queue_bytes; // client's outbound queue depth after each flush
+};
+
+// Monotonic clock for the metrics (vDSO, no syscall)
+static uint64_t MetricsNowNs() noexcept{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The metrics of all shards, rendered together in the Prometheus text exposition format.
+*/
+class MetricsRegistry{
+public:
+    void AddShard(const ServerMetrics* metrics){
+        shards_.push_back(metrics);
+    }
+
+    std::string RenderPrometheus() const{
+        std::string out;
+        out.reserve(8192);
+        __RenderSum__(out, "chat_connections_accepted_total", "counter", "Accepted client connections.", &ServerMetrics::connections_accepted);
+        __RenderSum__(out, "chat_connections_failed_total", "counter", "Connections closed before completing the handshake.", &ServerMetrics::connections_failed);
+        __RenderSum__(out, "chat_pending_handshakes", "gauge", "Accepted connections that haven't completed the handshake.", &ServerMetrics::pending_handshakes);
+        __RenderSum__(out, "chat_users_connected", "gauge", "Users that have completed the handshake.", &ServerMetrics::users_connected);
+        __RenderSum__(out, "chat_channel_memberships", "gauge", "Channel memberships (a user in 3 channels counts 3 times).", &ServerMetrics::channel_memberships);
+        __RenderSum__(out, "chat_messages_in_total", "counter", "Frames received from clients.", &ServerMetrics::messages_in);
+        __RenderSum__(out, "chat_messages_out_total", "counter", "Packets queued for clients.", &ServerMetrics::messages_out);
+        __RenderSum__(out, "chat_messages_dropped_total", "counter", "Packets dropped for congested clients.", &ServerMetrics::messages_dropped);
+        __RenderSum__(out, "chat_clients_throttled_total", "counter", "Times a client has overdrawn its flood control budget and stopped being read.", &ServerMetrics::clients_throttled);
+        __RenderSum__(out, "chat_clients_muted_total", "counter", "Clients muted for flooding.", &ServerMetrics::clients_muted);
+        __RenderSum__(out, "chat_bytes_in_total", "counter", "Bytes received from clients.", &ServerMetrics::bytes_in);
+        __RenderSum__(out, "chat_bytes_out_total", "counter", "Bytes written to clients.", &ServerMetrics::bytes_out);
+
+        out.append("# HELP chat_connections_rejected_total Connections refused by the admission control by reason.\n# TYPE chat_connections_rejected_total counter\n");
+        for (size_t reason = 0; reason < REJECT_REASONS_N; ++reason){
+            uint64_t total = 0;
+            for (const ServerMetrics* shard : shards_){
+                total += shard->connections_rejected[reason].Value();
+            }
+            out.append("chat_connections_rejected_total{reason=\"").append(reject_reason_labels[reason]).append("\"} ").append(std::to_string(total)).append("\n");
+        }
+
+        out.append("# HELP chat_disconnects_total Disconnected clients by reason.\n# TYPE chat_disconnects_total counter\n");
+        for (size_t reason = 0; reason < DISCONNECT_REASONS_N; ++reason){
+            uint64_t total = 0;
+            for (const ServerMetrics* shard : shards_){
+                total += shard->disconnects[reason].Value();
+            }
+            out.append("chat_disconnects_total{reason=\"").append(disconnect_reason_labels[reason]).append("\"} ").append(std::to_string(total)).append("\n");
+        }
+
+        __RenderHistogram__(out, "chat_broadcast_fanout_seconds", "Time to queue a broadcast for every recipient of a reactor.", &ServerMetrics::broadcast_fanout_ns, 1e-9, 10, 34);
+        __RenderHistogram__(out, "chat_channel_fanout_seconds", "Time to queue a channel message for every member of a reactor.", &ServerMetrics::channel_fanout_ns, 1e-9, 10, 34);
+        __RenderHistogram__(out, "chat_egress_queue_bytes", "Outbound queue depth of a client after a flush.", &ServerMetrics::egress_queue_bytes, 1.0, 0, 30);
+        return out;
+    }
+
+private:
+    template <typename Metric>
+    void __RenderSum__(std::string& out, const char* name, const char* type, const char* help, Metric ServerMetrics::* member) const{
+        int64_t total = 0;
+        for (const ServerMetrics* shard : shards_){
+            total += static_cast<int64_t>((shard->*member).Value());
+        }
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        out.append(name).append(" ").append(std::to_string(total)).append("\n");
+    }
+
+    /**
+     * @param scale unit of the samples in the exported unit (1e-9: ns -> seconds)
+     * @param min_power, max_power range of the exported power-of-2 bucket boundaries
+    */
+    void __RenderHistogram__(std::string& out, const char* name, const char* help, MetricHistogram ServerMetrics::* member,
+                             double scale, size_t min_power, size_t max_power) const{
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" histogram\n");
+        char bound[32];
+        for (size_t power = min_power; power <= max_power; ++power){
+            uint64_t count = 0;
+            for (const ServerMetrics* shard : shards_){
+                count += (shard->*member).CountBelowPower(power);
+            }
+            snprintf(bound, sizeof(bound), "%g", static_cast<double>((uint64_t(1) << power) - 1) * scale);
+            out.append(name).append("_bucket{le=\"").append(bound).append("\"} ").append(std::to_string(count)).append("\n");
+        }
+        uint64_t count = 0, sum = 0;
+        for (const ServerMetrics* shard : shards_){
+            count += (shard->*member).Count();
+            sum += (shard->*member).Sum();
+        }
+        snprintf(bound, sizeof(bound), "%g", static_cast<double>(sum) * scale);
+        out.append(name).append("_bucket{le=\"+Inf\"} ").append(std::to_string(count)).append("\n");
+        out.append(name).append("_sum ").append(bound).append("\n");
+        out.append(name).append("_count ").append(std::to_string(count)).append("\n");
+    }
+
+    std::vector<const ServerMetrics*> shards_;
+};
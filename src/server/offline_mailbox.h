@@ -0,0 +1,84 @@
+// This file contains the mailboxes of the private messages sent to offline users
+#pragma once
+
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#define OFFLINE_MAILBOXES_MAX 4096 // offline nicknames with waiting messages, per reactor thread
+
+/**
+ * Private messages kept for nicknames that aren't connected, until a user takes the nickname. Every shard keeps
+ * the mailboxes of the nicknames it owns, so the shard that decides a nickname claim hands the mailbox over with its answer.
+ * Memory is bounded: at most messages_per_user messages for at most OFFLINE_MAILBOXES_MAX nicknames.
+*/
+class OfflineMailboxes{
+public:
+    // @param messages_per_user messages kept per nickname, 0 disables the mailboxes
+    explicit OfflineMailboxes(size_t messages_per_user) : messages_per_user_(messages_per_user) {}
+
+    bool Enabled() const noexcept{
+        return messages_per_user_ > 0;
+    }
+
+    /**
+     * Keep a message (already formatted for the recipient) for an offline nickname.
+     * @return false if the nickname's mailbox, or the table of mailboxes, is full
+    */
+    bool Deposit(const std::string& recipient, std::string_view message){
+        auto mailbox_it = mailboxes_.find(recipient);
+        if (mailbox_it == mailboxes_.end()){
+            if (mailboxes_.size() >= OFFLINE_MAILBOXES_MAX){
+                return false;
+            }
+            mailbox_it = mailboxes_.emplace(recipient, std::vector<std::string>()).first;
+        }
+        if (mailbox_it->second.size() >= messages_per_user_){
+            return false;
+        }
+        mailbox_it->second.emplace_back(message);
+        return true;
+    }
+
+    /**
+     * Take the messages of a nickname (oldest first), emptying its mailbox.
+    */
+    std::vector<std::string> Collect(const std::string& recipient){
+        auto mailbox_it = mailboxes_.find(recipient);
+        if (mailbox_it == mailboxes_.end()){
+            return {};
+        }
+        std::vector<std::string> messages = std::move(mailbox_it->second);
+        mailboxes_.erase(mailbox_it);
+        return messages;
+    }
+
+    /**
+     * Put back the messages a user hasn't received (it has left before the handover completed), before the newer ones.
+    */
+    void Restore(const std::string& recipient, std::vector<std::string>&& messages){
+        if (messages.empty()){
+            return;
+        }
+        std::vector<std::string>& mailbox = mailboxes_[recipient];
+        messages.insert(messages.end(), std::make_move_iterator(mailbox.begin()), std::make_move_iterator(mailbox.end()));
+        if (messages.size() > messages_per_user_){
+            messages.resize(messages_per_user_);
+        }
+        mailbox = std::move(messages);
+    }
+
+    size_t MailboxesCount() const noexcept{
+        return mailboxes_.size();
+    }
+
+    void Clear() noexcept{
+        mailboxes_.clear();
+    }
+
+private:
+    const size_t messages_per_user_;
+    std::unordered_map<std::string, std::vector<std::string>> mailboxes_; // nickname -> messages, oldest first
+};
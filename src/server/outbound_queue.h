@@ -0,0 +1,282 @@
+// This file contains the per-client queue of outgoing message packets
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../lib/networking_ops.h"
+
+#define FLUSH_IOV_BATCH 64 // Max number of packets written by a single sendmsg() call
+#define OUTBOUND_QUEUE_MIN_CAPACITY 4 // packet slots allocated by the first Push()
+#define OUTBOUND_QUEUE_KEPT_CAPACITY 64 // a drained queue bigger than this gives its memory back
+
+#define PACKET_POOL_MAX_FREE 4096 // released packets kept for reuse per thread
+#define PACKET_POOL_MAX_KEPT_BYTES 16384 // a released packet with a bigger buffer is freed instead of pooled
+
+/**
+ * Reference-counted packet buffer. Released packets go back to the pool of the thread that releases them
+ * with their buffer capacity intact, so once the pool is warm assembling a packet costs no heap allocation.
+ * The counter is atomic: broadcast packets are shared by the queues of several reactor threads.
+*/
+class PacketBuffer{
+public:
+    std::string bytes;
+
+    static PacketBuffer* Acquire(){
+        Pool& pool = __ThreadPool__();
+        if (pool.free_list == nullptr){
+            return new PacketBuffer();
+        }
+        PacketBuffer* packet = pool.free_list;
+        pool.free_list = packet->next_free_;
+        --pool.free_n;
+        packet->refs_.store(1, std::memory_order_relaxed);
+        return packet;
+    }
+
+    void AddRef() noexcept{
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Release() noexcept{
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1){
+            return;
+        }
+        Pool& pool = __ThreadPool__();
+        if (pool.free_n >= PACKET_POOL_MAX_FREE || bytes.capacity() > PACKET_POOL_MAX_KEPT_BYTES){
+            delete this;
+            return;
+        }
+        bytes.clear();
+        next_free_ = pool.free_list;
+        pool.free_list = this;
+        ++pool.free_n;
+    }
+
+private:
+    struct Pool{
+        PacketBuffer* free_list = nullptr;
+        size_t free_n = 0;
+
+        ~Pool(){
+            while (free_list != nullptr){
+                PacketBuffer* next = free_list->next_free_;
+                delete free_list;
+                free_list = next;
+            }
+        }
+    };
+
+    static Pool& __ThreadPool__() noexcept{
+        thread_local Pool pool;
+        return pool;
+    }
+
+    std::atomic_uint32_t refs_{1};
+    PacketBuffer* next_free_ = nullptr;
+};
+
+// An assembled, immutable message packet shared by the outbound queues of all its recipients.
+class SharedPacket{
+public:
+    SharedPacket() noexcept = default;
+
+    // Take over a freshly acquired (or already referenced) buffer.
+    explicit SharedPacket(PacketBuffer* packet) noexcept : packet_(packet) {}
+
+    SharedPacket(const SharedPacket& other) noexcept : packet_(other.packet_){
+        if (packet_ != nullptr){
+            packet_->AddRef();
+        }
+    }
+    SharedPacket(SharedPacket&& other) noexcept : packet_(other.packet_){
+        other.packet_ = nullptr;
+    }
+    SharedPacket& operator=(SharedPacket other) noexcept{
+        std::swap(packet_, other.packet_);
+        return *this;
+    }
+    ~SharedPacket(){
+        reset();
+    }
+
+    void reset() noexcept{
+        if (packet_ != nullptr){
+            packet_->Release();
+            packet_ = nullptr;
+        }
+    }
+
+    const std::string* operator->() const noexcept{
+        return &packet_->bytes;
+    }
+    const std::string& operator*() const noexcept{
+        return packet_->bytes;
+    }
+    explicit operator bool() const noexcept{
+        return packet_ != nullptr;
+    }
+
+private:
+    PacketBuffer* packet_ = nullptr;
+};
+
+static SharedPacket MakeSharedPacket(std::string&& packet){
+    PacketBuffer* buffer = PacketBuffer::Acquire();
+    buffer->bytes = std::move(packet);
+    return SharedPacket(buffer);
+}
+
+// Assemble a frame right into a pooled buffer (see AssembleFrame()).
+static SharedPacket MakeFramePacket(ProtocolVersion version, Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    PacketBuffer* buffer = PacketBuffer::Acquire();
+    AssembleFrameInto(buffer->bytes, version, opcode, payload, flags);
+    return SharedPacket(buffer);
+}
+
+// A broadcast frame assembled once per protocol version: every recipient's queue references the encoding it speaks.
+struct VersionedPackets{
+    SharedPacket v1;
+    SharedPacket v2;
+
+    const SharedPacket& For(ProtocolVersion version) const noexcept{
+        return version == ProtocolVersion::V2 ? v2 : v1;
+    }
+};
+
+static VersionedPackets MakeVersionedPackets(Opcode opcode, std::string_view payload, uint8_t flags = 0){
+    return VersionedPackets{.v1 = MakeFramePacket(ProtocolVersion::V1, opcode, payload, flags),
+                            .v2 = MakeFramePacket(ProtocolVersion::V2, opcode, payload, flags)};
+}
+
+/**
+ * FIFO of assembled message packets waiting to be written to a non-blocking socket.
+ * Packets are never sent synchronously by the broadcaster: they are queued and flushed
+ * when the socket is writable, so one slow client never stalls the event loop.
+ * The packets are kept in a power-of-2 ring that is allocated on the first Push(), so an idle client's queue costs no heap memory.
+*/
+class OutboundQueue{
+public:
+    /**
+     * Append an assembled packet (<msg_length><msg>) to the end of the queue. Only the reference is stored.
+    */
+    void Push(SharedPacket packet){
+        if (packets_n_ == ring_.size()){
+            __Grow__();
+        }
+        queued_bytes_ += packet->size();
+        ring_[(head_ + packets_n_) & (ring_.size() - 1)] = std::move(packet);
+        ++packets_n_;
+    }
+
+    /**
+     * Write as many queued bytes as the socket accepts without blocking.
+     * Up to FLUSH_IOV_BATCH pending packets are gathered into a single sendmsg() call.
+     * @param socketfd a non-blocking socket of the queue's owner
+     * @return 0 if the queue has been emptied or the socket buffer is full, -1 on error with errno set
+    */
+    int Flush(int socketfd){
+        iovec iov[FLUSH_IOV_BATCH];
+        while (packets_n_ > 0){
+            size_t iov_n = Gather(iov, nullptr, FLUSH_IOV_BATCH);
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_n;
+
+            ssize_t sent_bytes = sendmsg(socketfd, &msg, MSG_NOSIGNAL);
+            if (sent_bytes == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK){ // wait for the next EPOLLOUT
+                    return 0;
+                }
+                return -1;
+            }
+            Consume(sent_bytes);
+            if (iov_n == FLUSH_IOV_BATCH || packets_n_ == 0){
+                continue;
+            }
+            return 0; // a partial write means the socket buffer is full
+        }
+        return 0;
+    }
+
+    /**
+     * Describe the oldest unsent bytes of the queue without removing them.
+     * @param iov array of at least max_n elements to be filled
+     * @param pinned optional array of at least max_n elements: receives references to the described packets,
+     *               so that they outlive the queue while an asynchronous write is in progress
+     * @return number of filled iovec structures
+    */
+    size_t Gather(iovec* iov, SharedPacket* pinned, size_t max_n) const{
+        size_t iov_n = 0;
+        for (; iov_n < packets_n_ && iov_n < max_n; ++iov_n){
+            const SharedPacket& packet = ring_[(head_ + iov_n) & (ring_.size() - 1)];
+            size_t offset = iov_n == 0 ? front_offset_ : 0;
+            iov[iov_n].iov_base = const_cast<char*>(packet->data() + offset);
+            iov[iov_n].iov_len = packet->size() - offset;
+            if (pinned != nullptr){
+                pinned[iov_n] = packet;
+            }
+        }
+        return iov_n;
+    }
+
+    // Drop the packets (or the part of the front packet) that have been written to the socket.
+    void Consume(size_t sent_bytes) noexcept{
+        queued_bytes_ -= sent_bytes;
+        while (sent_bytes > 0){
+            SharedPacket& front = ring_[head_];
+            size_t front_left = front->size() - front_offset_;
+            if (sent_bytes < front_left){
+                front_offset_ += sent_bytes;
+                return;
+            }
+            sent_bytes -= front_left;
+            front.reset();
+            head_ = (head_ + 1) & (ring_.size() - 1);
+            --packets_n_;
+            front_offset_ = 0;
+        }
+        if (packets_n_ == 0 && ring_.size() > OUTBOUND_QUEUE_KEPT_CAPACITY){ // a burst is over: don't hold its memory
+            ring_ = std::vector<SharedPacket>();
+            head_ = 0;
+        }
+    }
+
+    // Number of bytes that are still waiting to be sent.
+    size_t QueuedBytes() const noexcept{
+        return queued_bytes_;
+    }
+
+    bool Empty() const noexcept{
+        return packets_n_ == 0;
+    }
+
+private:
+    // Double the ring, moving the packets to its beginning in FIFO order.
+    void __Grow__(){
+        std::vector<SharedPacket> new_ring(ring_.empty() ? OUTBOUND_QUEUE_MIN_CAPACITY : ring_.size() * 2);
+        for (size_t i = 0; i < packets_n_; ++i){
+            new_ring[i] = std::move(ring_[(head_ + i) & (ring_.size() - 1)]);
+        }
+        ring_.swap(new_ring);
+        head_ = 0;
+    }
+
+    std::vector<SharedPacket> ring_; // capacity is 0 or a power of 2
+    uint32_t head_ = 0; // index of the oldest packet
+    uint32_t packets_n_ = 0;
+    size_t front_offset_ = 0; // bytes of the front packet that have already been sent
+    size_t queued_bytes_ = 0;
+};
@@ -0,0 +1,97 @@
+// This file contains the batching of the join/leave notices
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define PRESENCE_NAMES_MAX 5 // nicknames listed per kind of event in an aggregated notice
+
+/**
+ * Join and leave events of the users of a reactor thread, collected over a short window and announced with a single
+ * broadcast: a reconnect storm of K users costs the N others one notice each instead of K. Memory doesn't grow with K:
+ * only the counts, the first PRESENCE_NAMES_MAX nicknames of each kind and the full notice of the first event are kept.
+*/
+class PresenceBatch{
+public:
+    /**
+     * @param nickname user who has joined
+     * @param notice notice announcing the event alone
+    */
+    void Joined(std::string_view nickname, std::string_view notice){
+        __Record__(joined_, nickname, notice);
+    }
+
+    void Left(std::string_view nickname, std::string_view notice){
+        __Record__(left_, nickname, notice);
+    }
+
+    size_t EventsCount() const noexcept{
+        return joined_.count + left_.count;
+    }
+
+    bool Empty() const noexcept{
+        return EventsCount() == 0;
+    }
+
+    /**
+     * Text of the notice announcing the batch: the notice of the event itself if there's only one,
+     * "42 users joined (alice, bob, ...), 17 left (...)." otherwise.
+    */
+    std::string Notice() const{
+        if (EventsCount() == 1){
+            return first_notice_;
+        }
+        std::string notice;
+        __Describe__(notice, joined_, "joined");
+        if (joined_.count > 0 && left_.count > 0){
+            notice.append(", ");
+        }
+        __Describe__(notice, left_, "left");
+        notice.push_back('.');
+        return notice;
+    }
+
+    void Clear() noexcept{
+        joined_.count = left_.count = 0;
+        joined_.names.clear();
+        left_.names.clear();
+        first_notice_.clear();
+    }
+
+private:
+    struct Events{
+        size_t count = 0;
+        std::vector<std::string> names; // the first PRESENCE_NAMES_MAX of them
+    };
+
+    void __Record__(Events& events, std::string_view nickname, std::string_view notice){
+        if (Empty()){
+            first_notice_.assign(notice);
+        }
+        if (events.names.size() < PRESENCE_NAMES_MAX){
+            events.names.emplace_back(nickname);
+        }
+        ++events.count;
+    }
+
+    static void __Describe__(std::string& out, const Events& events, std::string_view verb){
+        if (events.count == 0){
+            return;
+        }
+        out.append(std::to_string(events.count)).append(events.count == 1 ? " user " : " users ").append(verb).append(" (");
+        for (size_t i = 0; i < events.names.size(); ++i){
+            if (i > 0){
+                out.append(", ");
+            }
+            out.append(events.names[i]);
+        }
+        if (events.count > events.names.size()){
+            out.append(" and ").append(std::to_string(events.count - events.names.size())).append(" more");
+        }
+        out.push_back(')');
+    }
+
+    Events joined_, left_;
+    std::string first_notice_;
+};
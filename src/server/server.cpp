@@ -1,7 +1,17 @@
 #include "server.h"
 
-Server::Server(char* hostname, char* port) : hostname_(hostname), port_(port) {
-    std::cerr << MakeColorfulText("[ServInit] Configuring the server..."s, Color::Yellow) << '\n';
+Server::Server(char* hostname, char* port, const ServerConfig& config, ShardHub* hub, size_t shard_id, MessageLog* message_log)
+    : hostname_(hostname), port_(port), config_(config), hub_(hub), shard_id_(shard_id), message_log_(message_log),
+      offline_mailboxes_(config.mailbox_messages),
+      // SO_REUSEPORT spreads the connections of an address over the shards: each one enforces its share of the budget
+      connect_limiter_(config.connect_rate_per_ip / (hub != nullptr ? hub->ShardsCount() : 1),
+                       config.connect_burst_per_ip / (hub != nullptr ? hub->ShardsCount() : 1)),
+      message_budgets_{TokenBudget::FromRateLimit(config.chat_limit, TIMER_WHEEL_TICK_MS),
+                       TokenBudget::FromRateLimit(config.command_limit, TIMER_WHEEL_TICK_MS),
+                       TokenBudget::FromRateLimit(config.nick_limit, TIMER_WHEEL_TICK_MS)},
+      byte_budget_(TokenBudget::FromRateLimit(config.bytes_limit, TIMER_WHEEL_TICK_MS)),
+      history_(config.history_messages, config.history_bytes) {
+    LOGGER.LogColorful(LogLevel::INFO, Color::Yellow, {"[ServInit] Configuring the server..."});
 
     addrinfo hints, *res_addr;
 
@@ -22,253 +32,648 @@ Server::Server(char* hostname, char* port) : hostname_(hostname), port_(port) {
         throw std::runtime_error("socket(): "s + std::string(strerror(errno)));
     }
 
+    // Allow launching the server right after a shutdown.
+    SetSocketOption(server_socket_, SO_REUSEADDR);
+    if (hub_ != nullptr){ // every shard binds its own listenner to the same address, the kernel balances the connections
+        SetSocketOption(server_socket_, SO_REUSEPORT);
+    }
+
     // Bind the server socket to an available address
     if (bind(server_socket_, res_addr->ai_addr, res_addr->ai_addrlen) == -1){
         throw std::runtime_error("bind(): "s + std::string(strerror(errno)));
     }
     freeaddrinfo(res_addr);
 
-    // Allow launching the server right after a shutdown.
-    SetSocketOption(server_socket_, SO_REUSEADDR);
+    if (message_log_ != nullptr){ // the conversation goes on where it has stopped
+        for (const MessageLog::Record& record : message_log_->RecoveredTail()){
+            if (!(record.flags & FRAME_FLAG_NOTICE)){
+                history_.Append(MakeVersionedPackets(Opcode::MESSAGE, record.text, record.flags));
+            }
+        }
+    }
+
+    LOGGER.LogColorful(LogLevel::INFO, Color::Green, {"[ServInit] Successfully configured the server!"});
+}
 
-    std::cerr << MakeColorfulText("[ServInit] Successfully configured the server!"s, Color::Green) << '\n';
+constexpr std::array<Server::Command, 256> Server::__BuildCommandTable__(){
+    // Command registry: a new command is one more line here and costs the existing ones nothing.
+    constexpr std::pair<Opcode, Command> commands[] = {
+        {Opcode::MESSAGE, {&Server::HandleChatMessage, true, MessageClass::CHAT}},
+        {Opcode::PROTO_UPGRD, {&Server::HandleProtocolUpgrade, false}},
+        {Opcode::NICK_NEWREQ, {&Server::HandleNicknameRequest, false, MessageClass::NICK_CHANGE}},
+        {Opcode::ACT_NICKCNG, {&Server::HandleNicknameChange, true, MessageClass::NICK_CHANGE}},
+        {Opcode::ACT_LSUSERS, {&Server::HandleUsersList, true}},
+        {Opcode::ACT_PMSGUSR, {&Server::HandlePrivateMessage, true, MessageClass::CHAT}},
+        {Opcode::ACT_CHNJOIN, {&Server::HandleChannelJoin, true}},
+        {Opcode::ACT_CHNLEAV, {&Server::HandleChannelLeave, true}},
+        {Opcode::ACT_CHNMSGS, {&Server::HandleChannelMessage, true, MessageClass::CHAT}},
+        {Opcode::HEARTB_PING, {&Server::HandleHeartbeatPing, false}},
+        {Opcode::HEARTB_PONG, {&Server::HandleHeartbeatPong, false}}
+    };
+    std::array<Command, 256> table{};
+    for (const auto& [opcode, command] : commands){
+        table[static_cast<uint8_t>(opcode)] = command;
+    }
+    return table;
 }
 
-int Server::ProcessMessage(int sender_socketfd, char* readable_buffer, std::vector<DisconnectedClient>& disconnected_storage){
-    // std::cerr << "ProcessMessage() call"s << std::endl;
-    // std::cerr << "ProcessMessage(): readable_buffer size is "s << strlen(readable_buffer) << std::endl;
+const std::array<Server::Command, 256> Server::command_table_ = Server::__BuildCommandTable__();
 
-    std::string msg_str(readable_buffer);
-    if (msg_str.size() == 0){ // TO DO: Make sure that no message is empty
-        return 0;
+void Server::ProcessMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    const Command& command = command_table_[static_cast<uint8_t>(frame.opcode)];
+    if (command.handler == nullptr){
+        HandleUnknownCommand(sender_socketfd, frame, disconnected_storage);
+        return;
     }
-    ConnectionInfo conn_inf = GetConnectionInfoFromSocket(sender_socketfd);
-    // std::cerr << "ProcessMessage(): Checking if this is a command"s << std::endl;
-    if (msg_str[0] == '\07'){
-        // std::cerr << "ProcessMessage(): This is a command!"s << std::endl;
-        std::string command_str(msg_str.substr(1));
-        const auto send_msg_with_errorchecking = [&](std::string&& message){
-            if (SendMessage(sender_socketfd, std::move(message)) == -1){
-                if (sock_to_user_.count(sender_socketfd)){ // check if this is a connected client
-                    disconnected_storage.push_back(DisconnectedClient{.socket_fd = sender_socketfd, .disconnect_reason = "message delivery failed: "s + std::string(strerror(errno))});
-                } else{ // not yet connected client
-                    return -1;
-                }
-            }
-            return 0;
-        };
-        switch (StringToClientKeySignal(command_str.substr(0, 11))){ // 11 = key signal bytes length
-            case ClientKeySignal::UNKNOWN:
-            {
-                send_msg_with_errorchecking(std::string("Unknown command: "s + command_str.substr(0, 11)));
-                break;
-            }
-            case ClientKeySignal::NICK_NEWREQ: // Client sending its initial nickname
-            {
-                // std::cerr << MakeColorfulText("ClientKeySignal: NICK_NEWREQ"s, Color::Cyan) << std::endl;
-                std::string nickname(command_str.substr(11));
-                NicknameAction nick_action = __ValidateNickname__(nickname);
-                if (nick_action == NicknameAction::NICK_ACCEPT){
-                    send_msg_with_errorchecking("\07NICK_ACCEPT"s);
-                    
-                    User new_user{.nickname = nickname, .ip_address = conn_inf.ip_address, .port = std::to_string(conn_inf.port)};
-
-                    pollfd new_user_pollobj;
-                    new_user_pollobj.events = POLLIN | POLLOUT;
-                    new_user_pollobj.fd = sender_socketfd;
-                    
-                    poll_objects_.push_back(std::move(new_user_pollobj));
-                    sock_to_user_[sender_socketfd] = std::move(new_user);
-                    taken_nicknames_.insert(nickname);
-                    BroadcastMessage(MakeColorfulText("[Connection] "s + nickname + " "s + conn_inf.ToString() + " has connected."s, Color::Green));
-                    memset(readable_buffer, 0, sizeof(*readable_buffer));
-                    return send_msg_with_errorchecking(std::string("Welcome to the server! Currently active users: "s + std::to_string(sock_to_user_.size())));
-                }
+    if (command.requires_user && !connections_.Find(sender_socketfd)->established){ // a command from an unconnected client -> protocol violation (possible DDOS)
+        disconnected_storage.push_back(DisconnectedClient{.socket_fd = sender_socketfd, .reason = DisconnectReason::PROTOCOL_VIOLATION, .disconnect_reason = "message protocol violation. (msg: "s + std::string(frame.payload) + ")."s});
+        return;
+    }
+    (this->*command.handler)(sender_socketfd, frame, disconnected_storage);
+}
 
-                return send_msg_with_errorchecking(std::string(nickaction_to_keysig_string.at(nick_action)));
-            }
-            case ClientKeySignal::ACT_PMSGUSR: // Client wants to send a Private Message to another one
-            { // TO DO
-                // int pos;
-                // std::string arguments_str = command_str.substr(11); // Omit the key signal
-                // pos = arguments_str.find('\02');
-                // std::string other_user(arguments_str.substr(0, pos));
-
-                // if (taken_nicknames_.count(other_user) == 0){ // if the user is not found
-                //     return send_msg_with_errorchecking(std::string(MakeColorfulText("[SERVER] User \""s + std::move(other_user) + "\" is not found."s, Color::Red)));
-                // }
-                // std::string message(arguments_str.substr(pos));
-                // return send_msg_with_errorchecking(std::string(MakeColorfulText("[PM] to "s + sock_to_user_[sender_socketfd].nickname + ": "s + message, Color::Yellow)));
-            }
-            default:
-                break;
+void Server::HandleChatMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    if (frame.payload.empty()){ // nothing to relay
+        return;
+    }
+    std::string_view sender_name = connections_.Find(sender_socketfd)->nickname.View();
+    BroadcastMessage(scratch_.Concat({"[", sender_name, "] ", frame.payload}));
+}
+
+void Server::HandleProtocolUpgrade(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    Connection& connection = *connections_.Find(sender_socketfd);
+    if (connection.protocol_version == ProtocolVersion::V2){
+        return;
+    }
+    QueueFrame(sender_socketfd, Opcode::PROTO_ACCPT);
+    connection.protocol_version = ProtocolVersion::V2;
+    connection.inbound.SetVersion(ProtocolVersion::V2); // the frames following this one in the same chunk are v2 already
+}
+
+void Server::HandleNicknameRequest(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    const Connection& connection = *connections_.Find(sender_socketfd);
+    if (connection.established || connection.nick_claim_in_flight){ // already connected or waiting for an answer
+        return;
+    }
+    NicknameAction nick_action = __ValidateNickname__(frame.payload);
+    if (nick_action != NicknameAction::NICK_ACCEPT){
+        QueueFrame(sender_socketfd, NicknameActionOpcode(nick_action)); // delivery errors are reported when the queue is flushed
+        return;
+    }
+    ClaimNickname(sender_socketfd, std::string(frame.payload));
+}
+
+void Server::HandleNicknameChange(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    if (connections_.Find(sender_socketfd)->nick_claim_in_flight){ // one change at a time
+        return;
+    }
+    NicknameAction nick_action = __ValidateNickname__(frame.payload);
+    if (nick_action != NicknameAction::NICK_ACCEPT){
+        QueueFrame(sender_socketfd, NicknameActionOpcode(nick_action));
+        return;
+    }
+    ClaimNickname(sender_socketfd, std::string(frame.payload));
+}
+
+void Server::HandleUsersList(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    if (hub_ == nullptr || hub_->ShardsCount() == 1){
+        SendUsersList(sender_socketfd, LocalUsersList());
+        return;
+    }
+    // Scatter the request to the other shards and gather their parts on the connection.
+    Connection& connection = *connections_.Find(sender_socketfd);
+    if (connection.user_list_replies_left > 0){ // the previous request is still being gathered
+        return;
+    }
+    connection.user_list = LocalUsersList();
+    connection.user_list_replies_left = hub_->ShardsCount() - 1;
+    hub_->PostToOthers(shard_id_, ShardMessage{.type = ShardMessageType::USER_LIST_REQUEST, .origin_shard = shard_id_, .socket_fd = sender_socketfd,
+                                               .generation = connection.generation});
+}
+
+void Server::HandlePrivateMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    size_t delimiter_pos = frame.payload.find('\02');
+    if (delimiter_pos == std::string_view::npos || delimiter_pos == 0 || delimiter_pos + 1 == frame.payload.size()){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, MakeColorfulText("[SERVER] Usage: /pm <nickname> <message>"s, Color::Red), FRAME_FLAG_NOTICE);
+        return;
+    }
+    std::string recipient(frame.payload.substr(0, delimiter_pos));
+    std::string_view message = frame.payload.substr(delimiter_pos + 1);
+    const Connection& sender_connection = *connections_.Find(sender_socketfd);
+    std::string sender(sender_connection.nickname.View());
+    uint32_t generation = sender_connection.generation;
+
+    if (DeliverPrivateMessage(recipient, sender, message)){
+        ReportPrivateMessage(sender_socketfd, generation, recipient, message, PrivateMessageOutcome::DELIVERED);
+        return;
+    }
+    if (hub_ == nullptr){
+        ReportPrivateMessage(sender_socketfd, generation, recipient, message, StoreOfflineMessage(recipient, sender, message));
+        return;
+    }
+    ShardMessage private_message{.type = ShardMessageType::PRIVATE_MESSAGE, .origin_shard = shard_id_, .socket_fd = sender_socketfd,
+                                 .generation = generation, .nickname = std::move(recipient), .sender_nickname = std::move(sender), .text = std::string(message)};
+    size_t owner = hub_->NicknameOwner(private_message.nickname);
+    if (owner == shard_id_){
+        RoutePrivateMessage(std::move(private_message));
+    } else{ // the nickname's owner knows which shard the recipient is on
+        hub_->Post(owner, std::move(private_message));
+    }
+}
+
+void Server::HandleChannelJoin(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    if (!__ValidateChannelName__(frame.payload)){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, MakeColorfulText("[SERVER] Usage: /join <channel> (up to 32 characters, no spaces)"s, Color::Red), FRAME_FLAG_NOTICE);
+        return;
+    }
+    std::string channel(frame.payload);
+    Connection& connection = *connections_.Find(sender_socketfd);
+    if (connection.channels.size() >= CHANNELS_PER_USER_MAX){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] You can't be in more than ", std::to_string(CHANNELS_PER_USER_MAX), " channels."}), FRAME_FLAG_NOTICE);
+        return;
+    }
+    auto [channel_id, joined] = channels_.Join(channel, sender_socketfd);
+    if (!joined){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] You are already in #", channel, "."}), FRAME_FLAG_NOTICE);
+        return;
+    }
+    connection.channels.push_back(channel_id);
+    metrics_.channel_memberships.Add(1);
+    ChannelMessage(channel, scratch_.ConcatColorful(Color::Green, {"[#", channel, "] ", connection.nickname.View(), " has joined the channel."}), FRAME_FLAG_NOTICE);
+}
+
+void Server::HandleChannelLeave(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    std::string channel(frame.payload);
+    Connection& connection = *connections_.Find(sender_socketfd);
+    uint32_t channel_id = channels_.Find(channel);
+    if (channel_id == ChannelTable::NO_CHANNEL || !channels_.Leave(channel_id, sender_socketfd)){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] You are not in #", channel, "."}), FRAME_FLAG_NOTICE);
+        return;
+    }
+    connection.channels.erase(std::find(connection.channels.begin(), connection.channels.end(), channel_id));
+    metrics_.channel_memberships.Add(-1);
+    QueueFrame(sender_socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Pink, {"[#", channel, "] You have left the channel."}), FRAME_FLAG_NOTICE);
+    ChannelMessage(channel, scratch_.ConcatColorful(Color::Pink, {"[#", channel, "] ", connection.nickname.View(), " has left the channel."}), FRAME_FLAG_NOTICE);
+}
+
+void Server::HandleChannelMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    size_t delimiter_pos = frame.payload.find('\02');
+    if (delimiter_pos == std::string_view::npos || delimiter_pos == 0 || delimiter_pos + 1 == frame.payload.size()){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, MakeColorfulText("[SERVER] Usage: /cm <channel> <message>"s, Color::Red), FRAME_FLAG_NOTICE);
+        return;
+    }
+    std::string channel(frame.payload.substr(0, delimiter_pos));
+    const Connection& connection = *connections_.Find(sender_socketfd);
+    uint32_t channel_id = channels_.Find(channel);
+    if (channel_id == ChannelTable::NO_CHANNEL || std::find(connection.channels.begin(), connection.channels.end(), channel_id) == connection.channels.end()){
+        QueueFrame(sender_socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] You are not in #", channel, ". Use /join ", channel, " first."}), FRAME_FLAG_NOTICE);
+        return;
+    }
+    ChannelMessage(channel, scratch_.Concat({"[#", channel, "] [", connection.nickname.View(), "] ", frame.payload.substr(delimiter_pos + 1)}));
+}
+
+void Server::HandleHeartbeatPing(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    QueueFrame(sender_socketfd, Opcode::HEARTB_PONG);
+}
+
+void Server::HandleHeartbeatPong(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+}
+
+void Server::HandleUnknownCommand(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage){
+    // an unknown key signal or opcode, or a server-side one
+    std::string_view key_signal = frame.opcode == Opcode::UNKNOWN ? frame.payload.substr(0, KEY_SIGNAL_LENGTH) : OpcodeKeySignal(frame.opcode);
+    std::string command_name(key_signal.empty() ? "#"s + std::to_string(static_cast<int>(frame.opcode)) : std::string(key_signal));
+    QueueFrame(sender_socketfd, Opcode::MESSAGE, "Unknown command: "s + command_name, FRAME_FLAG_NOTICE);
+}
+
+std::string Server::LocalUsersList() const{
+    std::string entries;
+    for (const Connection& connection : connections_){
+        if (!connection.established){
+            continue;
+        }
+        if (!entries.empty()){
+            entries.push_back('\02');
         }
+        entries.append(connection.nickname.View()).append(" "s).append(connection.address.ToString());
     }
-    else{
-        // std::cerr << "ProcessMessage(): this is not a command."s << std::endl;
-        if (sock_to_user_.count(sender_socketfd)){ // if the message is from connected client
-            std::string sender_name = sock_to_user_.at(sender_socketfd).nickname;
-            std::string final_msg;
-            final_msg.append("["s).append(std::move(sender_name)).append("] "s).append(std::move(msg_str));
-            BroadcastMessage(std::move(final_msg));
+    return entries;
+}
+
+void Server::SendUsersList(int socketfd, const std::string& entries){
+    std::string users_list;
+    users_list.reserve(entries.size() + 64);
+    size_t entry_number = 0, entry_begin = 0;
+    while (entry_begin < entries.size()){
+        size_t entry_end = entries.find('\02', entry_begin);
+        if (entry_end == entries.npos){
+            entry_end = entries.size();
         }
-        else{ // it is a message from an unconnected client -> protocol violation (possible DDOS)
-            std::cerr << MakeColorfulText("client ("s + conn_inf.ip_address + ":"s + std::to_string(conn_inf.port) + ") failed to connect: message protocol violation. (msg: "s + std::string(readable_buffer) + ")."s, Color::Pink) << '\n';
-            close(sender_socketfd); 
+        if (entry_number > 0){
+            users_list.push_back('\02');
         }
+        users_list.append(std::to_string(++entry_number)).append(". "s).append(entries, entry_begin, entry_end - entry_begin);
+        entry_begin = entry_end + 1;
     }
-    return 0;
+    QueueFrame(socketfd, Opcode::MESSAGE, users_list, FRAME_FLAG_NOTICE);
 }
 
-void Server::EstablishConnection(std::vector<pollfd>& pending_connections_vec, sockaddr_storage* addr_storage, socklen_t* addr_len_ptr){
-    int new_conn_socketfd = AcceptNewConnection(addr_storage, addr_len_ptr);
-    ConnectionInfo new_conn_info = GetConnectionInfoFromSocket(new_conn_socketfd);
-    std::cerr << "[Connection] "s << new_conn_info.ToString() << " is trying to connect.\n"s;
+bool Server::DeliverPrivateMessage(const std::string& recipient, const std::string& sender, std::string_view message){
+    auto recipient_it = nick_to_sock_.find(recipient);
+    if (recipient_it == nick_to_sock_.end()){
+        return false;
+    }
+    QueueFrame(recipient_it->second, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Yellow, {"[PM] from ", sender, ": ", message}));
+    return true;
+}
 
-    if (new_conn_socketfd == -1){
-        DeletePendingConnection(new_conn_info, new_conn_socketfd, strerror(errno));
+void Server::ReportPrivateMessage(int socketfd, uint32_t generation, const std::string& recipient, std::string_view message, PrivateMessageOutcome outcome){
+    if (connections_.Find(socketfd, generation) == nullptr){ // the sender has left meanwhile
+        return;
     }
-    
-    // Begin the handshake
-    if (SendMessage(new_conn_socketfd, "\07NICK_PROMPT") != 0){
-        DeletePendingConnection(new_conn_info, new_conn_socketfd, strerror(errno));
+    switch (outcome){
+        case PrivateMessageOutcome::DELIVERED:
+            QueueFrame(socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Yellow, {"[PM] to ", recipient, ": ", message}));
+            break;
+        case PrivateMessageOutcome::STORED:
+            QueueFrame(socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Yellow, {"[PM] to ", recipient, " (offline, delivered when they connect): ", message}));
+            break;
+        case PrivateMessageOutcome::NOT_FOUND:
+            QueueFrame(socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] User \"", recipient, "\" is not found."}), FRAME_FLAG_NOTICE);
+            break;
+        case PrivateMessageOutcome::MAILBOX_FULL:
+            QueueFrame(socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] User \"", recipient, "\" is offline and can't receive more messages."}), FRAME_FLAG_NOTICE);
+            break;
     }
+}
 
-    pollfd conn_pollfd;
-    conn_pollfd.fd = new_conn_socketfd;
-    conn_pollfd.events = POLLIN | POLLOUT; // get notified when the socket is readable or writable
-    pending_connections_vec.push_back(std::move(conn_pollfd));
+void Server::RoutePrivateMessage(ShardMessage&& message){
+    auto location_it = taken_nicknames_.find(message.nickname);
+    if (location_it == taken_nicknames_.end() || location_it->second == shard_id_){ // not taken, or not connected here anymore
+        PrivateMessageOutcome outcome = StoreOfflineMessage(message.nickname, message.sender_nickname, message.text);
+        AnswerPrivateMessage(std::move(message), outcome);
+        return;
+    }
+    hub_->Post(location_it->second, std::move(message));
 }
 
-void Server::HandlePendingConnections(std::vector<pollfd>& pending_connections_vec, char* read_buffer){
-    // std::cerr << "HandlePendingConnections call" << std::endl;
-    memset(read_buffer, 0, sizeof(*read_buffer));
-    int poll_count = poll(pending_connections_vec.data(), pending_connections_vec.size(), 200); // 200 miliseconds wait.
-    if (poll_count == 0){
+void Server::AnswerPrivateMessage(ShardMessage&& message, PrivateMessageOutcome outcome){
+    if (message.origin_shard == shard_id_){
+        ReportPrivateMessage(message.socket_fd, message.generation, message.nickname, message.text, outcome);
         return;
     }
-    else if (poll_count == -1){
-        throw std::runtime_error("Failed to extract pending connections: poll(): "s + std::string(strerror(errno)));
+    size_t origin_shard = message.origin_shard;
+    message.type = ShardMessageType::PRIVATE_MESSAGE_RESULT;
+    message.private_message_outcome = outcome;
+    hub_->Post(origin_shard, std::move(message));
+}
+
+PrivateMessageOutcome Server::StoreOfflineMessage(const std::string& recipient, const std::string& sender, std::string_view message){
+    if (!offline_mailboxes_.Enabled() || __ValidateNickname__(recipient) != NicknameAction::NICK_ACCEPT){ // nobody could ever read it
+        return PrivateMessageOutcome::NOT_FOUND;
     }
-    
-    static std::vector<DisconnectedClient> failed_clients;
-    failed_clients.reserve(sock_to_user_.size());
+    std::string_view letter = scratch_.ConcatColorful(Color::Yellow, {"[PM] from ", sender, " (while you were offline): ", message});
+    return offline_mailboxes_.Deposit(recipient, letter) ? PrivateMessageOutcome::STORED : PrivateMessageOutcome::MAILBOX_FULL;
+}
 
-    static std::vector<pollfd> new_connected_clients;
-    new_connected_clients.reserve(sock_to_user_.size());
-    for (size_t i = 0; i < pending_connections_vec.size(); ++i){
-        memset(read_buffer, 0, sizeof(*read_buffer));
-        pollfd& poll_obj = pending_connections_vec[i];
-        if (poll_obj.revents & POLLIN){ // a client is sending us something
-            if (ReceiveMessage(poll_obj.fd, read_buffer) == 0){
-                failed_clients.push_back(DisconnectedClient{.socket_fd = poll_obj.fd, .disconnect_reason = "client disconnect."s});
-            }
-            if (ProcessMessage(poll_obj.fd, read_buffer, failed_clients) == 0){ // if connection has been successful
-                ConnectionInfo conn_info = GetConnectionInfoFromSocket(poll_obj.fd);
-                new_connected_clients.push_back(poll_obj);
-            } else{
-                failed_clients.push_back(DisconnectedClient{.socket_fd = poll_obj.fd, .disconnect_reason = "client failed to connect: "s + std::string(strerror(errno))});
+void Server::DeliverMailbox(int socketfd, const std::vector<std::string>& mailbox){
+    if (mailbox.empty()){
+        return;
+    }
+    QueueFrame(socketfd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Yellow, {"[SERVER] ", std::to_string(mailbox.size()), " private message(s) have arrived while you were offline:"}), FRAME_FLAG_NOTICE);
+    for (const std::string& letter : mailbox){
+        QueueFrame(socketfd, Opcode::MESSAGE, letter);
+    }
+}
+
+void Server::OnAccept(int new_conn_socketfd, sockaddr_storage* conn_address){
+    PeerAddress new_conn_address = conn_address != nullptr ? MakePeerAddress(conn_address) : GetPeerAddressFromSocket(new_conn_socketfd);
+    if (!AdmitConnection(new_conn_socketfd, new_conn_address)){
+        return;
+    }
+    char address[PEER_ADDRESS_STRLEN];
+    LOGGER.Log(LogLevel::INFO, {"[Connection] ", new_conn_address.Format(address), " is trying to connect."});
+
+    if (io_backend_->AddClient(new_conn_socketfd) == -1){
+        DeletePendingConnection(new_conn_address, new_conn_socketfd, strerror(errno));
+        metrics_.connections_failed.Add();
+        return;
+    }
+    Connection& connection = connections_.Insert(new_conn_socketfd);
+    connection.address = new_conn_address;
+    metrics_.connections_accepted.Add();
+    CountPendingHandshake(1);
+    connection.last_received_tick = connection.last_activity_tick = timers_.Now();
+    connection.flood.Fill(message_budgets_, byte_budget_, timers_.Now());
+    connection.timer = timers_.Arm(timers_.Now() + TimerWheel::TicksFromMs(config_.handshake_timeout_ms), __TimerData__(connection));
+
+    // Begin the handshake (always in v1: the client may ask for an upgrade in its answer)
+    QueueFrame(new_conn_socketfd, Opcode::NICK_PROMPT);
+}
+
+bool Server::AdmitConnection(int socketfd, const PeerAddress& conn_address){
+    RejectReason reject_reason;
+    if (PendingHandshakesCount() >= config_.max_pending_handshakes){
+        reject_reason = RejectReason::PENDING_FULL;
+    } else if (!connect_limiter_.TryAcquire(conn_address, std::chrono::steady_clock::now())){
+        reject_reason = RejectReason::RATE_LIMITED;
+    } else{
+        return true;
+    }
+    linger reset_on_close{.l_onoff = 1, .l_linger = 0};
+    setsockopt(socketfd, SOL_SOCKET, SO_LINGER, &reset_on_close, sizeof(reset_on_close));
+    close(socketfd);
+    metrics_.connections_rejected[static_cast<size_t>(reject_reason)].Add();
+    char address[PEER_ADDRESS_STRLEN];
+    LOGGER.Log(LogLevel::DEBUG, {"[Admission] ", conn_address.Format(address), " has been rejected: ", reject_reason_labels[static_cast<size_t>(reject_reason)]});
+    return false;
+}
+
+void Server::CountPendingHandshake(int delta) noexcept{
+    pending_handshakes_n_ += delta;
+    metrics_.pending_handshakes.Add(delta);
+    if (hub_ != nullptr){
+        hub_->pending_handshakes_n += delta;
+    }
+}
+
+size_t Server::PendingHandshakesCount() const noexcept{
+    return hub_ != nullptr ? hub_->pending_handshakes_n.load() : pending_handshakes_n_;
+}
+
+void Server::OnConnectionTimer(TimerWheel::TimerId timer, uint64_t data, std::vector<DisconnectedClient>& disconnected_storage){
+    int socketfd = static_cast<int>(data & UINT32_MAX);
+    Connection* connection = connections_.Find(socketfd, static_cast<uint32_t>(data >> 32));
+    if (connection == nullptr){ // can't be: DisconnectClient() cancels the timer
+        timers_.Cancel(timer);
+        return;
+    }
+    if (!connection->established){
+        disconnected_storage.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::HANDSHAKE_TIMEOUT, .disconnect_reason = "handshake timeout: no nickname has been accepted in time."s});
+        return;
+    }
+    uint64_t now = timers_.Now();
+    uint64_t idle_ticks = TimerWheel::TicksFromMs(config_.idle_timeout_ms);
+    if (idle_ticks > 0 && now - connection->last_activity_tick >= idle_ticks){
+        disconnected_storage.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::IDLE_TIMEOUT, .disconnect_reason = "idle for too long."s});
+        return;
+    }
+    if (config_.heartbeat_interval_ms > 0 && connection->protocol_version == ProtocolVersion::V2){
+        uint64_t silent_ticks = now - connection->last_received_tick;
+        uint64_t interval_ticks = TimerWheel::TicksFromMs(config_.heartbeat_interval_ms);
+        if (connection->ping_sent && silent_ticks >= interval_ticks + TimerWheel::TicksFromMs(config_.heartbeat_timeout_ms)){
+            disconnected_storage.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::HEARTBEAT_TIMEOUT, .disconnect_reason = "heartbeat timeout: the client hasn't answered."s});
+            return;
+        }
+        if (!connection->ping_sent && silent_ticks >= interval_ticks){
+            QueueFrame(socketfd, Opcode::HEARTB_PING);
+            connection->ping_sent = true;
+        }
+    }
+    ScheduleConnectionTimer(*connection);
+}
+
+void Server::ScheduleConnectionTimer(Connection& connection){
+    uint64_t deadline = UINT64_MAX;
+    if (config_.idle_timeout_ms > 0){
+        deadline = connection.last_activity_tick + TimerWheel::TicksFromMs(config_.idle_timeout_ms);
+    }
+    if (config_.heartbeat_interval_ms > 0 && connection.protocol_version == ProtocolVersion::V2){ // v1 clients can't answer a ping
+        uint64_t heartbeat_deadline = connection.last_received_tick + TimerWheel::TicksFromMs(config_.heartbeat_interval_ms);
+        if (connection.ping_sent){
+            heartbeat_deadline += TimerWheel::TicksFromMs(config_.heartbeat_timeout_ms);
+        }
+        deadline = std::min(deadline, heartbeat_deadline);
+    }
+    if (deadline == UINT64_MAX){
+        if (connection.timer != TimerWheel::NO_TIMER){
+            timers_.Cancel(connection.timer);
+            connection.timer = TimerWheel::NO_TIMER;
+        }
+        return;
+    }
+    if (connection.timer == TimerWheel::NO_TIMER){
+        connection.timer = timers_.Arm(deadline, __TimerData__(connection));
+    } else{
+        timers_.Rearm(connection.timer, deadline);
+    }
+}
+
+bool Server::OnData(int socketfd, const char* data, size_t data_length){
+    Connection* connection = connections_.Find(socketfd);
+    if (connection == nullptr){ // stale event of an already disconnected socket
+        return false;
+    }
+    connection->inbound.Feed(data, data_length);
+    connection->last_received_tick = timers_.Now(); // any traffic proves the peer is alive
+    connection->ping_sent = false;
+    metrics_.bytes_in.Add(data_length);
+    if (connection->flood.throttled){ // bytes the backend had received before the pause: they wait for the resume
+        connection->inbound.Retain();
+        return false;
+    }
+    return ProcessInbound(socketfd);
+}
+
+bool Server::ProcessInbound(int socketfd){
+    Connection* connection = connections_.Find(socketfd);
+    Frame frame;
+    int decode_status;
+    while ((decode_status = connection->inbound.NextFrame(frame)) == 1){
+        metrics_.messages_in.Add();
+        if (frame.opcode != Opcode::HEARTB_PONG){
+            connection->last_activity_tick = timers_.Now();
+        }
+        MessageClass message_class = command_table_[static_cast<uint8_t>(frame.opcode)].message_class;
+        FloodVerdict verdict = ChargeFrame(*connection, message_class, frame.payload.size());
+        if (verdict == FloodVerdict::DISCONNECT){
+            disconnecting_clients_.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::FLOODING, .disconnect_reason = "flooding."s});
+            return false;
+        }
+        if (message_class != MessageClass::CHAT || connection->flood.muted_until_tick <= timers_.Now()){ // a muted client's chat is dropped
+            ProcessMessage(socketfd, frame, disconnecting_clients_);
+            // the message could have caused the disconnection of its own sender (and moved connections around the table)
+            if ((connection = connections_.Find(socketfd)) == nullptr){
+                return false;
             }
         }
+        if (verdict == FloodVerdict::THROTTLE){ // the rest of the frames wait until the budgets refill
+            ThrottleClient(*connection);
+            return false;
+        }
+    }
+    if (decode_status == -1){
+        disconnecting_clients_.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::PROTOCOL_VIOLATION, .disconnect_reason = "message protocol violation: malformed packet header."s});
+        return false;
     }
+    return true;
+}
 
-    // Removing successfully connected clients from pending connections list
-    for (pollfd& poll_obj : new_connected_clients){
-        ConnectionInfo conn_info = GetConnectionInfoFromSocket(poll_obj.fd);
-        pending_connections_vec.erase(std::find_if(pending_connections_vec.begin(), pending_connections_vec.end(), [&poll_obj](const pollfd& poll_obj2){
-            return poll_obj.fd == poll_obj2.fd;
-        }));
+Server::FloodVerdict Server::ChargeFrame(Connection& connection, MessageClass message_class, size_t payload_bytes){
+    FloodState& flood = connection.flood;
+    uint64_t now = timers_.Now();
+    size_t class_index = static_cast<size_t>(message_class);
+    bool within_budget = flood.message_buckets[class_index].Take(message_budgets_[class_index], now, FLOOD_TOKEN_UNIT);
+    within_budget &= flood.byte_bucket.Take(byte_budget_, now, static_cast<int64_t>(payload_bytes) * FLOOD_TOKEN_UNIT);
+    if (within_budget){
+        return FloodVerdict::ALLOW;
     }
 
-    DisconnectClient(failed_clients);
-    failed_clients.clear();
-    new_connected_clients.clear();
+    // A client that overdraws right after being resumed is sending faster than its budgets all along.
+    if (now - flood.resumed_at_tick > TimerWheel::TicksFromMs(FLOOD_PRESSURE_GAP_MS)){
+        flood.pressure_since_tick = now;
+    }
+    uint64_t pressure_ticks = now - flood.pressure_since_tick;
+    if (pressure_ticks >= TimerWheel::TicksFromMs(FLOOD_DISCONNECT_AFTER_MS)){
+        return FloodVerdict::DISCONNECT;
+    }
+    if (pressure_ticks >= TimerWheel::TicksFromMs(FLOOD_MUTE_AFTER_MS) && flood.muted_until_tick <= now && config_.flood_mute_ms > 0){
+        flood.muted_until_tick = now + TimerWheel::TicksFromMs(config_.flood_mute_ms);
+        metrics_.clients_muted.Add();
+        QueueFrame(connection.socket_fd, Opcode::MESSAGE, scratch_.ConcatColorful(Color::Red, {"[SERVER] You are sending too fast and have been muted for ", std::to_string(config_.flood_mute_ms / 1000), " s."}), FRAME_FLAG_NOTICE);
+        LOGGER.LogColorful(LogLevel::WARN, Color::Yellow, {"[Flood] ", connection.address.ToString(), " has been muted."});
+    }
+    return FloodVerdict::THROTTLE;
 }
 
-int Server::AcceptNewConnection(sockaddr_storage* addr_storage, socklen_t* addr_len_ptr){
-    int new_conn_socketfd = accept(server_socket_, reinterpret_cast<sockaddr*>(addr_storage), addr_len_ptr);
-    if (new_conn_socketfd == -1){
-        throw std::runtime_error("Failed to accept new connection: accept(): "s + std::string(strerror(errno)));
+void Server::ThrottleClient(Connection& connection){
+    connection.inbound.Retain(); // the fed chunk belongs to the backend
+    if (connection.flood.throttled){
+        return;
     }
-    return new_conn_socketfd;
+    connection.flood.throttled = true;
+    io_backend_->PauseReading(connection.socket_fd);
+    throttled_clients_.push_back(connection.socket_fd);
+    metrics_.clients_throttled.Add();
 }
 
-void Server::Start(){
-    std::cerr << MakeColorfulText("[ServStart] Starting the server..."s, Color::Yellow) << '\n';
+void Server::ResumeThrottledClients(){
+    if (throttled_clients_.empty()){
+        return;
+    }
+    uint64_t now = timers_.Now();
+    resuming_clients_.swap(throttled_clients_); // resumed clients may be throttled again right away
+    for (int socketfd : resuming_clients_){
+        Connection* connection = connections_.Find(socketfd);
+        if (connection == nullptr || !connection->flood.throttled){
+            continue;
+        }
+        if (!connection->flood.Refill(message_budgets_, byte_budget_, now)){ // still in debt
+            throttled_clients_.push_back(socketfd);
+            continue;
+        }
+        connection->flood.throttled = false;
+        connection->flood.resumed_at_tick = now;
+        io_backend_->ResumeReading(socketfd);
+        ProcessInbound(socketfd);
+    }
+    resuming_clients_.clear();
+}
 
-    signal(SIGINT, InterruptHandler);
+void Server::OnPeerClosed(int socketfd, int error_code){
+    if (connections_.Find(socketfd) == nullptr){
+        return;
+    }
+    if (error_code == 0){
+        disconnecting_clients_.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::CLIENT_QUIT, .disconnect_reason = "Client disconnect."s});
+    } else{
+        disconnecting_clients_.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::SOCKET_ERROR, .disconnect_reason = "socket error: "s + std::string(strerror(error_code))});
+    }
+}
 
-    __SetUpListenner__();
+void Server::OnWritable(int socketfd, size_t sent_bytes){
+    Connection* connection = connections_.Find(socketfd);
+    if (connection == nullptr){
+        return;
+    }
+    connection->outbound.Consume(sent_bytes);
+    metrics_.bytes_out.Add(sent_bytes);
+    FlushConnection(socketfd, disconnecting_clients_);
+}
 
-    std::cerr << MakeColorfulText("[ServStart] Server is up! (accepting connections on "s + hostname_ + ":"s + port_ + ")"s, Color::Green) << '\n';
+void Server::OnWakeup(){
+    if (hub_ == nullptr){
+        return;
+    }
+    hub_->Mailbox(shard_id_).Drain([this](ShardMessage&& message){
+        HandleShardMessage(std::move(message));
+    });
+}
 
-    char read_buffer[1028]; // +4 bytes for message header (msg_len)
-    sockaddr_storage new_connection_addr;
-    socklen_t new_conn_addrlen;
+void Server::Start(){
+    LOGGER.LogColorful(LogLevel::INFO, Color::Yellow, {"[ServStart] Starting the server..."});
 
-    int poll_count;
-    const auto check_poll_count_error = [&poll_count](){
-        if (poll_count == -1){
-            std::string error_msg("Listen for connections failed: poll(): "s + std::string(strerror(errno)));
-            throw std::runtime_error(MakeColorfulText(std::move(error_msg), Color::Red));
-        }
-    };
-    static std::vector<DisconnectedClient> disconnecting_clients; // stores clients who want to disconnect (invalidation of iterators in the for-range)
-    std::vector<pollfd> pending_connections;
-    disconnecting_clients.reserve(30);
-    pending_connections.reserve(30);
-    while (EXIT_SIGNAL == 0){
-        memset(&read_buffer, 0, sizeof(read_buffer));
-        DisconnectClient(disconnecting_clients);
+    signal(SIGINT, InterruptHandler);
 
-        // check pending connections
-        poll_count = poll(pending_connections.data(), pending_connections.size(), 200);
-        check_poll_count_error();
+    __SetUpListenner__();
 
-        HandlePendingConnections(pending_connections, read_buffer);
+    LOGGER.LogColorful(LogLevel::INFO, Color::Green, {"[ServStart] Server is up! (accepting connections on ", hostname_, ":", port_, ", I/O backend: ", io_backend_->Name(), ")"});
 
-        // check for regular data
-        poll_count = poll(poll_objects_.data(), poll_objects_.size(), 200);
-        check_poll_count_error();
+    disconnecting_clients_.reserve(30);
+    while (EXIT_SIGNAL == 0){
+        DisconnectClient(disconnecting_clients_);
+        scratch_.Reset(); // nothing formatted during the previous tick is referenced anymore
 
-        // run through active connections to see if there is data to read
-        for (const pollfd& poll_obj : poll_objects_){
-            // check if the socket is ready to be read
-            if (poll_obj.fd == server_socket_){
+        // One wait per tick covers the listenner, the shard mailbox, pending handshakes and established clients.
+        if (io_backend_->Wait(*this, WaitTimeout()) == -1){
+            if (errno == EINTR){
+                continue;
             }
-            if (poll_obj.revents & POLLIN){ 
-                if (poll_obj.fd == server_socket_){ // serv_socket ready-to-be-read = new connection data
+            std::string error_msg("Event loop failed: "s + std::string(io_backend_->Name()) + ": "s + std::string(strerror(errno)));
+            throw std::runtime_error(MakeColorfulText(std::move(error_msg), Color::Red));
+        }
 
-                    EstablishConnection(pending_connections, &new_connection_addr, &new_conn_addrlen);
-                }
-                else{ // regular client's message
-                    int recv_msg_code;
-                    if ((recv_msg_code = ReceiveMessage(poll_obj.fd, read_buffer)) == 0){ // client disconnected
-                        std::cerr << "Client is disonnecting: "s << GetConnectionInfoFromSocket(poll_obj.fd).ToString() << std::endl;
-                        disconnecting_clients.push_back(DisconnectedClient{.socket_fd = poll_obj.fd, .disconnect_reason = "Client disconnect."s});
-                        continue;
-                    } else if (recv_msg_code == -1){
-                        throw std::runtime_error("Failed to receive message from client "s + GetConnectionInfoFromSocket(poll_obj.fd).ToString());
-                    }
-                    if (ProcessMessage(poll_obj.fd, read_buffer, disconnecting_clients) == -1){
-                        std::cerr << MakeColorfulText("[Error] Error with pending connection."s, Color::Red) << std::endl;
-                    }
-                    memset(&read_buffer, 0, sizeof(read_buffer));
-                }
-            }
+        // Timers that are due fire before the flush, so the pings they queue leave in this tick.
+        timers_.Advance(std::chrono::steady_clock::now(), [this](TimerWheel::TimerId timer, uint64_t data){
+            OnConnectionTimer(timer, data, disconnecting_clients_);
+        });
+        ResumeThrottledClients();
+        if (!presence_.Empty() && timers_.Now() >= presence_due_tick_){
+            FlushPresence();
         }
+
+        // Everything queued during this tick is written out (or submitted) in one pass per socket.
+        FlushPendingWrites(disconnecting_clients_);
+        EvictSlowConsumers(disconnecting_clients_);
     }
 
     ShutDown();
 }
 
+int Server::WaitTimeout() const noexcept{
+    int timeout_ms = EVENT_WAIT_TIMEOUT;
+    if (!throttled_clients_.empty()){ // checked every timer tick, so that they resume as soon as their budgets refill
+        timeout_ms = TIMER_WHEEL_TICK_MS;
+    }
+    if (!presence_.Empty()){
+        uint64_t now = timers_.Now();
+        int presence_ms = presence_due_tick_ > now ? static_cast<int>((presence_due_tick_ - now) * TIMER_WHEEL_TICK_MS) : 0;
+        timeout_ms = std::min(timeout_ms, presence_ms);
+    }
+    return timeout_ms;
+}
+
 void Server::ShutDown() noexcept{
-    std::cerr << MakeColorfulText("[ServerShutdown] Shutting down..."s, Color::Pink) << '\n';
-    for (const auto& [socketfd, user] : sock_to_user_){
-        close(socketfd);
+    LOGGER.LogColorful(LogLevel::INFO, Color::Pink, {"[ServerShutdown] Shutting down..."});
+    for (const Connection& connection : connections_){
+        close(connection.socket_fd);
     }
-    close(server_socket_);
-    std::cerr << MakeColorfulText("[ServerShutdown] Bye!"s, Color::Pink) << '\n';
+    nick_to_sock_.clear();
+    connections_.Clear();
+    channels_.Clear();
+    history_.Clear();
+    connect_limiter_.Clear();
+    throttled_clients_.clear();
+    presence_.Clear();
+    offline_mailboxes_.Clear();
+    timers_.Clear();
+    taken_nicknames_.clear();
+    io_backend_.reset();
+    if (server_socket_ != -1){
+        close(server_socket_);
+        server_socket_ = -1;
+    }
+    LOGGER.LogColorful(LogLevel::INFO, Color::Pink, {"[ServerShutdown] Bye!"});
 }
 
 Server::~Server(){
@@ -277,19 +682,28 @@ Server::~Server(){
 
 void Server::__SetUpListenner__(){
     // Set up the listenner socket
-    if (listen(server_socket_, BACKLOG) == -1){
+    if (listen(server_socket_, config_.listen_backlog) == -1){
         throw std::runtime_error("listen(): "s + std::string(strerror(errno)));
     }
 
-    // Add the initial poll object - server socket
-    pollfd listenner_pollobj;
-    listenner_pollobj.fd = server_socket_;
-    listenner_pollobj.events = POLLIN;
-
-    poll_objects_.push_back(std::move(listenner_pollobj));
+    int wakeup_fd = hub_ != nullptr ? hub_->Mailbox(shard_id_).EventFd() : -1;
+    if (config_.io_backend == "io_uring"s){
+        try{
+            io_backend_ = std::make_unique<UringBackend>();
+            io_backend_->Init(server_socket_, wakeup_fd);
+            return;
+        } catch(std::runtime_error& err){
+            LOGGER.LogColorful(LogLevel::WARN, Color::Yellow, {"[ServStart] io_uring is unavailable (", err.what(), "), falling back to epoll."});
+        }
+    }
+    io_backend_ = std::make_unique<EpollBackend>();
+    io_backend_->Init(server_socket_, wakeup_fd);
 }
 
-NicknameAction Server::__ValidateNickname__(std::string& nickname) noexcept{
+NicknameAction Server::__ValidateNickname__(std::string_view nickname) noexcept{
+    if (nickname.empty() || nickname.size() > NICKNAME_MAX_LENGTH){
+        return NicknameAction::NICK_INVALD;
+    }
     int char_ascii_code;
     for (const char c : nickname){
         char_ascii_code = static_cast<int>(c);
@@ -297,101 +711,391 @@ NicknameAction Server::__ValidateNickname__(std::string& nickname) noexcept{
             return NicknameAction::NICK_INVALD;
         }
     }
-    std::cerr << MakeColorfulText("Validating nickname: \""s + nickname + "\"", Color::Cyan) << '\n';
-    if (taken_nicknames_.count(nickname)){
-        return NicknameAction::NICK_STAKEN;
-    }
+    LOGGER.LogColorful(LogLevel::DEBUG, Color::Cyan, {"Validating nickname: \"", nickname, "\""});
     return NicknameAction::NICK_ACCEPT;
 }
 
-void Server::BroadcastMessage(std::string&& message){
-    std::vector<DisconnectedClient> errored_clients;
-    errored_clients.reserve(poll_objects_.size());
-    for (const pollfd& poll_obj_ : poll_objects_){
-        if (poll_obj_.fd == server_socket_){
-            std::cout << message << '\n';
+bool Server::__ValidateChannelName__(std::string_view channel) noexcept{
+    if (channel.empty() || channel.size() > CHANNEL_NAME_MAX_LENGTH){
+        return false;
+    }
+    for (const char c : channel){
+        if (c < 33 || c > 126){ // printable ASCII without the space
+            return false;
         }
-        if (poll_obj_.revents & POLLOUT){
-            if (SendMessage(poll_obj_.fd, message) == -1){
-                errored_clients.push_back(DisconnectedClient{.socket_fd = poll_obj_.fd, .disconnect_reason = "message delivery failed: "s + std::string(strerror(errno))});
-            }
+    }
+    return true;
+}
+
+void Server::ClaimNickname(int socketfd, std::string&& nickname){
+    Connection& connection = *connections_.Find(socketfd);
+    if (hub_ == nullptr || hub_->NicknameOwner(nickname) == shard_id_){
+        bool is_free = taken_nicknames_.emplace(nickname, shard_id_).second;
+        CompleteNicknameClaim(socketfd, connection.generation, nickname, is_free ? NicknameAction::NICK_ACCEPT : NicknameAction::NICK_STAKEN,
+                              is_free ? offline_mailboxes_.Collect(nickname) : std::vector<std::string>());
+        return;
+    }
+    connection.nick_claim_in_flight = true;
+    size_t owner = hub_->NicknameOwner(nickname); // before the nickname is moved into the message
+    hub_->Post(owner, ShardMessage{.type = ShardMessageType::NICK_CLAIM, .origin_shard = shard_id_, .socket_fd = socketfd,
+                                   .generation = connection.generation, .nickname = std::move(nickname)});
+}
+
+void Server::CompleteNicknameClaim(int socketfd, uint32_t generation, const std::string& nickname, NicknameAction nick_action,
+                                   std::vector<std::string>&& mailbox){
+    Connection* connection = connections_.Find(socketfd, generation);
+    if (connection == nullptr){ // the client has left meanwhile
+        if (nick_action == NicknameAction::NICK_ACCEPT){
+            ReleaseNickname(nickname, std::move(mailbox));
         }
+        return;
     }
-    DisconnectClient(std::move(errored_clients));
+    connection->nick_claim_in_flight = false;
+    if (nick_action != NicknameAction::NICK_ACCEPT){
+        QueueFrame(socketfd, NicknameActionOpcode(nick_action));
+        return;
+    }
+
+    QueueFrame(socketfd, Opcode::NICK_ACCEPT);
+    if (connection->established){ // ACT_NICKCNG of a connected user
+        ChangeNickname(socketfd, nickname);
+        DeliverMailbox(socketfd, mailbox);
+        return;
+    }
+
+    ReplayHistory(*connection); // before the notice of the user's own arrival
+    connection->established = true;
+    ScheduleConnectionTimer(*connection); // the handshake deadline is replaced by the heartbeat and idle ones
+    connection->nickname.Assign(nickname);
+    CountPendingHandshake(-1);
+    metrics_.users_connected.Add(1);
+    nick_to_sock_[nickname] = socketfd;
+    if (hub_ != nullptr){
+        ++hub_->connected_users_n;
+    }
+    char address[PEER_ADDRESS_STRLEN];
+    AnnouncePresence(true, nickname, scratch_.ConcatColorful(Color::Green, {"[Connection] ", nickname, " ", connection->address.Format(address), " has connected."}));
+    QueueFrame(socketfd, Opcode::MESSAGE, "Welcome to the server! Currently active users: "s + std::to_string(ConnectedUsersCount()), FRAME_FLAG_NOTICE);
+    DeliverMailbox(socketfd, mailbox);
 }
 
-void Server::DisconnectClient(DisconnectedClient&& disconn_info) noexcept{
-    if (sock_to_user_.count(disconn_info.socket_fd)){ // if the client is connected.
-        User disc_client = sock_to_user_.at(disconn_info.socket_fd);
-
-        sock_to_user_.erase(disconn_info.socket_fd);
-        taken_nicknames_.erase(disc_client.nickname);
-        for (size_t i = 0; i < poll_objects_.size(); ++i){
-            if (poll_objects_[i].fd == disconn_info.socket_fd){
-                poll_objects_.erase(poll_objects_.begin() + i);
+void Server::ChangeNickname(int socketfd, const std::string& nickname){
+    Connection& connection = *connections_.Find(socketfd);
+    std::string old_nickname = connection.nickname.ToString();
+    connection.nickname.Assign(nickname);
+    nick_to_sock_.erase(old_nickname);
+    nick_to_sock_[nickname] = socketfd;
+    ReleaseNickname(old_nickname);
+    BroadcastMessage(scratch_.ConcatColorful(Color::Cyan, {"[Nickname] ", old_nickname, " is now known as ", nickname, "."}), FRAME_FLAG_NOTICE);
+}
+
+void Server::ReleaseNickname(const std::string& nickname, std::vector<std::string>&& unread){
+    if (hub_ == nullptr || hub_->NicknameOwner(nickname) == shard_id_){
+        taken_nicknames_.erase(nickname);
+        offline_mailboxes_.Restore(nickname, std::move(unread));
+        return;
+    }
+    hub_->Post(hub_->NicknameOwner(nickname), ShardMessage{.type = ShardMessageType::NICK_RELEASE, .origin_shard = shard_id_, .nickname = nickname,
+                                                           .mailbox = std::move(unread)});
+}
+
+void Server::HandleShardMessage(ShardMessage&& message){
+    switch (message.type){
+        case ShardMessageType::BROADCAST:
+            FanoutPacket(message.packets, message.frame_flags);
+            break;
+        case ShardMessageType::NICK_CLAIM: // we are the owner of the nickname
+        {
+            bool is_free = taken_nicknames_.emplace(message.nickname, message.origin_shard).second;
+            if (is_free){ // the messages that have waited for the nickname go to its new user
+                message.mailbox = offline_mailboxes_.Collect(message.nickname);
+            }
+            size_t origin_shard = message.origin_shard;
+            message.type = ShardMessageType::NICK_CLAIM_RESULT;
+            message.origin_shard = shard_id_;
+            message.accepted = is_free;
+            hub_->Post(origin_shard, std::move(message));
+            break;
+        }
+        case ShardMessageType::NICK_CLAIM_RESULT:
+            CompleteNicknameClaim(message.socket_fd, message.generation, message.nickname, message.accepted ? NicknameAction::NICK_ACCEPT : NicknameAction::NICK_STAKEN,
+                                  std::move(message.mailbox));
+            break;
+        case ShardMessageType::NICK_RELEASE:
+            taken_nicknames_.erase(message.nickname);
+            offline_mailboxes_.Restore(message.nickname, std::move(message.mailbox));
+            break;
+        case ShardMessageType::USER_LIST_REQUEST:
+        {
+            size_t origin_shard = message.origin_shard;
+            message.type = ShardMessageType::USER_LIST_REPLY;
+            message.origin_shard = shard_id_;
+            message.text = LocalUsersList();
+            hub_->Post(origin_shard, std::move(message));
+            break;
+        }
+        case ShardMessageType::USER_LIST_REPLY:
+        {
+            Connection* reply_connection = connections_.Find(message.socket_fd, message.generation);
+            if (reply_connection == nullptr || reply_connection->user_list_replies_left == 0){
                 break;
             }
+            Connection& connection = *reply_connection;
+            if (!message.text.empty()){
+                if (!connection.user_list.empty()){
+                    connection.user_list.push_back('\02');
+                }
+                connection.user_list.append(message.text);
+            }
+            if (--connection.user_list_replies_left == 0){
+                SendUsersList(message.socket_fd, connection.user_list);
+                connection.user_list = std::string();
+            }
+            break;
         }
-        close(disconn_info.socket_fd);
-        BroadcastMessage(std::string(disc_client.nickname + " ("s + disc_client.ip_address + ":"s + disc_client.port + ") has been disconnected, reason: "s + std::move(disconn_info.disconnect_reason)));
-    } else{ // if the client hasn't established the connection
-        ConnectionInfo conn_inf = GetConnectionInfoFromSocket(disconn_info.socket_fd);
-        close(disconn_info.socket_fd);
-        std::cerr << MakeColorfulText("[ConnectionFail] Unconnected client "s + conn_inf.ToString() + " has been disconnected: "s + disconn_info.disconnect_reason, Color::Red) << '\n'; // don't notify other clients about failed connections.
+        case ShardMessageType::PRIVATE_MESSAGE:
+            if (DeliverPrivateMessage(message.nickname, message.sender_nickname, message.text)){
+                AnswerPrivateMessage(std::move(message), PrivateMessageOutcome::DELIVERED);
+            } else if (hub_->NicknameOwner(message.nickname) == shard_id_){
+                RoutePrivateMessage(std::move(message));
+            } else{ // the recipient has left meanwhile: its NICK_RELEASE is ahead of this message in the owner's mailbox
+                size_t owner = hub_->NicknameOwner(message.nickname);
+                hub_->Post(owner, std::move(message));
+            }
+            break;
+        case ShardMessageType::PRIVATE_MESSAGE_RESULT:
+            ReportPrivateMessage(message.socket_fd, message.generation, message.nickname, message.text, message.private_message_outcome);
+            break;
+        case ShardMessageType::CHANNEL_BROADCAST:
+            FanoutChannelPacket(message.text, message.packets);
+            break;
     }
 }
-void Server::DisconnectClient(const DisconnectedClient& disconn_info) noexcept{
-    if (sock_to_user_.count(disconn_info.socket_fd)){ // if the client is connected.
-        User disc_client = sock_to_user_.at(disconn_info.socket_fd);
-
-        sock_to_user_.erase(disconn_info.socket_fd);
-        taken_nicknames_.erase(disc_client.nickname);
-        for (size_t i = 0; i < poll_objects_.size(); ++i){
-            if (poll_objects_[i].fd == disconn_info.socket_fd){
-                poll_objects_.erase(poll_objects_.begin() + i);
-                break;
-            }
+
+size_t Server::ConnectedUsersCount() const noexcept{
+    return hub_ != nullptr ? hub_->connected_users_n.load() : nick_to_sock_.size();
+}
+
+void Server::BroadcastMessage(std::string_view message, uint8_t flags){
+    LOGGER.Log(LogLevel::INFO, {message});
+
+    // Encode once per protocol version: every recipient's queue (on every shard) references the same packet.
+    const VersionedPackets packets = MakeVersionedPackets(Opcode::MESSAGE, message, flags);
+    if (message_log_ != nullptr){
+        message_log_->Append(packets.v2);
+    }
+    FanoutPacket(packets, flags);
+    if (hub_ != nullptr){
+        hub_->PostToOthers(shard_id_, ShardMessage{.type = ShardMessageType::BROADCAST, .origin_shard = shard_id_, .frame_flags = flags, .packets = packets});
+    }
+}
+
+void Server::AnnouncePresence(bool joined, std::string_view nickname, std::string_view notice){
+    if (presence_.Empty()){ // the first event opens the window
+        presence_due_tick_ = timers_.Now() + TimerWheel::TicksFromMs(config_.presence_window_ms);
+    }
+    LOGGER.Log(LogLevel::DEBUG, {notice}); // a batch is logged once, as broadcast
+    if (joined){
+        presence_.Joined(nickname, notice);
+    } else{
+        presence_.Left(nickname, notice);
+    }
+}
+
+void Server::FlushPresence(){
+    if (presence_.EventsCount() == 1){
+        BroadcastMessage(presence_.Notice(), FRAME_FLAG_NOTICE);
+    } else{
+        BroadcastMessage(scratch_.ConcatColorful(Color::Yellow, {"[Presence] ", presence_.Notice()}), FRAME_FLAG_NOTICE);
+    }
+    presence_.Clear();
+}
+
+void Server::FanoutPacket(const VersionedPackets& packets, uint8_t flags){
+    if (!(flags & FRAME_FLAG_NOTICE)){
+        history_.Append(packets);
+    }
+    uint64_t started_at = MetricsNowNs();
+    for (Connection& connection : connections_){
+        if (connection.established){
+            QueuePacket(connection, packets.For(connection.protocol_version));
         }
-        close(disconn_info.socket_fd);
-        BroadcastMessage(std::string(disc_client.nickname + " ("s + disc_client.ip_address + ":"s + disc_client.port + ") has been disconnected, reason: "s + std::move(disconn_info.disconnect_reason)));
-    } else{ // if the client hasn't established the connection
-        ConnectionInfo conn_inf = GetConnectionInfoFromSocket(disconn_info.socket_fd);
-        close(disconn_info.socket_fd);
-        std::cerr << MakeColorfulText("[ConnectionFail] Unconnected client "s + conn_inf.ToString() + " has been disconnected: "s + disconn_info.disconnect_reason, Color::Red) << '\n'; // don't notify other clients about failed connections.
     }
+    metrics_.broadcast_fanout_ns.Record(MetricsNowNs() - started_at);
 }
-void Server::DisconnectClient(std::vector<DisconnectedClient>&& clients_to_disconnect) noexcept{
-    for (DisconnectedClient& client : clients_to_disconnect){
-        DisconnectClient(std::move(client));
+
+void Server::ReplayHistory(Connection& connection){
+    history_.ForEach([&](const VersionedPackets& packets){
+        QueuePacket(connection, packets.For(connection.protocol_version));
+    });
+}
+
+void Server::ChannelMessage(const std::string& channel, std::string_view message, uint8_t flags){
+    LOGGER.Log(LogLevel::INFO, {message});
+
+    const VersionedPackets packets = MakeVersionedPackets(Opcode::MESSAGE, message, flags);
+    FanoutChannelPacket(channel, packets);
+    if (hub_ != nullptr){ // a shard without members of the channel drops it after one lookup
+        hub_->PostToOthers(shard_id_, ShardMessage{.type = ShardMessageType::CHANNEL_BROADCAST, .origin_shard = shard_id_, .text = channel, .packets = packets});
     }
 }
-void Server::DisconnectClient(std::vector<DisconnectedClient>& clients_to_disconnect) noexcept{
-    for (DisconnectedClient& client : clients_to_disconnect){
-        DisconnectClient(std::move(client));
+
+void Server::FanoutChannelPacket(const std::string& channel, const VersionedPackets& packets){
+    uint32_t channel_id = channels_.Find(channel);
+    if (channel_id == ChannelTable::NO_CHANNEL){
+        return;
     }
-    clients_to_disconnect.clear();
+    uint64_t started_at = MetricsNowNs();
+    for (int member_socketfd : channels_.Members(channel_id)){
+        Connection* connection = connections_.Find(member_socketfd);
+        if (connection != nullptr){
+            QueuePacket(*connection, packets.For(connection->protocol_version));
+        }
+    }
+    metrics_.channel_fanout_ns.Record(MetricsNowNs() - started_at);
 }
 
+void Server::QueueFrame(int receiver_socketfd, Opcode opcode, std::string_view payload, uint8_t flags){
+    Connection* connection = connections_.Find(receiver_socketfd);
+    if (connection == nullptr){
+        return;
+    }
+    QueuePacket(*connection, MakeFramePacket(connection->protocol_version, opcode, payload, flags));
+}
 
-int main(int argc, char* argv[]){
-    if (argc != 3){
-        std::cerr << "[Usage] ./server <hostname> <port>"s << std::endl;
-        return 1;
+void Server::QueuePacket(int receiver_socketfd, const SharedPacket& packet){
+    Connection* connection = connections_.Find(receiver_socketfd);
+    if (connection != nullptr){
+        QueuePacket(*connection, packet);
     }
+}
+
+void Server::QueuePacket(Connection& connection, const SharedPacket& packet){
 
-    std::unique_ptr<Server> p_server;
-    try{
-        p_server = std::make_unique<Server>(argv[1], argv[2]);
-    } catch(std::runtime_error& err){
-        std::cerr << MakeColorfulText("[ServerInitFail] "s + std::string(err.what()), Color::Red) << std::endl;
-        return 1;
+    if (connection.congested){ // memory per slow client is capped: drop until it drains below the low watermark
+        ++connection.dropped_messages;
+        metrics_.messages_dropped.Add();
+        return;
+    }
+    connection.outbound.Push(packet);
+    metrics_.messages_out.Add();
+    if (connection.outbound.QueuedBytes() >= config_.egress_high_watermark){
+        connection.congested = true;
+        connection.congested_since = std::chrono::steady_clock::now();
+        congested_clients_.push_back(connection.socket_fd);
     }
+    if (!connection.flush_scheduled){
+        connection.flush_scheduled = true;
+        flush_list_.push_back(connection.socket_fd);
+    }
+}
 
-    try{
-        p_server->Start();
-    } catch(std::runtime_error& err){
-        std::cerr << MakeColorfulText("[ServerFatalError] "s + std::string(err.what()), Color::Red) << std::endl;
-        return 1;
+void Server::FlushConnection(int socketfd, std::vector<DisconnectedClient>& disconnected_storage){
+    Connection* found_connection = connections_.Find(socketfd);
+    if (found_connection == nullptr){
+        return;
     }
-    std::cerr << "Exited from the server!" << std::endl;
-}
\ No newline at end of file
+    Connection& connection = *found_connection;
+    size_t queued_bytes = connection.outbound.QueuedBytes();
+    int send_status = io_backend_->Send(socketfd, connection.outbound);
+    metrics_.bytes_out.Add(queued_bytes - connection.outbound.QueuedBytes()); // epoll writes right away, io_uring reports in OnWritable()
+    metrics_.egress_queue_bytes.Record(connection.outbound.QueuedBytes());
+    if (send_status == -1){
+        disconnected_storage.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::DELIVERY_FAILED, .disconnect_reason = "message delivery failed: "s + std::string(strerror(errno))});
+        return;
+    }
+    if (connection.congested && connection.outbound.QueuedBytes() <= config_.egress_low_watermark){
+        connection.congested = false;
+        if (connection.dropped_messages > 0){
+            LOGGER.LogColorful(LogLevel::WARN, Color::Yellow, {"[SlowConsumer] ", connection.address.ToString(), " has recovered, ", std::to_string(connection.dropped_messages), " messages were dropped."});
+            connection.dropped_messages = 0;
+        }
+    }
+}
+
+void Server::FlushPendingWrites(std::vector<DisconnectedClient>& disconnected_storage){
+    for (size_t i = 0; i < flush_list_.size(); ++i){
+        int socketfd = flush_list_[i];
+        Connection* connection = connections_.Find(socketfd);
+        if (connection == nullptr){
+            continue;
+        }
+        connection->flush_scheduled = false;
+        FlushConnection(socketfd, disconnected_storage);
+    }
+    flush_list_.clear();
+}
+
+void Server::EvictSlowConsumers(std::vector<DisconnectedClient>& disconnected_storage){
+    if (congested_clients_.empty()){
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const auto timeout = std::chrono::milliseconds(config_.slow_consumer_timeout_ms);
+    size_t kept_n = 0;
+    for (int socketfd : congested_clients_){
+        const Connection* connection = connections_.Find(socketfd);
+        if (connection == nullptr || !connection->congested){ // disconnected or recovered
+            continue;
+        }
+        if (now - connection->congested_since >= timeout){
+            disconnected_storage.push_back(DisconnectedClient{.socket_fd = socketfd, .reason = DisconnectReason::SLOW_CONSUMER, .disconnect_reason = "slow consumer: outbound queue has stayed over the limit for too long."s});
+            continue;
+        }
+        congested_clients_[kept_n++] = socketfd;
+    }
+    congested_clients_.resize(kept_n);
+}
+
+void Server::DisconnectClient(DisconnectedClient&& disconn_info) noexcept{
+    const Connection* connection = connections_.Find(disconn_info.socket_fd);
+    if (connection == nullptr){ // already disconnected
+        return;
+    }
+    // the slot is reused by Remove(): keep what's needed for the notice
+    bool was_established = connection->established;
+    std::string nickname = connection->nickname.ToString();
+    std::string address = connection->address.ToString();
+    for (uint32_t channel_id : connection->channels){ // the user's own list: no scan over all the channels
+        channels_.Leave(channel_id, disconn_info.socket_fd);
+    }
+    metrics_.channel_memberships.Add(-static_cast<int64_t>(connection->channels.size()));
+    if (connection->timer != TimerWheel::NO_TIMER){
+        timers_.Cancel(connection->timer);
+    }
+    if (connection->flood.throttled){ // the socket may be reused before the next resume pass
+        throttled_clients_.erase(std::remove(throttled_clients_.begin(), throttled_clients_.end(), disconn_info.socket_fd), throttled_clients_.end());
+    }
+
+    connections_.Remove(disconn_info.socket_fd);
+    io_backend_->RemoveClient(disconn_info.socket_fd);
+    close(disconn_info.socket_fd); // closing the socket also removes it from the epoll instance
+    metrics_.disconnects[static_cast<size_t>(disconn_info.reason)].Add();
+    if (was_established){ // if the client is connected.
+        metrics_.users_connected.Add(-1);
+        nick_to_sock_.erase(nickname);
+        ReleaseNickname(nickname);
+        if (hub_ != nullptr){
+            --hub_->connected_users_n;
+        }
+        AnnouncePresence(false, nickname, scratch_.Concat({nickname, " ", address, " has been disconnected, reason: ", disconn_info.disconnect_reason}));
+    } else{ // if the client hasn't established the connection
+        CountPendingHandshake(-1);
+        metrics_.connections_failed.Add();
+        LOGGER.LogColorful(LogLevel::WARN, Color::Red, {"[ConnectionFail] Unconnected client ", address, " has been disconnected: ", disconn_info.disconnect_reason}); // don't notify other clients about failed connections.
+    }
+}
+void Server::DisconnectClient(const DisconnectedClient& disconn_info) noexcept{
+    DisconnectClient(DisconnectedClient(disconn_info));
+}
+void Server::DisconnectClient(std::vector<DisconnectedClient>&& clients_to_disconnect) noexcept{
+    for (DisconnectedClient& client : clients_to_disconnect){
+        DisconnectClient(std::move(client));
+    }
+}
+void Server::DisconnectClient(std::vector<DisconnectedClient>& clients_to_disconnect) noexcept{
+    for (size_t i = 0; i < clients_to_disconnect.size(); ++i){ // by index: the pass may append to the vector
+        DisconnectClient(std::move(clients_to_disconnect[i]));
+    }
+    clients_to_disconnect.clear();
+}
@@ -2,6 +2,8 @@
 
 #include "../../lib/networking_ops.h"
 #include "../../lib/color.h"
+#include "../../lib/tick_arena.h"
+#include "../../lib/logger.h"
 
 #include <execinfo.h>
 
@@ -15,16 +17,32 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
+#include <array>
 #include <algorithm>
 #include <signal.h>
+#include <atomic>
+#include <thread>
+#include <pthread.h>
 
 #include "domain.h"
+#include "metrics.h"
+#include "connection_table.h"
+#include "channel_table.h"
+#include "history_ring.h"
+#include "message_log.h"
+#include "admission.h"
+#include "timer_wheel.h"
+#include "flood_control.h"
+#include "presence.h"
+#include "offline_mailbox.h"
+#include "shard_hub.h"
+#include "io_backend.h"
+#include "uring_backend.h"
 
-#define BACKLOG 10 // Max number of pending connections to the server
-#define MESSAGE_MAX_LENGTH 1024;
-#define CONNECTIONS_LIMIT 30;
+#define MESSAGE_MAX_LENGTH 1024
+#define EVENT_WAIT_TIMEOUT 200 // miliseconds
 
-int EXIT_SIGNAL = 0;
+inline std::atomic_int EXIT_SIGNAL = 0; // shared by all reactor threads
 static void InterruptHandler(int signal_num){
     EXIT_SIGNAL = 1;
 }
@@ -32,9 +50,17 @@ static void InterruptHandler(int signal_num){
 // TO DO: Finish the algorithm for accepting new connections
 // TO DO: Switch from exceptions to return values.
 
-class Server{
+class Server : private IoHandler{
 public:
-    explicit Server(char* hostname, char* port);
+    /**
+     * @param hub state shared with the other reactor threads of a sharded server, nullptr in the single-thread mode
+     * @param shard_id index of this reactor thread in the hub
+     * @param message_log durable log the broadcasts are appended to (shared by the shards), nullptr if nothing is persisted.
+     *                    The history starts with the messages recovered from it.
+     * @throws std::runtime_error if the listenner socket can't be created.
+    */
+    explicit Server(char* hostname, char* port, const ServerConfig& config = ServerConfig(), ShardHub* hub = nullptr, size_t shard_id = 0,
+                    MessageLog* message_log = nullptr);
 
     explicit Server(const Server& other) = delete;
     Server& operator=(const Server& other) = delete;
@@ -53,11 +79,72 @@ public:
     */
     void ShutDown() noexcept;
 
+    /**
+     * Counters and histograms of this reactor thread, safe to read from any thread.
+    */
+    const ServerMetrics& Metrics() const noexcept{
+        return metrics_;
+    }
+
 private: // --------- client actions ---------
 
-    void BroadcastMessage(std::string&& message);
+    /**
+     * Assemble the message once per protocol version and share the packets between the queues of every connected client.
+     * Never blocks on a socket.
+     * @param flags v2 frame flags (FRAME_FLAG_NOTICE for server notices)
+    */
+    void BroadcastMessage(std::string_view message, uint8_t flags = 0);
+
+    /**
+     * Record a join or leave event. The events of a presence window are announced together by FlushPresence().
+     * @param notice notice announcing the event alone
+    */
+    void AnnouncePresence(bool joined, std::string_view nickname, std::string_view notice);
+
+    // Broadcast the notice of the presence events collected so far.
+    void FlushPresence();
 
     /**
+     * Queue a broadcast packet for every client connected to this shard, in the protocol version each client speaks.
+     * Chat lines (no FRAME_FLAG_NOTICE) are recorded in the history.
+    */
+    void FanoutPacket(const VersionedPackets& packets, uint8_t flags);
+
+    /**
+     * Queue the recorded chat lines for a user who has just joined. The stored packets are queued as they are,
+     * and the flush at the end of the tick gathers them into one sendmsg() (FLUSH_IOV_BATCH packets per call).
+    */
+    void ReplayHistory(Connection& connection);
+
+    /**
+     * Send a message to the members of a channel on every shard.
+     * @param channel channel name (without '#')
+    */
+    void ChannelMessage(const std::string& channel, std::string_view message, uint8_t flags = 0);
+
+    /**
+     * Queue a channel packet for the channel's members connected to this shard. Only the members are visited.
+    */
+    void FanoutChannelPacket(const std::string& channel, const VersionedPackets& packets);
+
+    /**
+     * Assemble a frame in the client's protocol version and queue it. The packet is written out at the end of the loop tick.
+     * @param receiver_socketfd client's socket
+     * @param payload chat text or the arguments of a command
+    */
+    void QueueFrame(int receiver_socketfd, Opcode opcode, std::string_view payload = std::string_view(), uint8_t flags = 0);
+
+    /**
+     * Queue an assembled packet for a client. A client whose queue is over the high watermark is marked congested and
+     * new packets for it are dropped until the queue drains below the low watermark.
+    */
+    void QueuePacket(int receiver_socketfd, const SharedPacket& packet);
+    void QueuePacket(Connection& connection, const SharedPacket& packet);
+
+    /**
+     * Remove a client and record its leave event (nothing is broadcast from here, so a disconnection never
+     * causes another one recursively). A vector of clients is disconnected in one iterative pass, which also handles
+     * the clients added to it during the pass.
      * @param disconn_info structure with socket and disconnection reason for a client
     */
     void DisconnectClient(DisconnectedClient&& disconn_info) noexcept;
@@ -66,69 +153,297 @@ private: // --------- client actions ---------
     void DisconnectClient(std::vector<DisconnectedClient>& clients_to_disconnect) noexcept;
 
     /**
-     * Check if the message is a command or a regular text: if a regular message - broadcast to everyone, if a command - send a response to the client
+     * Decode and dispatch the frames buffered in a client's decoder, charging each one to the client's flood control
+     * budgets. Decoding stops when the client overdraws a budget: the rest waits in the decoder until the client is resumed.
+     * @return false if the client is throttled, being disconnected or gone
+    */
+    bool ProcessInbound(int socketfd);
+
+    /**
+     * Dispatch a frame to the handler registered for its opcode: a regular message is broadcast to everyone, a command gets a response.
      * @param sender_socketfd client's socket
-     * @param readable_buffer a buffer where the message is stored
+     * @param frame a decoded frame of the client's protocol version
      * @param disconnected_storage a vector for storing disconnecting clients
-     * @return -1 on error with a pending connection, 0 on everything else
     */
-    int ProcessMessage(int sender_socketfd, char* readable_buffer, std::vector<DisconnectedClient>& disconnected_storage);
+    void ProcessMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+private: // --------- command handlers (see __BuildCommandTable__() for the registry) ---------
+    using CommandHandler = void (Server::*)(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    struct Command{
+        CommandHandler handler = nullptr;
+        bool requires_user = false; // a client that hasn't finished the handshake sending it is a protocol violation
+        MessageClass message_class = MessageClass::COMMAND; // flood control budget the frame is charged to
+    };
+
+    /**
+     * Turn the command registry into an opcode-indexed table, so that dispatching a frame is a single array lookup
+     * no matter how many commands there are.
+    */
+    static constexpr std::array<Command, 256> __BuildCommandTable__();
+    static const std::array<Command, 256> command_table_;
+
+    // Relay a chat message to everyone.
+    void HandleChatMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // PROTO_UPGRD: answer in v1, switch the connection to v2 right after the answer.
+    void HandleProtocolUpgrade(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // NICK_NEWREQ<nickname>: the initial nickname of a pending client.
+    void HandleNicknameRequest(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_NICKCNG<nickname>: a connected user wants another nickname. The answer is NICK_ACCEPT, NICK_STAKEN or NICK_INVALD.
+    void HandleNicknameChange(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_LSUSERS: answer with the '\02'-separated list of the users of the whole server.
+    void HandleUsersList(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_PMSGUSR<nickname>\02<message>: deliver a message to a single user.
+    void HandlePrivateMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_CHNJOIN<channel>: join a channel (created by its first member).
+    void HandleChannelJoin(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_CHNLEAV<channel>: leave a channel.
+    void HandleChannelLeave(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // ACT_CHNMSGS<channel>\02<message>: send a message to the members of a channel the sender is in.
+    void HandleChannelMessage(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // HEARTB_PING: answer with HEARTB_PONG.
+    void HandleHeartbeatPing(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    // HEARTB_PONG: nothing to do, receiving it has already refreshed the connection.
+    void HandleHeartbeatPong(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    void HandleUnknownCommand(int sender_socketfd, const Frame& frame, std::vector<DisconnectedClient>& disconnected_storage);
+
+    /**
+     * @return this shard's users as '\02'-separated "<nickname> (<address>)" entries
+    */
+    std::string LocalUsersList() const;
+
+    /**
+     * Number the gathered user list entries and send them to the client.
+    */
+    void SendUsersList(int socketfd, const std::string& entries);
+
+    /**
+     * Deliver a private message to a user connected to this shard.
+     * @return false if there is no such user on this shard
+    */
+    bool DeliverPrivateMessage(const std::string& recipient, const std::string& sender, std::string_view message);
+
+    // Tell the sender how its private message went.
+    void ReportPrivateMessage(int socketfd, uint32_t generation, const std::string& recipient, std::string_view message, PrivateMessageOutcome outcome);
+
+    /**
+     * On the owner shard of the recipient's nickname: forward a private message to the shard the recipient is connected to,
+     * or keep it in the mailbox of the offline nickname.
+    */
+    void RoutePrivateMessage(ShardMessage&& message);
+
+    // Send the outcome of a private message back to the sender's shard.
+    void AnswerPrivateMessage(ShardMessage&& message, PrivateMessageOutcome outcome);
+
+    /**
+     * On the owner shard of the recipient's nickname: keep a private message for an offline nickname.
+    */
+    PrivateMessageOutcome StoreOfflineMessage(const std::string& recipient, const std::string& sender, std::string_view message);
+
+    /**
+     * Queue the private messages that have waited for a nickname in its mailbox: they leave with the same batched write.
+    */
+    void DeliverMailbox(int socketfd, const std::vector<std::string>& mailbox);
 
 private: // --------- connection-handling functions ---------
     /**
-     * Enable server socket to listen for incoming connections
-     * @throw std::runtime_error on listen() -1 return
+     * Enable server socket to listen for incoming connections and start the configured I/O backend on it.
+     * Falls back to epoll if io_uring can't be set up.
+     * @throw std::runtime_error on listen() -1 return or if no backend can be started
     */
     void __SetUpListenner__();
 
     /**
-     * EstablishConnection's internal-use method: Create a new socket from incoming connection.
-     * @param addr_storage structure for holding incoming connection's address
-     * @param addr_len_ptr pointer to the length of addr_storage structure
-     * @throw std::runtime_error on accept() -1 return <--- WORK ON THE EXCEPTION HANDLING
+     * Admission control, before an accepted socket costs anything else: the cap on pending handshakes and the connect
+     * rate limit of the client's IP. A rejected socket is reset (no TIME_WAIT is left behind) and only counted.
+     * @return false if the connection has been rejected
+    */
+    bool AdmitConnection(int socketfd, const PeerAddress& conn_address);
+
+    /**
+     * Account for a handshake that has begun (+1) or ended, completed or not (-1).
+    */
+    void CountPendingHandshake(int delta) noexcept;
+
+    // Number of handshakes in progress on the whole server (all shards).
+    size_t PendingHandshakesCount() const noexcept;
+
+private: // --------- flood control ---------
+    enum class FloodVerdict{
+        ALLOW = 0,
+        THROTTLE = 1, // the frame has overdrawn a budget: handle it, then stop reading the client
+        DISCONNECT = 2
+    };
+
+    /**
+     * Charge a frame to the client's budgets (a few integer operations, no allocation) and escalate on an overdraft:
+     * an overdraft throttles the client, a client that keeps overdrawing right after every resume is muted after
+     * FLOOD_MUTE_AFTER_MS and disconnected after FLOOD_DISCONNECT_AFTER_MS.
     */
-    [[nodiscard]] int AcceptNewConnection(sockaddr_storage* addr_storage, socklen_t* addr_len_ptr);
+    FloodVerdict ChargeFrame(Connection& connection, MessageClass message_class, size_t payload_bytes);
 
-    static void DeletePendingConnection(ConnectionInfo& conn_info, int socket_fd, char* fail_reason) noexcept{
+    // Stop reading a client until its budgets are out of debt.
+    void ThrottleClient(Connection& connection);
+
+    /**
+     * Resume the throttled clients whose budgets have refilled, and process the frames they have left in their decoders.
+    */
+    void ResumeThrottledClients();
+
+    // Time the next wait for events may block: shorter while clients are throttled or presence events are pending.
+    int WaitTimeout() const noexcept;
+
+private: // --------- connection timers (one per connection on the timer wheel) ---------
+    /**
+     * A connection's timer has fired: disconnect a client whose handshake, heartbeat or idle deadline has passed,
+     * send a heartbeat ping to a silent one, and re-arm the timer for the next deadline.
+     * @param data socket fd and generation of the connection (see __TimerData__())
+    */
+    void OnConnectionTimer(TimerWheel::TimerId timer, uint64_t data, std::vector<DisconnectedClient>& disconnected_storage);
+
+    /**
+     * Arm the connection's timer for its earliest heartbeat or idle deadline. The traffic of the connection doesn't touch
+     * the timer: it only updates the tick of the last received bytes, and the timer moves the deadline when it fires.
+    */
+    void ScheduleConnectionTimer(Connection& connection);
+
+    static uint64_t __TimerData__(const Connection& connection) noexcept{
+        return (static_cast<uint64_t>(connection.generation) << 32) | static_cast<uint32_t>(connection.socket_fd);
+    }
+
+    static void DeletePendingConnection(const PeerAddress& conn_address, int socket_fd, char* fail_reason) noexcept{
         // close socket and print the fail text
         close(socket_fd);
-        std::string err_msg("[ConnectionFail] "s);
-        err_msg.reserve(100);
-        err_msg.append(conn_info.ToString()).append(" has failed to connect: "s).append(std::string(fail_reason));
-        std::cerr << MakeColorfulText(std::move(err_msg), Color::Red) << '\n';
+        char address[PEER_ADDRESS_STRLEN];
+        LOGGER.LogColorful(LogLevel::WARN, Color::Red, {"[ConnectionFail] ", conn_address.Format(address), " has failed to connect: ", fail_reason});
     }
 
+private: // --------- IoHandler: events from the I/O backend ---------
+    /**
+     * Add a freshly accepted client to the pending connections and begin the connection protocol.
+     * @param conn_address client's address, nullptr if the backend doesn't report it
+    */
+    void OnAccept(int socketfd, sockaddr_storage* conn_address) override;
+
+    /**
+     * Feed received bytes to the client's frame decoder and process every complete frame.
+    */
+    bool OnData(int socketfd, const char* data, size_t data_length) override;
+
+    void OnPeerClosed(int socketfd, int error_code) override;
+
+    /**
+     * Account for the bytes a completion-based backend has sent and keep flushing the client's queue.
+    */
+    void OnWritable(int socketfd, size_t sent_bytes) override;
+
+    // Handle the messages posted to this shard's mailbox.
+    void OnWakeup() override;
+
+    /**
+     * Write out as much of the client's outbound queue as the socket accepts.
+     * @param socketfd client's socket
+     * @param disconnected_storage a vector for storing clients whose delivery failed
+    */
+    void FlushConnection(int socketfd, std::vector<DisconnectedClient>& disconnected_storage);
+
     /**
-     * Add an incoming connection to the list of pending connections and perform the connection protocol.
-     * @param pending_connections_vec vector to store the pending connection info
-     * @param addr_storage a structure for holding info about a new connection.
-     * @param addr_len_ptr a pointer to a variable with length of the incoming connection address
-     * 
+     * Flush every client that had packets queued during the current loop tick.
     */
-    void EstablishConnection(std::vector<pollfd>& pending_connections_vec, sockaddr_storage* addr_storage, socklen_t* addr_len_ptr);
+    void FlushPendingWrites(std::vector<DisconnectedClient>& disconnected_storage);
 
     /**
-     * Handle clients that are waiting for their connection to the server to be established.
-     * @param pending_connection_vec vector of pending connections with pollfd structs
-     * @param read_buffer a pointer to a writable buffer.
-     * @throw std::runtime_error on poll() -1 return or from ReceiveMessage or SendMessage methods.
+     * Disconnect clients that have stayed above the egress high watermark longer than the slow consumer timeout.
     */
-    void HandlePendingConnections(std::vector<pollfd>& pending_connections_vec, char* read_buffer);
+    void EvictSlowConsumers(std::vector<DisconnectedClient>& disconnected_storage);
 
     /**
-     * Give response to client's nickname change.
+     * Check that a nickname is not empty and contains only allowed characters.
      * @param nickname a nickname string
-     * @return One of NicknameAction flags
+     * @return NICK_ACCEPT or NICK_INVALD
     */
-    NicknameAction __ValidateNickname__(std::string& nickname) noexcept;
+    NicknameAction __ValidateNickname__(std::string_view nickname) noexcept;
+
+    /**
+     * @return true if a channel name is 1 to CHANNEL_NAME_MAX_LENGTH printable characters without spaces
+    */
+    static bool __ValidateChannelName__(std::string_view channel) noexcept;
+
+private: // --------- nickname ownership (sharded mode) ---------
+    /**
+     * Reserve a valid nickname for a pending client or a user changing its nickname. The nickname's owner shard decides
+     * whether it is taken: in the single-thread mode (or if this shard is the owner) the claim is completed right away,
+     * otherwise a claim is posted to the owner's mailbox and completed when the answer arrives.
+    */
+    void ClaimNickname(int socketfd, std::string&& nickname);
+
+    /**
+     * Finish the connection protocol of a pending client, or the nickname change of a connected user,
+     * after the nickname claim has been decided.
+     * @param generation the connection generation the claim was made for: a reused socket won't get someone else's answer
+     * @param mailbox private messages that have waited for the accepted nickname
+    */
+    void CompleteNicknameClaim(int socketfd, uint32_t generation, const std::string& nickname, NicknameAction nick_action,
+                               std::vector<std::string>&& mailbox = {});
+
+    /**
+     * Switch a connected user to a nickname that has just been reserved for it, and free the old one.
+    */
+    void ChangeNickname(int socketfd, const std::string& nickname);
+
+    /**
+     * Give a nickname back to its owner shard.
+     * @param unread private messages handed over with the nickname that its user hasn't received, they go back to the mailbox
+    */
+    void ReleaseNickname(const std::string& nickname, std::vector<std::string>&& unread = {});
+
+    /**
+     * Handle a message posted to this shard's mailbox by another reactor thread.
+    */
+    void HandleShardMessage(ShardMessage&& message);
+
+    // Number of users connected to the whole server (all shards).
+    size_t ConnectedUsersCount() const noexcept;
 
 
 private:
     const std::string hostname_, port_;
+    const ServerConfig config_;
+    ShardHub* const hub_;
+    const size_t shard_id_;
+    MessageLog* const message_log_;
     int server_socket_;
+    std::unique_ptr<IoBackend> io_backend_;
 
-    
-    std::unordered_set<std::string> taken_nicknames_;
-    std::unordered_map<int, User> sock_to_user_;
-    std::vector<pollfd> poll_objects_;
+    std::unordered_map<std::string, size_t> taken_nicknames_; // taken nickname -> shard its user is connected to (sharded mode: nicknames owned by this shard)
+    std::unordered_map<std::string, int> nick_to_sock_; // nicknames of the users connected to this shard -> their socket
+    OfflineMailboxes offline_mailboxes_; // private messages for the offline nicknames this shard owns
+    ConnectionTable connections_; // every accepted client socket, pending or established
+    ChannelTable channels_; // channels of this shard's users, with their local members
+    std::vector<DisconnectedClient> disconnecting_clients_; // clients to be disconnected at the beginning of the next tick
+    std::vector<int> flush_list_; // sockets with packets queued during the current tick
+    std::vector<int> congested_clients_; // sockets whose outbound queue has reached the high watermark
+    ConnectRateLimiter connect_limiter_; // per-IP connect budgets of this shard
+    TimerWheel timers_; // handshake, heartbeat and idle deadlines of the connections
+    std::array<TokenBudget, MESSAGE_CLASSES_N> message_budgets_; // flood control, in timer wheel ticks
+    TokenBudget byte_budget_;
+    std::vector<int> throttled_clients_; // sockets that aren't read until their budgets refill
+    std::vector<int> resuming_clients_; // throttled_clients_ of the previous tick, being resumed
+    PresenceBatch presence_; // join/leave events of the current presence window
+    uint64_t presence_due_tick_ = 0; // timer wheel tick the pending presence events are announced at
+    size_t pending_handshakes_n_ = 0; // handshakes in progress on this shard
+    TickArena scratch_; // formatted messages of the current tick
+    ServerMetrics metrics_;
+    HistoryRing history_; // the last broadcast chat lines (every shard records all of them)
 };
@@ -0,0 +1,154 @@
+// This file contains the structures shared by the reactor threads of a sharded server
+#pragma once
+
+#include <sys/eventfd.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../../lib/mpsc_queue.h"
+#include "outbound_queue.h"
+
+enum class ShardMessageType{
+    BROADCAST = 0, // fan a packet out to the shard's local clients
+    NICK_CLAIM = 1, // ask the nickname's owner shard to reserve a nickname
+    NICK_CLAIM_RESULT = 2, // owner shard's answer to NICK_CLAIM
+    NICK_RELEASE = 3, // a user holding the nickname has disconnected (or has changed it)
+    USER_LIST_REQUEST = 4, // send the shard's part of the user list to the origin shard
+    USER_LIST_REPLY = 5, // one shard's part of the user list
+    PRIVATE_MESSAGE = 6, // origin -> nickname owner shard -> shard of the recipient
+    PRIVATE_MESSAGE_RESULT = 7, // tells the sender's shard whether the private message has been delivered
+    CHANNEL_BROADCAST = 8 // fan a packet out to the shard's local members of a channel
+};
+
+// What has become of a private message
+enum class PrivateMessageOutcome : uint8_t{
+    DELIVERED = 0,
+    STORED = 1, // the recipient is offline, the message waits in its mailbox
+    NOT_FOUND = 2, // the recipient is offline and the mailboxes are disabled (or the nickname is invalid)
+    MAILBOX_FULL = 3
+};
+
+struct ShardMessage{
+    ShardMessageType type = ShardMessageType::BROADCAST;
+    size_t origin_shard = 0;
+    int socket_fd = -1; // socket of the client on the origin shard that has to receive the answer
+    uint32_t generation = 0; // generation of that client's connection: guards against the socket being reused meanwhile
+    bool accepted = false; // NICK_CLAIM_RESULT
+    PrivateMessageOutcome private_message_outcome = PrivateMessageOutcome::DELIVERED; // PRIVATE_MESSAGE_RESULT
+    uint8_t frame_flags = 0; // BROADCAST: v2 flags of the packets (FRAME_FLAG_NOTICE: not recorded in the history)
+    std::string nickname; // NICK_*: the nickname, PRIVATE_MESSAGE*: the recipient
+    std::string sender_nickname; // PRIVATE_MESSAGE
+    std::string text; // USER_LIST_REPLY: '\02'-separated entries, PRIVATE_MESSAGE*: the message, CHANNEL_BROADCAST: the channel
+    VersionedPackets packets; // BROADCAST, CHANNEL_BROADCAST
+    std::vector<std::string> mailbox; // NICK_CLAIM_RESULT: private messages kept for the offline nickname, NICK_RELEASE: the ones not delivered
+};
+
+/**
+ * Inbox of a reactor thread: a lock-free MPSC queue plus an eventfd registered in the thread's epoll instance.
+ * The eventfd is written only when the inbox goes from "drained" to "has messages", so a burst of posts costs one wakeup.
+*/
+class ShardMailbox{
+public:
+    ShardMailbox(){
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ == -1){
+            throw std::runtime_error(std::string("eventfd(): ") + strerror(errno));
+        }
+    }
+
+    ShardMailbox(const ShardMailbox& other) = delete;
+    ShardMailbox& operator=(const ShardMailbox& other) = delete;
+
+    ~ShardMailbox(){
+        close(event_fd_);
+    }
+
+    // Called from any thread.
+    void Post(ShardMessage&& message){
+        queue_.Push(std::move(message));
+        if (!wakeup_pending_.exchange(true, std::memory_order_seq_cst)){
+            uint64_t one = 1;
+            [[maybe_unused]] ssize_t written = write(event_fd_, &one, sizeof(one));
+        }
+    }
+
+    /**
+     * Called from the owning thread only: handle every posted message.
+    */
+    template <typename Handler>
+    void Drain(Handler&& handler){
+        uint64_t counter;
+        [[maybe_unused]] ssize_t read_n = read(event_fd_, &counter, sizeof(counter));
+        wakeup_pending_.store(false, std::memory_order_seq_cst);
+
+        ShardMessage message;
+        while (queue_.Pop(message)){
+            handler(std::move(message));
+        }
+    }
+
+    int EventFd() const noexcept{
+        return event_fd_;
+    }
+
+private:
+    MpscQueue<ShardMessage> queue_;
+    std::atomic<bool> wakeup_pending_{false};
+    int event_fd_;
+};
+
+/**
+ * State shared by all shards: one mailbox per shard and the global user counter.
+ * Every nickname is owned by exactly one shard (hash of the nickname), and only the owner decides
+ * whether it is taken, so uniqueness needs no locks, only messages. The owner also remembers which shard
+ * the user holding the nickname is connected to, so private messages are routed without a broadcast.
+*/
+class ShardHub{
+public:
+    explicit ShardHub(size_t shards_n){
+        mailboxes_.reserve(shards_n);
+        for (size_t i = 0; i < shards_n; ++i){
+            mailboxes_.push_back(std::make_unique<ShardMailbox>());
+        }
+    }
+
+    size_t ShardsCount() const noexcept{
+        return mailboxes_.size();
+    }
+
+    ShardMailbox& Mailbox(size_t shard_id) noexcept{
+        return *mailboxes_[shard_id];
+    }
+
+    void Post(size_t shard_id, ShardMessage&& message){
+        mailboxes_[shard_id]->Post(std::move(message));
+    }
+
+    // Send a copy of the message to every shard except the origin one.
+    void PostToOthers(size_t origin_shard, const ShardMessage& message){
+        for (size_t i = 0; i < mailboxes_.size(); ++i){
+            if (i != origin_shard){
+                ShardMessage copy(message);
+                mailboxes_[i]->Post(std::move(copy));
+            }
+        }
+    }
+
+    size_t NicknameOwner(const std::string& nickname) const noexcept{
+        return std::hash<std::string>{}(nickname) % mailboxes_.size();
+    }
+
+    std::atomic<size_t> connected_users_n{0};
+    std::atomic<size_t> pending_handshakes_n{0}; // accepted connections of all shards that haven't finished the handshake
+
+private:
+    std::vector<std::unique_ptr<ShardMailbox>> mailboxes_;
+};
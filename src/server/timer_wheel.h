@@ -0,0 +1,200 @@
+// This file contains the hierarchical timing wheel that drives the per-connection timers of a reactor thread
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#define TIMER_WHEEL_TICK_MS 10 // resolution of the timers
+#define TIMER_WHEEL_SLOT_BITS 6 // 64 slots per level
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ticks ahead (~1.9 days with 10 ms ticks), later deadlines are capped
+
+/**
+ * Hierarchical timing wheel: level 0 has a slot per tick, every slot of level k spans 64^k ticks. A timer is linked
+ * into the slot of its deadline at the coarsest level it fits, and when the wheel reaches the beginning of a coarse
+ * slot, the timers of that slot are spread over the finer level (cascade). Arm, Rearm and Cancel unlink/link a node
+ * in O(1), and advancing the wheel only touches the slots of the elapsed ticks and the timers due in them,
+ * so the cost of a loop tick doesn't depend on how many timers are armed.
+ *
+ * Timers are nodes of a slab addressed by TimerId (connections move around in the ConnectionTable, so they keep
+ * the id, not a pointer). A timer stays allocated after it fires, until the owner re-arms or cancels it.
+*/
+class TimerWheel{
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimerId = uint32_t;
+    static constexpr TimerId NO_TIMER = UINT32_MAX;
+
+    explicit TimerWheel(Clock::time_point start = Clock::now()) : start_(start) {
+        for (TimerId& slot : slots_){
+            slot = NO_TIMER;
+        }
+    }
+
+    // Current tick: the last one the wheel has been advanced to
+    uint64_t Now() const noexcept{
+        return now_;
+    }
+
+    static uint64_t TicksFromMs(int64_t ms) noexcept{
+        return ms <= 0 ? 0 : (static_cast<uint64_t>(ms) + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    }
+
+    /**
+     * @param expires_at tick the timer fires at (a past tick fires on the next advance)
+     * @param data value handed to the expiry visitor
+     * @return id of the new timer
+    */
+    TimerId Arm(uint64_t expires_at, uint64_t data){
+        TimerId id;
+        if (free_head_ != NO_TIMER){
+            id = free_head_;
+            free_head_ = nodes_[id].next;
+        } else{
+            id = static_cast<TimerId>(nodes_.size());
+            nodes_.emplace_back();
+        }
+        nodes_[id].data = data;
+        nodes_[id].slot = NO_SLOT;
+        Rearm(id, expires_at);
+        ++armed_n_;
+        return id;
+    }
+
+    // Move an armed or fired timer to a new deadline.
+    void Rearm(TimerId id, uint64_t expires_at) noexcept{
+        Node& node = nodes_[id];
+        if (node.slot != NO_SLOT){
+            __Unlink__(id);
+        } else if (node.fired){
+            node.fired = false;
+            ++armed_n_;
+        }
+        node.expires_at = expires_at > now_ ? expires_at : now_ + 1;
+        __Link__(id);
+    }
+
+    // Disarm a timer and free its id.
+    void Cancel(TimerId id) noexcept{
+        Node& node = nodes_[id];
+        if (node.slot != NO_SLOT){
+            __Unlink__(id);
+        }
+        if (!node.fired){
+            --armed_n_;
+        }
+        node.fired = false;
+        node.next = free_head_;
+        free_head_ = id;
+    }
+
+    /**
+     * Advance the wheel to the current time and fire the timers that are due, in deadline order (by tick).
+     * @param visit called with (TimerId, data) of every fired timer, it may Rearm() or Cancel() any timer
+    */
+    template <typename Visitor>
+    void Advance(Clock::time_point now, Visitor&& visit){
+        uint64_t target = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - start_).count()) / TIMER_WHEEL_TICK_MS;
+        while (now_ < target){
+            ++now_;
+            for (size_t level = TIMER_WHEEL_LEVELS - 1; level > 0; --level){ // the coarse slots that begin at this tick
+                if ((now_ & ((uint64_t(1) << (level * TIMER_WHEEL_SLOT_BITS)) - 1)) == 0){
+                    __Cascade__(level);
+                }
+            }
+            TimerId& slot = slots_[now_ & SLOT_MASK];
+            while (slot != NO_TIMER){
+                TimerId id = slot;
+                __Unlink__(id);
+                nodes_[id].fired = true;
+                --armed_n_;
+                visit(id, nodes_[id].data);
+            }
+        }
+    }
+
+    // Timers waiting to fire
+    size_t ArmedCount() const noexcept{
+        return armed_n_;
+    }
+
+    void Clear() noexcept{
+        nodes_.clear();
+        free_head_ = NO_TIMER;
+        armed_n_ = 0;
+        for (TimerId& slot : slots_){
+            slot = NO_TIMER;
+        }
+    }
+
+private:
+    static constexpr uint64_t SLOTS_PER_LEVEL = uint64_t(1) << TIMER_WHEEL_SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS_PER_LEVEL - 1;
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    struct Node{
+        uint64_t expires_at = 0;
+        uint64_t data = 0;
+        TimerId prev = NO_TIMER;
+        TimerId next = NO_TIMER; // next node of the slot, or of the free list
+        uint32_t slot = NO_SLOT; // index in slots_, NO_SLOT when not linked
+        bool fired = false;
+    };
+
+    // Slot of a deadline relative to the current tick (expires_at >= now_).
+    uint32_t __SlotFor__(uint64_t expires_at) const noexcept{
+        uint64_t delta = expires_at - now_;
+        for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level){
+            if (delta < (uint64_t(1) << ((level + 1) * TIMER_WHEEL_SLOT_BITS))){
+                return static_cast<uint32_t>(level * SLOTS_PER_LEVEL + ((expires_at >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK));
+            }
+        }
+        // beyond the wheel: park in the farthest slot, the timer is placed again when it cascades
+        uint64_t capped = now_ + (uint64_t(1) << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1;
+        return static_cast<uint32_t>((TIMER_WHEEL_LEVELS - 1) * SLOTS_PER_LEVEL + ((capped >> ((TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK));
+    }
+
+    void __Link__(TimerId id) noexcept{
+        Node& node = nodes_[id];
+        node.slot = __SlotFor__(node.expires_at);
+        node.prev = NO_TIMER;
+        node.next = slots_[node.slot];
+        if (node.next != NO_TIMER){
+            nodes_[node.next].prev = id;
+        }
+        slots_[node.slot] = id;
+    }
+
+    void __Unlink__(TimerId id) noexcept{
+        Node& node = nodes_[id];
+        if (node.prev != NO_TIMER){
+            nodes_[node.prev].next = node.next;
+        } else{
+            slots_[node.slot] = node.next;
+        }
+        if (node.next != NO_TIMER){
+            nodes_[node.next].prev = node.prev;
+        }
+        node.slot = NO_SLOT;
+        node.prev = node.next = NO_TIMER;
+    }
+
+    // Spread the timers of the level's current slot over the finer levels.
+    void __Cascade__(size_t level) noexcept{
+        TimerId& slot = slots_[level * SLOTS_PER_LEVEL + ((now_ >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK)];
+        TimerId id = slot;
+        slot = NO_TIMER;
+        while (id != NO_TIMER){
+            TimerId next = nodes_[id].next;
+            __Link__(id); // expires_at >= now_: a due timer lands in the level 0 slot of this very tick
+            id = next;
+        }
+    }
+
+    const Clock::time_point start_;
+    uint64_t now_ = 0;
+    std::vector<Node> nodes_;
+    TimerId free_head_ = NO_TIMER;
+    size_t armed_n_ = 0;
+    TimerId slots_[TIMER_WHEEL_LEVELS * SLOTS_PER_LEVEL];
+};
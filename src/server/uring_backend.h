@@ -0,0 +1,537 @@
+// This file contains the io_uring implementation of the server's I/O backend (raw syscalls, no liburing)
+#pragma once
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "io_backend.h"
+
+#define URING_ENTRIES 4096 // submission queue size, the completion queue is 4 times bigger
+#define URING_RECV_BUFFERS 1024 // provided receive buffers (power of 2)
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/**
+ * Completion-based backend: a multishot accept, one multishot recv per client fed from a provided buffer ring,
+ * and every send produced during a loop tick submitted together with the next wait in a single io_uring_enter().
+*/
+class UringBackend : public IoBackend{
+public:
+    UringBackend() = default;
+
+    UringBackend(const UringBackend& other) = delete;
+    UringBackend& operator=(const UringBackend& other) = delete;
+
+    ~UringBackend() override{
+        if (ring_fd_ != -1){
+            close(ring_fd_); // cancels everything that is still in flight
+        }
+        if (sqes_ != nullptr){
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ptr_ != nullptr && cq_ring_ptr_ != sq_ring_ptr_){
+            munmap(cq_ring_ptr_, cq_ring_size_);
+        }
+        if (sq_ring_ptr_ != nullptr){
+            munmap(sq_ring_ptr_, sq_ring_size_);
+        }
+        if (buf_ring_ != nullptr){
+            munmap(buf_ring_, URING_RECV_BUFFERS * sizeof(io_uring_buf));
+        }
+        for (Operation* op : free_send_ops_){
+            delete op;
+        }
+        for (Operation* op : live_ops_){
+            delete op;
+        }
+    }
+
+    const char* Name() const noexcept override{
+        return "io_uring";
+    }
+
+    void Init(int listen_socketfd, int wakeup_fd) override{
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        if (ring_fd_ == -1){
+            throw std::runtime_error("io_uring_setup(): "s + std::string(strerror(errno)));
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)){
+            throw std::runtime_error("io_uring: the kernel is too old (IORING_FEAT_EXT_ARG and IORING_FEAT_NODROP are required)"s);
+        }
+        __MapRings__(params);
+        __SetUpBufferRing__();
+
+        Operation* accept_op = __NewOperation__(OperationType::ACCEPT, listen_socketfd);
+        __ArmAccept__(accept_op);
+        if (wakeup_fd != -1){
+            __ArmWakeup__(__NewOperation__(OperationType::WAKEUP, wakeup_fd));
+        }
+    }
+
+    int AddClient(int socketfd) override{
+        if (static_cast<size_t>(socketfd) >= clients_.size()){
+            clients_.resize(socketfd + 1);
+        }
+        ClientOperations& client = clients_[socketfd];
+        client.recv_op = __NewOperation__(OperationType::RECV, socketfd);
+        __ArmRecv__(client.recv_op);
+        return 0;
+    }
+
+    void RemoveClient(int socketfd) override{
+        if (static_cast<size_t>(socketfd) >= clients_.size()){
+            return;
+        }
+        ClientOperations& client = clients_[socketfd];
+        for (Operation* op : {client.recv_op, client.send_op}){
+            if (op == nullptr){
+                continue;
+            }
+            op->orphaned = true; // the completions of an orphaned operation are dropped
+            if (op->armed){
+                __Cancel__(op); // deleted when its final completion arrives
+            } else if (!op->starved){ // a starved operation is deleted by the next Wait()
+                __DeleteOperation__(op);
+            }
+        }
+        client = ClientOperations();
+    }
+
+    void PauseReading(int socketfd) override{
+        if (static_cast<size_t>(socketfd) >= clients_.size() || clients_[socketfd].recv_op == nullptr){
+            return;
+        }
+        Operation* op = clients_[socketfd].recv_op;
+        if (op->paused){
+            return;
+        }
+        op->paused = true;
+        if (op->armed){
+            __Cancel__(op); // the data received before the cancellation is still reported
+        }
+    }
+
+    void ResumeReading(int socketfd) override{
+        if (static_cast<size_t>(socketfd) >= clients_.size() || clients_[socketfd].recv_op == nullptr){
+            return;
+        }
+        Operation* op = clients_[socketfd].recv_op;
+        if (!op->paused){
+            return;
+        }
+        op->paused = false;
+        if (!op->armed && !op->starved){ // otherwise it is re-armed by its final completion or by the next Wait()
+            __ArmRecv__(op);
+        }
+    }
+
+    int Send(int socketfd, OutboundQueue& queue) override{
+        if (queue.Empty() || static_cast<size_t>(socketfd) >= clients_.size()){
+            return 0;
+        }
+        ClientOperations& client = clients_[socketfd];
+        if (client.send_op != nullptr){ // one send per socket in flight: the completion flushes the rest
+            return 0;
+        }
+        Operation* op = __NewSendOperation__(socketfd);
+        SendBatch& batch = *op->batch;
+        size_t iov_n = queue.Gather(batch.iov, batch.pinned, FLUSH_IOV_BATCH);
+        memset(&batch.msg, 0, sizeof(batch.msg));
+        batch.msg.msg_iov = batch.iov;
+        batch.msg.msg_iovlen = iov_n;
+
+        io_uring_sqe* sqe = __GetSqe__();
+        if (sqe == nullptr){
+            __ReleaseSendOperation__(op);
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = socketfd;
+        sqe->addr = reinterpret_cast<__u64>(&batch.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = reinterpret_cast<__u64>(op);
+        client.send_op = op;
+        return 0;
+    }
+
+    int Wait(IoHandler& handler, int timeout_ms) override{
+        std::vector<Operation*> starved_recv_ops;
+        starved_recv_ops.swap(starved_recv_ops_);
+        for (Operation* op : starved_recv_ops){ // ran out of provided buffers or SQEs during the previous tick
+            op->starved = false;
+            if (op->orphaned){
+                __DeleteOperation__(op);
+            } else if (!op->paused){
+                __ArmRecv__(op);
+            }
+        }
+
+        __kernel_timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        io_uring_getevents_arg wait_arg;
+        memset(&wait_arg, 0, sizeof(wait_arg));
+        wait_arg.ts = reinterpret_cast<__u64>(&timeout);
+
+        // Submit everything produced in the previous tick and wait in the same syscall.
+        bool has_completions = __CompletionsReady__() > 0;
+        if (__Enter__(has_completions ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &wait_arg, sizeof(wait_arg)) == -1){
+            if (errno != ETIME && errno != EBUSY){
+                return -1;
+            }
+        }
+        __ReapCompletions__(handler);
+        return 0;
+    }
+
+private:
+    enum class OperationType{
+        ACCEPT = 0,
+        RECV = 1,
+        SEND = 2,
+        WAKEUP = 3
+    };
+
+    struct SendBatch{
+        msghdr msg;
+        iovec iov[FLUSH_IOV_BATCH];
+        SharedPacket pinned[FLUSH_IOV_BATCH]; // keeps the packets alive until the kernel is done with them
+    };
+
+    struct Operation{
+        OperationType type;
+        int socketfd;
+        bool orphaned = false; // its client has been removed, the operation only waits for its final completion
+        bool armed = false; // submitted and not finished yet
+        bool starved = false; // RECV: waits for the next Wait() to be armed again
+        bool paused = false; // RECV: not re-armed until ResumeReading()
+        size_t live_index = 0; // position in live_ops_
+        std::unique_ptr<SendBatch> batch; // SEND only
+    };
+
+    struct ClientOperations{
+        Operation* recv_op = nullptr;
+        Operation* send_op = nullptr;
+    };
+
+    void __MapRings__(const io_uring_params& params){
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap){
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        void* sq_ptr = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED){
+            throw std::runtime_error("io_uring: mmap(): "s + std::string(strerror(errno)));
+        }
+        sq_ring_ptr_ = static_cast<char*>(sq_ptr);
+        if (single_mmap){
+            cq_ring_ptr_ = sq_ring_ptr_;
+        } else{
+            void* cq_ptr = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED){
+                throw std::runtime_error("io_uring: mmap(): "s + std::string(strerror(errno)));
+            }
+            cq_ring_ptr_ = static_cast<char*>(cq_ptr);
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED){
+            throw std::runtime_error("io_uring: mmap(): "s + std::string(strerror(errno)));
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes_ptr);
+
+        sq_head_ = reinterpret_cast<unsigned*>(sq_ring_ptr_ + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ptr_ + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ptr_ + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ptr_ + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ptr_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ptr_ + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ptr_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ptr_ + params.cq_off.cqes);
+        local_sq_tail_ = *sq_tail_;
+    }
+
+    void __SetUpBufferRing__(){
+        void* ring_ptr = mmap(nullptr, URING_RECV_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring_ptr == MAP_FAILED){
+            throw std::runtime_error("io_uring: mmap(): "s + std::string(strerror(errno)));
+        }
+        buf_ring_ = static_cast<io_uring_buf_ring*>(ring_ptr);
+
+        io_uring_buf_reg buf_reg;
+        memset(&buf_reg, 0, sizeof(buf_reg));
+        buf_reg.ring_addr = reinterpret_cast<__u64>(buf_ring_);
+        buf_reg.ring_entries = URING_RECV_BUFFERS;
+        buf_reg.bgid = URING_BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &buf_reg, 1) == -1){
+            throw std::runtime_error("io_uring_register(IORING_REGISTER_PBUF_RING): "s + std::string(strerror(errno)));
+        }
+
+        recv_buffers_.resize(static_cast<size_t>(URING_RECV_BUFFERS) * URING_RECV_BUFFER_SIZE);
+        for (unsigned short buffer_id = 0; buffer_id < URING_RECV_BUFFERS; ++buffer_id){
+            __RecycleBuffer__(buffer_id);
+        }
+    }
+
+    // Give a receive buffer back to the kernel.
+    void __RecycleBuffer__(unsigned short buffer_id) noexcept{
+        // The ring is indexed directly: in C++ the header's flexible bufs[] member is not laid out at offset 0 of the union.
+        io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(buf_ring_) + (buf_ring_tail_ & (URING_RECV_BUFFERS - 1));
+        buf->addr = reinterpret_cast<__u64>(recv_buffers_.data() + static_cast<size_t>(buffer_id) * URING_RECV_BUFFER_SIZE);
+        buf->len = URING_RECV_BUFFER_SIZE;
+        buf->bid = buffer_id;
+        ++buf_ring_tail_;
+        __atomic_store_n(&buf_ring_->tail, buf_ring_tail_, __ATOMIC_RELEASE);
+    }
+
+    Operation* __NewOperation__(OperationType type, int socketfd){
+        Operation* op = new Operation();
+        op->type = type;
+        op->socketfd = socketfd;
+        op->live_index = live_ops_.size();
+        live_ops_.push_back(op);
+        return op;
+    }
+
+    void __DeleteOperation__(Operation* op){
+        live_ops_[op->live_index] = live_ops_.back();
+        live_ops_[op->live_index]->live_index = op->live_index;
+        live_ops_.pop_back();
+        delete op;
+    }
+
+    Operation* __NewSendOperation__(int socketfd){
+        Operation* op;
+        if (free_send_ops_.empty()){
+            op = new Operation();
+            op->batch = std::make_unique<SendBatch>();
+        } else{
+            op = free_send_ops_.back();
+            free_send_ops_.pop_back();
+        }
+        op->type = OperationType::SEND;
+        op->socketfd = socketfd;
+        op->orphaned = false;
+        op->armed = true;
+        return op;
+    }
+
+    void __ReleaseSendOperation__(Operation* op){
+        for (SharedPacket& packet : op->batch->pinned){
+            packet.reset();
+        }
+        free_send_ops_.push_back(op);
+    }
+
+    io_uring_sqe* __GetSqe__(){
+        if (local_sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_){ // full: submit what we have
+            __Enter__(0, 0, nullptr, 0);
+            if (local_sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_){
+                return nullptr;
+            }
+        }
+        unsigned index = local_sq_tail_ & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        ++local_sq_tail_;
+        return sqe;
+    }
+
+    // Publish the prepared SQEs and call io_uring_enter().
+    int __Enter__(unsigned min_complete, unsigned flags, void* arg, size_t arg_size){
+        unsigned to_submit = local_sq_tail_ - *sq_tail_;
+        __atomic_store_n(sq_tail_, local_sq_tail_, __ATOMIC_RELEASE);
+        if (to_submit == 0 && min_complete == 0){
+            return 0;
+        }
+        return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, arg, arg_size));
+    }
+
+    unsigned __CompletionsReady__() const noexcept{
+        return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+    }
+
+    void __ArmAccept__(Operation* op){
+        io_uring_sqe* sqe = __GetSqe__();
+        if (sqe == nullptr){
+            throw std::runtime_error("io_uring: submission queue is full"s);
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = op->socketfd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = reinterpret_cast<__u64>(op);
+    }
+
+    void __ArmWakeup__(Operation* op){
+        io_uring_sqe* sqe = __GetSqe__();
+        if (sqe == nullptr){
+            throw std::runtime_error("io_uring: submission queue is full"s);
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = op->socketfd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = reinterpret_cast<__u64>(op);
+    }
+
+    void __ArmRecv__(Operation* op){
+        io_uring_sqe* sqe = __GetSqe__();
+        if (sqe == nullptr){ // retry in the next tick
+            __Starve__(op);
+            return;
+        }
+        op->armed = true;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = op->socketfd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = reinterpret_cast<__u64>(op);
+    }
+
+    void __Starve__(Operation* op){
+        op->starved = true;
+        starved_recv_ops_.push_back(op);
+    }
+
+    void __Cancel__(Operation* op){
+        io_uring_sqe* sqe = __GetSqe__();
+        if (sqe == nullptr){
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<__u64>(op);
+        sqe->user_data = 0; // the cancellation's own completion is ignored
+    }
+
+    void __ReapCompletions__(IoHandler& handler){
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)){
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            ++head;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            if (cqe.user_data != 0){
+                __HandleCompletion__(handler, reinterpret_cast<Operation*>(cqe.user_data), cqe.res, cqe.flags);
+            }
+        }
+    }
+
+    void __HandleCompletion__(IoHandler& handler, Operation* op, int result, unsigned cqe_flags){
+        bool more = cqe_flags & IORING_CQE_F_MORE; // a multishot operation stays armed
+        switch (op->type){
+            case OperationType::ACCEPT:
+                if (result >= 0){
+                    handler.OnAccept(result, nullptr);
+                } else if (result != -EAGAIN && result != -ECONNABORTED && result != -EINTR){
+                    LOGGER.LogColorful(LogLevel::ERROR, Color::Red, {"[ConnectionFail] accept(): ", strerror(-result)});
+                }
+                if (!more){
+                    __ArmAccept__(op);
+                }
+                break;
+            case OperationType::WAKEUP:
+                handler.OnWakeup();
+                if (!more){
+                    __ArmWakeup__(op);
+                }
+                break;
+            case OperationType::RECV:
+            {
+                bool has_buffer = cqe_flags & IORING_CQE_F_BUFFER;
+                unsigned short buffer_id = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+                op->armed = more;
+                if (op->orphaned){
+                    if (has_buffer){
+                        __RecycleBuffer__(buffer_id);
+                    }
+                    if (!more){
+                        __DeleteOperation__(op);
+                    }
+                    break;
+                }
+                if (result > 0){
+                    const char* data = recv_buffers_.data() + static_cast<size_t>(buffer_id) * URING_RECV_BUFFER_SIZE;
+                    handler.OnData(op->socketfd, data, result);
+                    __RecycleBuffer__(buffer_id); // the handler has copied the incomplete packet tail
+                    if (!more && !op->orphaned && !op->paused){
+                        __ArmRecv__(op);
+                    }
+                } else if (result == -ENOBUFS){
+                    if (!op->paused){
+                        __Starve__(op);
+                    }
+                } else if (result == -ECANCELED){ // PauseReading()
+                    if (!op->paused){ // resumed before the cancellation completed
+                        __ArmRecv__(op);
+                    }
+                } else{
+                    if (has_buffer){
+                        __RecycleBuffer__(buffer_id);
+                    }
+                    handler.OnPeerClosed(op->socketfd, result == 0 ? 0 : -result);
+                }
+                break;
+            }
+            case OperationType::SEND:
+            {
+                if (!op->orphaned){
+                    clients_[op->socketfd].send_op = nullptr;
+                    if (result >= 0){
+                        handler.OnWritable(op->socketfd, result);
+                    } else{
+                        handler.OnPeerClosed(op->socketfd, -result);
+                    }
+                }
+                __ReleaseSendOperation__(op);
+                break;
+            }
+        }
+    }
+
+    int ring_fd_ = -1;
+    char* sq_ring_ptr_ = nullptr;
+    char* cq_ring_ptr_ = nullptr;
+    size_t sq_ring_size_ = 0, cq_ring_size_ = 0, sqes_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0, sq_entries_ = 0;
+    unsigned local_sq_tail_ = 0; // prepared but not yet published SQEs end here
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    io_uring_buf_ring* buf_ring_ = nullptr;
+    unsigned short buf_ring_tail_ = 0;
+    std::vector<char> recv_buffers_;
+
+    std::vector<ClientOperations> clients_; // indexed by socket fd
+    std::vector<Operation*> live_ops_; // accept, wakeup and recv operations
+    std::vector<Operation*> free_send_ops_;
+    std::vector<Operation*> starved_recv_ops_;
+};